@@ -0,0 +1,30 @@
+/* A fixed block of memory handed out in pieces and given back all at once.
+ *
+ * Big working buffers that only live for one request (the settings JSON, the
+ * sample summary) come from here instead of the heap or the 4K loop stack, so
+ * they can't fragment the heap however long the unit stays up. Take a mark
+ * before allocating and release back to it when done; anything allocated
+ * after the mark is freed together. Allocations are 4 byte aligned.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+  {
+  uint8_t* base;
+  size_t size;
+  size_t used;
+  size_t highWater; //most that has ever been in use at once
+  uint16_t failures; //allocations that didn't fit
+  } arena;
+
+#define ARENA_INIT(buffer) {buffer,sizeof(buffer),0,0,0}
+
+void* arenaAlloc(arena& a, size_t size);
+size_t arenaMark(arena& a);
+void arenaRelease(arena& a, size_t mark);
+
+#endif
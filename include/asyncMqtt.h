@@ -0,0 +1,150 @@
+/* A small MQTT 3.1.1 and 5 client on the same async TCP layer as the web server.
+ *
+ * Nothing here waits on the network. connect() starts the connection and
+ * returns, publish() queues a packet and returns, and the broker's replies are
+ * handled by loop(). Received bytes are buffered by the TCP callbacks and only
+ * parsed in loop(), so the message callback runs in the sketch's own context
+ * where it is allowed to publish, delay, or write settings.
+ *
+ * Up to ASYNC_MQTT_WINDOW QoS1 publishes can be waiting for their PUBACK at
+ * once, so a report's publishes go out back to back instead of one per round
+ * trip. A publish that is not acknowledged within ASYNC_MQTT_ACK_TIMEOUT_MS, or
+ * that is lost with the connection, is counted in takeFailures() so the caller
+ * can send it again; the payloads aren't kept for a retransmit.
+ *
+ * With setMqtt5(true) it speaks MQTT 5. Publishes to a topic given in
+ * setTopicAliases() send the topic string once per connection and a two byte
+ * alias after that, as far as the broker's alias limit allows. A publish can
+ * carry a message expiry and correlation data, and the response topic and
+ * correlation data of an incoming message can be read in the callback.
+ */
+#ifndef ASYNC_MQTT_H
+#define ASYNC_MQTT_H
+
+#include <Arduino.h>
+#include <ESPAsyncTCP.h>
+
+#define ASYNC_MQTT_WINDOW 8 //QoS1 publishes that can be waiting for a PUBACK at once
+#define ASYNC_MQTT_RX_SIZE 1024 //received bytes waiting for loop() to parse them
+#define ASYNC_MQTT_PACKET_SIZE 320 //largest incoming packet handed to the callback
+#define ASYNC_MQTT_ACK_TIMEOUT_MS 10000 //a QoS1 publish without a PUBACK by then has failed
+#define ASYNC_MQTT_CONNECT_TIMEOUT_MS 10000 //TCP connect plus CONNACK
+#define ASYNC_MQTT_MAX_ALIASES 32 //topics that can have an alias, one bit each in aliasSent
+#define ASYNC_MQTT_REPLY_TOPIC_SIZE 160 //longest response topic kept for the callback
+#define ASYNC_MQTT_CORRELATION_SIZE 32 //longest correlation data kept for the callback
+
+#define ASYNC_MQTT_DISCONNECTED 0
+#define ASYNC_MQTT_TCP_CONNECTING 1
+#define ASYNC_MQTT_CONNECTING 2 //CONNECT sent, waiting for CONNACK
+#define ASYNC_MQTT_CONNECTED 3
+
+typedef void (*asyncMqttCallback)(char* topic, byte* payload, unsigned int length);
+
+// MQTT 5 publish properties. 3.1.1 doesn't have them, so they are left out then.
+typedef struct
+  {
+  uint32_t expirySeconds; //0 if the message doesn't expire
+  const uint8_t* correlation; //NULL for none
+  uint16_t correlationLength;
+  } asyncMqttProperties;
+
+class asyncMqttClient
+  {
+  public:
+    asyncMqttClient();
+    ~asyncMqttClient();
+
+    void setServer(IPAddress ip, uint16_t port);
+    void setServer(const char* host, uint16_t port);
+    void setCallback(asyncMqttCallback cb) {callback=cb;}
+    void setKeepAlive(uint16_t seconds) {keepAlive=seconds;}
+    bool setBufferSize(uint16_t size);
+    void setMqtt5(bool on) {mqtt5=on;} //takes effect on the next connect()
+    void setSessionExpiry(uint32_t seconds) {sessionExpiry=seconds;} //MQTT 5, how long the broker keeps a session
+    void setTopicAliases(const char* const* list, uint8_t count);
+
+    bool connect(const char* id, const char* user, const char* pass, bool cleanSession=true);
+    void disconnect();
+    bool connected() {return state==ASYNC_MQTT_CONNECTED;}
+    bool connecting() {return state==ASYNC_MQTT_TCP_CONNECTING || state==ASYNC_MQTT_CONNECTING;}
+    int8_t lastError() {return connackCode;}
+
+    bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retain, uint8_t qos=1,
+                 const asyncMqttProperties* props=NULL);
+    bool canPublish(); //true if there is room in the window and the TCP buffer
+    bool subscribe(const char* topic, uint8_t qos=0);
+    uint8_t inFlight() {return windowCount;}
+    uint16_t takeFailures(); //QoS1 publishes lost since the last call
+    bool usingMqtt5() {return connected() && mqtt5;}
+
+    // Only meaningful inside the callback, for the message being delivered
+    const char* responseTopic() {return replyTopic[0]?replyTopic:NULL;}
+    const uint8_t* correlationData(uint16_t& length) {length=correlationLength; return correlationLength?correlation:NULL;}
+
+    void loop();
+    bool flush(uint32_t timeoutMs); //wait until every QoS1 publish is acknowledged
+
+  private:
+    AsyncClient tcp;
+    IPAddress serverIp;
+    const char* serverHost=NULL;
+    uint16_t serverPort=1883;
+    asyncMqttCallback callback=NULL;
+    uint16_t keepAlive=15;
+
+    volatile uint8_t state=ASYNC_MQTT_DISCONNECTED;
+    volatile bool tcpUp=false; //set by the TCP callbacks, acted on in loop()
+    volatile bool tcpDown=false;
+    int8_t connackCode=0;
+    uint32_t connectStartMs=0;
+    uint32_t lastSendMs=0;
+    uint32_t pingSentMs=0; //0 if no PINGREQ is outstanding
+    const char* clientId=NULL;
+    const char* username=NULL;
+    const char* password=NULL;
+    bool cleanStart=true; //false to have the broker keep our subscriptions and queued messages
+    bool mqtt5=false;
+    uint32_t sessionExpiry=0;
+
+    const char* const* aliasTopics=NULL; //topics[i] is sent with alias i+1
+    uint8_t aliasCount=0;
+    uint16_t brokerAliasMax=0; //from the CONNACK, 0 if the broker takes no aliases
+    uint32_t aliasSent=0; //bit i is set once the broker has been told what alias i+1 means
+    uint16_t receiveMax=ASYNC_MQTT_WINDOW; //the broker's limit on unacknowledged QoS1 publishes
+    char replyTopic[ASYNC_MQTT_REPLY_TOPIC_SIZE]="";
+    uint8_t correlation[ASYNC_MQTT_CORRELATION_SIZE];
+    uint16_t correlationLength=0;
+
+    uint8_t* txBuffer=NULL;
+    uint16_t txSize=0;
+    uint8_t rxBuffer[ASYNC_MQTT_RX_SIZE];
+    volatile size_t rxLength=0;
+    bool rxOverflow=false;
+    uint8_t packet[ASYNC_MQTT_PACKET_SIZE+1]; //room for the callback to null terminate the payload
+
+    uint16_t nextPacketId=1;
+    struct
+      {
+      uint16_t id;
+      uint32_t sentMs;
+      } window[ASYNC_MQTT_WINDOW];
+    uint8_t windowCount=0;
+    uint16_t failures=0;
+
+    uint16_t packetId();
+    bool send(const uint8_t* buf, size_t len);
+    size_t writeHeader(uint8_t type, size_t remaining);
+    size_t writeVarint(size_t pos, size_t value);
+    uint8_t windowLimit() {return receiveMax<ASYNC_MQTT_WINDOW?receiveMax:ASYNC_MQTT_WINDOW;}
+    uint8_t topicAlias(const char* topic);
+    size_t writeString(size_t pos, const char* text, size_t len);
+    void sendConnect();
+    void sendSimple(uint8_t type);
+    void sendPuback(uint16_t id);
+    void acknowledged(uint16_t id);
+    void dropWindow();
+    void handlePacket(uint8_t header, uint8_t* body, size_t length);
+    void onTcpData(uint8_t* data, size_t len);
+  };
+
+#endif
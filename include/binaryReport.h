@@ -0,0 +1,48 @@
+/* The compact binary report, published on <topicroot>/bin when binaryreport=1.
+ *
+ * Everything a text report sends on a dozen topics fits in one small packed
+ * struct. The first byte is the version, so a decoder can tell which layout it
+ * has; bump BINARY_REPORT_VERSION and only ever append fields. Multi-byte fields
+ * are little endian, the ESP8266's own order. This header is shared with the
+ * decoder in tools/, so it only uses standard headers.
+ */
+#ifndef BINARY_REPORT_H
+#define BINARY_REPORT_H
+
+#include <stdint.h>
+
+#define BINARY_REPORT_VERSION 1
+
+#define BINARY_FLAG_FULL 0x01 //this report was a full sync
+#define BINARY_FLAG_WAKE 0x02 //first report since waking, so wakeCause and wakeGpio are meaningful
+#define BINARY_FLAG_SUMMARY 0x04 //samples, vccMin and vccMax hold a sample summary
+
+#define WAKE_CODE_TIMER 1
+#define WAKE_CODE_CHANGE 2
+#define WAKE_CODE_RESET 3
+#define WAKE_CODE_POWER 4
+#define WAKE_CODE_RESTART 5
+
+typedef struct __attribute__((packed))
+  {
+  uint8_t version; //BINARY_REPORT_VERSION
+  uint8_t flags; //BINARY_FLAG_*
+  uint16_t activeMask; //one bit per port index, see gpioMap.h
+  uint16_t levels; //port levels from one snapshot, same bits
+  uint32_t snapshotMillis; //when the ports were read, milliseconds since waking
+  uint32_t clockSeconds; //estimated seconds since power up when the ports were read
+  int8_t rssi; //dBm, 0 if sent through ESP-NOW
+  uint16_t vccMilliVolts;
+  uint32_t freeHeap;
+  uint32_t maxFreeBlockSize;
+  uint8_t heapFragmentation; //percent
+  uint8_t wakeCause; //WAKE_CODE_*
+  int8_t wakeGpio; //-1 if not known
+  uint8_t samples; //samples in the summary
+  uint16_t vccMin; //millivolts, over the summary
+  uint16_t vccMax;
+  } binaryReport;
+
+static_assert(sizeof(binaryReport)==33, "the binary report layout must not change without a version bump");
+
+#endif
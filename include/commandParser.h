@@ -0,0 +1,62 @@
+/* Parser for "name=value" configuration commands.
+ *
+ * Commands arrive from the serial port and from MQTT. The parser never copies
+ * or changes the text it is given. It returns views (a pointer and a length)
+ * into the original buffer, and the value functions convert a view into a
+ * number or copy it into a settings field, with an error code when the text
+ * won't fit or isn't a number. Nothing here uses the Arduino core, so the same
+ * file can be compiled on a PC to run large batches of commands through it.
+ */
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_COMMAND_SIZE 50 // incoming command names are all smaller than this
+#define FINGERPRINT_BYTES 20 //a SHA-1 certificate fingerprint
+#define MAC_BYTES 6
+#define ESPNOW_KEY_BYTES 16 //an ESP-NOW local master key
+
+typedef struct
+  {
+  const char* text; //not null terminated
+  size_t length;
+  } textView;
+
+typedef struct
+  {
+  textView name;
+  textView value; //empty if there was no "=" or nothing after it
+  } command;
+
+typedef enum
+  {
+  PARSE_OK=0,
+  PARSE_EMPTY, //nothing but whitespace, which means show the settings
+  PARSE_NAME_TOO_LONG,
+  PARSE_UNKNOWN_COMMAND,
+  PARSE_NO_VALUE,
+  PARSE_NOT_A_NUMBER,
+  PARSE_OUT_OF_RANGE,
+  PARSE_VALUE_TOO_LONG,
+  PARSE_BAD_PORT,
+  PARSE_BAD_FINGERPRINT,
+  PARSE_BAD_MAC,
+  PARSE_BAD_HOST,
+  PARSE_BAD_KEY,
+  PARSE_LIST_FULL
+  } parseResult;
+
+parseResult parseCommand(const char* line, size_t length, command& cmd);
+bool nextField(textView& rest, char separator, textView& field);
+bool viewIs(textView view, const char* text);
+parseResult viewToUnsigned(textView view, uint32_t minValue, uint32_t maxValue, uint32_t& result);
+parseResult viewToBool(textView view, bool& result);
+parseResult copyView(textView view, char* dest, size_t destSize);
+bool viewToFingerprint(textView view, uint8_t* bytes);
+bool viewToMac(textView view, uint8_t* bytes);
+bool viewToKey(textView view, uint8_t* bytes);
+const char* parseResultText(parseResult result);
+
+#endif
@@ -0,0 +1,56 @@
+/* The frame a node sends its publishes in over ESP-NOW, and the gateway's
+ * check for frames it has already forwarded.
+ *
+ * Each frame is one publish: a six byte header, the full topic, then the
+ * payload, in at most ESPNOW_MAX_FRAME bytes. The header is
+ *   magic, version, sequence (two bytes, little endian), flags, topic length
+ * A node sends a frame again with the same sequence number when the gateway
+ * didn't acknowledge it, so the gateway forwards a sequence number only once
+ * per node. Nothing here uses the Arduino core, so the simulation in tools/
+ * runs the same code as the firmware.
+ */
+#ifndef ESPNOW_FRAME_H
+#define ESPNOW_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ESPNOW_MAX_FRAME 250 //the most ESP-NOW will send at once
+#define ESPNOW_HEADER_SIZE 6
+#define ESPNOW_FRAME_MAGIC 0xE5
+#define ESPNOW_FRAME_VERSION 1
+#define ESPNOW_FLAG_RETAIN 0x01
+#define ESPNOW_MAC_BYTES 6
+#define ESPNOW_SEND_TRIES 3 //sends of a frame the gateway hasn't acknowledged
+#define ESPNOW_SEND_TIMEOUT_MS 20 //how long to wait for the acknowledgement of each one
+#define ESPNOW_GATEWAY_PEERS 16 //nodes a gateway remembers the last sequence number of
+
+typedef struct
+  {
+  uint16_t sequence;
+  bool retain;
+  char topic[ESPNOW_MAX_FRAME-ESPNOW_HEADER_SIZE+1]; //null terminated
+  const uint8_t* payload; //points into the frame it was decoded from
+  size_t length;
+  } espNowMessage;
+
+typedef struct
+  {
+  uint8_t mac[ESPNOW_MAC_BYTES];
+  uint16_t sequence; //the last one forwarded
+  uint32_t heard; //espNowSeen.clock when it was, for replacing the oldest
+  } espNowPeer;
+
+typedef struct
+  {
+  espNowPeer peers[ESPNOW_GATEWAY_PEERS];
+  uint8_t count;
+  uint32_t clock; //counts frames
+  } espNowSeen;
+
+size_t espNowEncode(uint8_t* frame, size_t size, uint16_t sequence, bool retain,
+                    const char* topic, const uint8_t* payload, size_t length);
+bool espNowDecode(const uint8_t* frame, size_t length, espNowMessage& msg);
+bool espNowIsNew(espNowSeen& seen, const uint8_t* mac, uint16_t sequence);
+
+#endif
@@ -0,0 +1,68 @@
+/* What each ESP8266 GPIO that can be monitored is able to do.
+ *
+ * GPIO 6-11 are wired to the flash chip, so the usable pins are 0-5 and 12-16,
+ * which map to the eleven entries in settings.ports[]. Everything here is
+ * constexpr, so a check on a pin number that is known at compile time costs
+ * nothing and a wrong table fails the build instead of a unit in the field.
+ */
+#ifndef GPIO_MAP_H
+#define GPIO_MAP_H
+
+#include <stdint.h>
+
+#define GPIO_PORT_COUNT 11
+
+#define GPIO_CAN_PULLUP 0x01 //has an internal pullup
+#define GPIO_BOOT_HIGH  0x02 //must be high at boot or the ESP won't start normally
+#define GPIO_BOOT_LOW   0x04 //must be low at boot
+#define GPIO_IS_TX      0x08 //serial transmit
+#define GPIO_IS_RX      0x10 //serial receive
+#define GPIO_IS_RTC     0x20 //GPIO16, in the RTC block: no pullup or interrupts, but wakes from deep sleep
+
+// In port index order
+constexpr uint8_t gpioCapabilities[GPIO_PORT_COUNT]=
+  {
+  GPIO_CAN_PULLUP|GPIO_BOOT_HIGH,            //GPIO0, selects flash boot
+  GPIO_CAN_PULLUP|GPIO_BOOT_HIGH|GPIO_IS_TX, //GPIO1
+  GPIO_CAN_PULLUP|GPIO_BOOT_HIGH,            //GPIO2
+  GPIO_CAN_PULLUP|GPIO_IS_RX,                //GPIO3
+  GPIO_CAN_PULLUP,                           //GPIO4
+  GPIO_CAN_PULLUP,                           //GPIO5
+  GPIO_CAN_PULLUP,                           //GPIO12
+  GPIO_CAN_PULLUP,                           //GPIO13
+  GPIO_CAN_PULLUP,                           //GPIO14
+  GPIO_BOOT_LOW,                             //GPIO15, held low by the board
+  GPIO_IS_RTC,                               //GPIO16
+  };
+
+// Accept a port number, and return the index into the settings.ports[] for that port
+// Only works for ports 0-5 and 12-16.  Returns -1 otherwise.
+constexpr int8_t portIndex(int8_t portNumber)
+  {
+  return (portNumber<0 || portNumber>16 || (portNumber>5 && portNumber<12))?-1
+         :portNumber<=5?portNumber
+         :portNumber-6;
+  }
+
+// Accept an index into the ports[] array, and return the GPIO number for that port
+// Index must be 0-10. This function is the opposite of portIndex()
+constexpr int8_t indexPort(uint8_t index)
+  {
+  return index>=GPIO_PORT_COUNT?-1
+         :index<=5?index
+         :index+6;
+  }
+
+// The GPIO_* flags for a port number, or 0 if it can't be used
+constexpr uint8_t gpioFlags(int8_t portNumber)
+  {
+  return portIndex(portNumber)<0?0:gpioCapabilities[portIndex(portNumber)];
+  }
+
+static_assert(portIndex(16)==10 && indexPort(10)==16, "GPIO16 must be the last port");
+static_assert(portIndex(8)<0 && indexPort(GPIO_PORT_COUNT)<0, "flash pins must not map to a port");
+static_assert(indexPort(portIndex(12))==12 && portIndex(indexPort(5))==5, "portIndex and indexPort must be opposites");
+static_assert(gpioFlags(1)&GPIO_IS_TX && gpioFlags(3)&GPIO_IS_RX, "TX and RX are GPIO1 and GPIO3");
+static_assert(!(gpioFlags(16)&GPIO_CAN_PULLUP), "GPIO16 has no pullup");
+
+#endif
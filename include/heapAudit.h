@@ -0,0 +1,67 @@
+/* Heap allocation counts per subsystem, for finding who churns the heap.
+ *
+ * Only built when HEAP_AUDIT is defined (see the esp01_1m_heapaudit environment
+ * in platformio.ini). That build wraps malloc, calloc, realloc and free at link
+ * time and counts each call against whichever subsystem is running, along with
+ * the bytes asked for, the largest single request, and the most heap that was
+ * in use while that subsystem was allocating (its high-water mark). Code marks
+ * itself with AUDIT_SUBSYSTEM() at the top of a function; the mark lasts until
+ * the function returns. In a normal build the macro is empty and costs nothing.
+ */
+#ifndef HEAP_AUDIT_H
+#define HEAP_AUDIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+  {
+  SUBSYSTEM_OTHER=0, //the core, the SDK, and anything not marked
+  SUBSYSTEM_WEB,
+  SUBSYSTEM_MQTT,
+  SUBSYSTEM_SERIAL,
+  SUBSYSTEM_SETTINGS,
+  SUBSYSTEM_NETWORK,
+  SUBSYSTEM_COUNT
+  } heapSubsystem;
+
+typedef struct
+  {
+  uint32_t allocs; //malloc, calloc, and realloc of a NULL pointer
+  uint32_t reallocs;
+  uint32_t frees;
+  uint32_t failures; //allocations that returned NULL
+  uint32_t bytes; //total bytes asked for
+  uint32_t largest; //biggest single request
+  uint32_t highWater; //most heap in use just after one of this subsystem's allocations
+  } heapCounts;
+
+#ifdef HEAP_AUDIT
+
+extern heapSubsystem currentSubsystem;
+extern heapCounts heapAudit[SUBSYSTEM_COUNT];
+
+// Sets the current subsystem for as long as it is in scope
+class heapAuditScope
+  {
+  public:
+    heapAuditScope(heapSubsystem s) : previous(currentSubsystem) {currentSubsystem=s;}
+    ~heapAuditScope() {currentSubsystem=previous;}
+  private:
+    heapSubsystem previous;
+  };
+
+#define AUDIT_SUBSYSTEM(s) heapAuditScope auditScope(s)
+
+const char* subsystemName(heapSubsystem s);
+void printHeapAudit();
+int heapAuditJson(char* buf, size_t size);
+void clearHeapAudit();
+
+#else
+
+#define AUDIT_SUBSYSTEM(s)
+
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+/* Fixed-bucket latency histograms for the places that can hold up loop().
+ *
+ * Each histogram counts how long one kind of work took, in power-of-two
+ * buckets starting at 64us, so recording a time is two micros() calls and a
+ * count-leading-zeros. PROFILE() at the top of a function or block times it
+ * until the end of that scope. The histograms are always on; they are read
+ * with the latency command over MQTT or from /api/latency.
+ */
+#ifndef LATENCY_PROFILER_H
+#define LATENCY_PROFILER_H
+
+#include <Arduino.h>
+
+#define LATENCY_BUCKETS 16 //<64us, <128us, ... <2.1s, and everything longer
+#define LATENCY_FIRST_BUCKET_SHIFT 6 //the first bucket ends at 1<<6 microseconds
+
+#define PROFILE_LOOP 0 //the work done in one loop(), not counting the idle time
+#define PROFILE_MQTT 1 //mqttClient.loop(), including the commands it delivers
+#define PROFILE_MDNS 2
+#define PROFILE_WEB 3 //web page and form handlers
+#define PROFILE_SERIAL 4 //checkForCommand()
+#define PROFILE_REPORT 5
+#define PROFILE_COUNT 6
+
+typedef struct
+  {
+  uint32_t count;
+  uint32_t maxUs;
+  uint64_t totalUs;
+  uint32_t buckets[LATENCY_BUCKETS];
+  } latencyHistogram;
+
+void recordLatency(uint8_t probe, uint32_t elapsedUs);
+int latencyJson(char* buf, size_t size);
+
+// Records the time from construction to the end of the scope
+class latencyScope
+  {
+  public:
+    latencyScope(uint8_t p) : probe(p), start(micros()) {}
+    ~latencyScope() {recordLatency(probe,micros()-start);}
+  private:
+    uint8_t probe;
+    uint32_t start;
+  };
+
+#define PROFILE(p) latencyScope latency(p)
+
+#endif
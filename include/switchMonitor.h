@@ -5,8 +5,16 @@
 #define SSID_SIZE 50
 #define PASSWORD_SIZE 50
 #define ADDRESS_SIZE 30
+#define TLS_FINGERPRINT_SIZE 60 //20 bytes in hex, with room for a separator between each
+#define BACKUP_BROKER_COUNT 2 //brokers to fail over to, broker2 and broker3
+#define MAX_BROKERS (1+BACKUP_BROKER_COUNT)
+#define BROKER_ENTRY_SIZE (ADDRESS_SIZE+6) //host:port
+#define MAC_TEXT_SIZE 18 //aa:bb:cc:dd:ee:ff
+#define ESPNOW_KEY_SIZE 48 //16 bytes in hex, with room for a separator between each
 #define USERNAME_SIZE 50
-#define MAX_COMMAND_SIZE 50 // incoming command names are all smaller than this
+#define SERIAL_LINE_SIZE 200 // longest command line accepted from the serial port, including the value
+#define SERIAL_RX_BUFFER_SIZE 1024 // UART receive buffer, big enough for a pasted configuration script
+#define SERIAL_CHUNK_SIZE 64 // bytes taken from the UART buffer at a time
 #define MQTT_CLIENTID_SIZE 25
 #define MQTT_TOPIC_SIZE 150
 #define MQTT_TOPIC_SUFFIX_SIZE 15
@@ -18,20 +26,46 @@
 #define MQTT_TOPIC_FREE_HEAP "freeHeap"
 #define MQTT_TOPIC_HEAP_FRAGMENTATION "heapFrag"
 #define MQTT_TOPIC_MAX_FREE_BLOCK_SIZE "maxBlockSize"
+#define MQTT_TOPIC_WAKE_CAUSE "wakeCause"
+#define MQTT_TOPIC_WAKE_PORT "wakePort"
+#define MQTT_TOPIC_SUMMARY "summary"
+#define MQTT_TOPIC_PORT_STATE "ports"
+#define MQTT_TOPIC_BINARY_REPORT "bin"
 #define MQTT_CLIENT_ID_ROOT "GenericMonitor"
 #define MQTT_TOPIC_COMMAND_REQUEST "command"
+
+#define TOPIC_STATUS 0 //index of each topic in topics[], one more than its MQTT 5 alias
+#define TOPIC_PORT_STATE 1
+#define TOPIC_WAKE_CAUSE 2
+#define TOPIC_WAKE_PORT 3
+#define TOPIC_SUMMARY 4
+#define TOPIC_RSSI 5
+#define TOPIC_BATTERY 6
+#define TOPIC_FREE_HEAP 7
+#define TOPIC_HEAP_FRAGMENTATION 8
+#define TOPIC_MAX_FREE_BLOCK_SIZE 9
+#define TOPIC_BINARY_REPORT 10
+#define TOPIC_COMMAND 11
+#define TOPIC_COUNT 12
 #define MQTT_PAYLOAD_SETTINGS_COMMAND "settings" //show all user accessable settings
 #define MQTT_PAYLOAD_RESET_PULSE_COMMAND "resetPulseCounter" //reset the pulse counter to zero
 #define MQTT_PAYLOAD_REBOOT_COMMAND "reboot" //reboot the controller
 #define MQTT_PAYLOAD_VERSION_COMMAND "version" //show the version number
 #define MQTT_PAYLOAD_STATUS_COMMAND "status" //show the most recent flow values
+#define MQTT_PAYLOAD_MEMSTATS_COMMAND "memstats" //show heap use, and allocations per subsystem in a heap audit build
+#define MQTT_PAYLOAD_LATENCY_COMMAND "latency" //show the loop, network, web, serial and report latency histograms
 #define MQTT_PAYLOAD_ARMED_STATUS "armed" //device has not triggered
 #define MQTT_PAYLOAD_TRIPPED_STATUS "tripped" //device has triggered
 #define MQTT_MAX_INCOMING_PAYLOAD_SIZE 100 //incoming MQTT message should never be this big
 #define PORT_COUNT 11 //Eleven different ports can be configured
-#define JSON_STATUS_SIZE SSID_SIZE+PASSWORD_SIZE+USERNAME_SIZE+MQTT_TOPIC_SIZE+ADDRESS_SIZE+((MQTT_TOPIC_SUFFIX_SIZE*2)*PORT_COUNT)+250 //+250 for associated field names, etc
+#define JSON_SETTINGS_STRINGS_SIZE (SSID_SIZE+PASSWORD_SIZE*2+USERNAME_SIZE+MQTT_TOPIC_SIZE+MQTT_CLIENTID_SIZE+ADDRESS_SIZE*7 \
+        +BACKUP_BROKER_COUNT*BROKER_ENTRY_SIZE+TLS_FINGERPRINT_SIZE+MAC_TEXT_SIZE+ESPNOW_KEY_SIZE+16) //every text setting at its longest, and the IP address
+#define JSON_SETTINGS_FIELDS_SIZE 1120 //the field names, quotes and numbers around them in the settings JSON
+#define JSON_PORT_SIZE (MQTT_TOPIC_SUFFIX_SIZE*2+80) //one port in the settings JSON
+#define JSON_STATUS_SIZE (JSON_SETTINGS_STRINGS_SIZE+JSON_SETTINGS_FIELDS_SIZE+PORT_COUNT*JSON_PORT_SIZE)
 #define PUBLISH_DELAY 400 //milliseconds to wait after publishing to MQTT to allow transaction to finish
 #define WIFI_TIMEOUT_SECONDS 30 // give up on wifi after this long
+#define WIFI_FAST_TIMEOUT_SECONDS 5 // give up on the cached lease and channel after this long and do it the slow way
 #define FULL_BATTERY_COUNT 3686 //raw A0 count with a freshly charged 18650 lithium battery 
 #define FULL_BATTERY_VOLTS 412 //4.12 volts for a fully charged 18650 lithium battery 
 #define ONE_HOUR 3600000 //milliseconds
@@ -45,25 +79,197 @@
 #define MQTT_DEFAULT_TOPIC_SUFFIX_LOW "low" //suffix if not supplied
 #define TX_PIN 1 //gpio1
 #define RX_PIN 3 //gpio3
+#define SETTINGS_VERSION 17 //bump when fields are appended to the settings struct, see upgradeSettings()
+#define DEFAULT_FULL_SYNC_INTERVAL 10 //in change-only mode, publish everything every this many reports
+#define DEFAULT_RSSI_DEADBAND 3 //dBm of RSSI change needed before it is published again
+#define DEFAULT_VCC_DEADBAND 20 //millivolts of battery change needed before it is published again
+#define DEFAULT_HEAP_DEADBAND 512 //bytes of freeHeap or maxBlockSize change needed before they are published again
+#define DEFAULT_FRAG_DEADBAND 5 //percent of heap fragmentation change needed before it is published again
+#define CACHE_BIT_RSSI (1<<PORT_COUNT) //bits in publishCache.validMask, after the one-per-port bits
+#define CACHE_BIT_VCC (1<<(PORT_COUNT+1))
+#define CACHE_BIT_FREE_HEAP (1<<(PORT_COUNT+2))
+#define CACHE_BIT_HEAP_FRAGMENTATION (1<<(PORT_COUNT+3))
+#define CACHE_BIT_MAX_FREE_BLOCK_SIZE (1<<(PORT_COUNT+4))
+#define NO_WAKE_PORT -1 //settings.wakePort when no port is wired to the wake circuit
+#define WAKE_CAUSE_TIMER "timer" //reportInterval ran out
+#define WAKE_CAUSE_CHANGE "change" //a port changed while we were asleep
+#define WAKE_CAUSE_RESET "reset" //reset pin while awake
+#define WAKE_CAUSE_POWER "power" //power was applied
+#define WAKE_CAUSE_RESTART "restart" //software restart, watchdog, or crash
+#define DEFAULT_SAMPLES_PER_REPORT 1 //wakes per reportInterval, only the last one turns on WiFi and reports
+#define MAX_SAMPLES_PER_REPORT 60 //keeps the time between samples reasonable
+#define SUMMARY_SIZE 512 //JSON summary of the samples taken between reports
+#define REQUEST_ARENA_SIZE (JSON_STATUS_SIZE+SUMMARY_SIZE+16) //the settings JSON and the summary can both be in use during a status command
+#define WEB_MESSAGE_SIZE 40
+#define PORT_STATE_SIZE 200 //JSON of every active port's level from one snapshot
+#define MEMSTATS_SIZE 1024 //memstats JSON, mostly the per-subsystem counts in a heap audit build
+#define LATENCY_JSON_SIZE 1400 //all of the latency histograms as JSON
+#define ASYNC_MQTT_RETRY_MS 1000 //how often to try connecting the async MQTT client
+#define REPORT_RETRY_MS 50 //how soon to try reporting again while WiFi or the async client connects
+#define BROKER_CONNECT_TIMEOUT_MS 3000 //give up on a broker after this, and fail over to the next
+#define BROKER_BACKOFF_SECONDS 60 //leave a broker alone this long after it fails, doubling with each failure in a row
+#define BROKER_BACKOFF_MAX_SHIFT 10 //up to about 17 hours
+#define BROKER_UNMEASURED_MS 5000 //connect time assumed for a broker that hasn't connected yet
+#define BROKER_SWITCH_PERCENT 75 //another broker must connect this much quicker than the current one to switch
+#define COMMAND_DRAIN_MS 1000 //after connecting, how long the broker gets to deliver commands it kept for us
+#define MQTT5_SESSION_EXPIRY_S 604800 //a week, how long an MQTT 5 broker keeps the session of a device that stopped waking up
+#define MQTT5_REPLY_EXPIRY_S 300 //command replies nobody picked up by then are dropped
+#define RADIO_RESTART_MICROS 1000 //deep sleep just long enough to reboot with the radio on
+#define DEFAULT_MAX_SLEEP 10800 //seconds, longer sleeps are chained. The chip can manage about 3.5 hours.
+#define MIN_MAX_SLEEP 60
+#define DEFAULT_TIME_SERVER "pool.ntp.org"
+#define SNTP_VALID_AFTER 1700000000 //the clock reads less than this until SNTP has set it
+#define SNTP_WAIT_MS 2000 //how long a slotted wake stays up for the time before sleeping without it
+#define DRIFT_MIN_SLEEP_MS 300000 //less sleep than this since the last sync is too little to measure the drift on
+#define MAX_DRIFT_PPM 100000 //a measurement off by more than 10% is from a wake that wasn't accounted for
+#define ESPNOW_MAX_CHANNEL 14 //highest WiFi channel for espnowchannel
+#define DEFAULT_AWAKE_BUDGET 20 //seconds a wake nobody is watching gets to report before giving up
+#define MAX_AWAKE_BUDGET 3600
+#define DEFAULT_AP_AFTER_FAILURES 5 //give-ups in a row before such a wake opens AP mode
+#define PHASE_STARTING 0 //where a wake has got to, each with its own share of the awake budget
+#define PHASE_WIFI 1 //finding and joining the access point
+#define PHASE_DHCP 2 //associated, waiting for an address
+#define PHASE_BROKER 3
+#define PHASE_PUBLISH 4
+#define PHASE_COUNT 5
+#define WIFI_PHASE_BUDGET_MS 10000 //long enough for the cached channel to fail and a scan to work
+#define DHCP_PHASE_BUDGET_MS 5000
+#define BROKER_PHASE_BUDGET_MS 10000 //a connect timeout for each broker, and a retry
+#define PUBLISH_PHASE_BUDGET_MS 5000
+#define ESPNOW_QUEUE_SIZE 8 //frames the gateway can hold for forwarding, one less than this at once
+#define ESPNOW_NODE_COUNT 6 //nodes a gateway can be paired with, the most encrypted peers the SDK allows with AP mode on
+#define DEFAULT_RF_CAL_INTERVAL 21600 //seconds between full RF calibrations on wakes that use the radio
+#define DEFAULT_CACHE_TTL 3600 //seconds to reuse a cached DHCP lease, access point channel and broker address
+#ifdef ESPNOW_GATEWAY
+#define TASK_COUNT 7 //tasks run by the scheduler in loop()
+#else
+#define TASK_COUNT 6
+#endif
+#define TASK_NETWORK 0 //index of each task in the table
+#define TASK_SERIAL 1
+#define TASK_MDNS 2
+#define TASK_REPORT 3
+#define TASK_IDLE 4
+#define TASK_SLEEP 5
+#define TASK_GATEWAY 6 //only in a gateway build
+#define NETWORK_TASK_MS 20 //how often to service the WiFi and MQTT connections
+#define MDNS_TASK_MS 50 //how often to service the MDNS responder
+#define IDLE_TASK_MS 500 //how often to check whether the radio can be put in light sleep
+#define SLEEP_TASK_MS 250 //how often to check whether it's time to go to sleep
+#define LIGHT_SLEEP_NETWORK_TASK_MS 100 //slower task periods while idling in light sleep
+#define LIGHT_SLEEP_MDNS_TASK_MS 200
+#define LIGHT_SLEEP_MAX_IDLE_MS 100 //longest loop() will idle in light sleep
+#define LIGHT_SLEEP_LISTEN_INTERVAL 3 //wake for every this many DTIM beacons in light sleep
+#define ACTIVE_HOLD_MS 20000 //stay out of light sleep this long after a web request, command or keystroke
+#define AP_MODE_TX_POWER_DBM 12 //lower transmit power in AP mode, configuration is done up close
+#define NETWORK_TASK_BUDGET_US 20000 //expected longest run of each task, longer runs are counted as overruns
+#define SERIAL_TASK_BUDGET_US 20000
+#define MDNS_TASK_BUDGET_US 5000
+#define REPORT_TASK_BUDGET_US 2000000
+#define SLEEP_TASK_BUDGET_US 1000
+#define IDLE_TASK_BUDGET_US 2000
+#define GATEWAY_TASK_BUDGET_US 100000 //a few publishes
 
 void showSettings();
-String getConfigCommand();
-bool processCommand(String cmd);
+parseResult processCommand(const char* line, size_t length);
 void checkForCommand();
 float read_pressure();
-bool report();
-boolean publish(char* topic, const char* reading, boolean retain);
+bool report(bool forceAll=false);
+bool reportBinary();
+uint8_t wakeCauseCode();
+boolean publish(const char* topic, const char* reading, boolean retain);
+boolean publishBytes(const char* topic, const uint8_t* payload, unsigned int length, boolean retain);
+boolean publishAsync(const char* topic, const uint8_t* payload, unsigned int length, boolean retain,
+                     const asyncMqttProperties* props=NULL);
+void checkAsyncFailures();
+boolean publishEspNow(const char* topic, const uint8_t* payload, unsigned int length, boolean retain);
+uint8_t espNowChannel();
+bool useEspNow();
+bool startEspNow();
+void stopEspNow();
+void espNowSent(uint8_t* mac, uint8_t status);
+#ifdef ESPNOW_GATEWAY
+void startEspNowGateway();
+void pairEspNowNodes();
+int8_t findEspNowNode(const uint8_t* mac);
+bool espNowPaired(const uint8_t* mac);
+bool espNowTopicAllowed(const char* root, const char* topic);
+void espNowReceived(uint8_t* mac, uint8_t* data, uint8_t length);
+bool espNowQueued();
+void gatewayTask();
+#endif
 void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) ;
 void setup_wifi();
+void startWiFi();
+bool serviceWiFi();
 void connectToWiFi();
+void initServer();
+void startMdns();
+void startAPMode();
 void reconnectToBroker();
-void showSub(char* topic, bool subgood);
+void connectAsync();
+parseResult checkBrokerEntry(textView entry);
+bool checkBackupBroker(const char* entry);
+bool brokerAddress(uint8_t n, char* host, size_t size, uint16_t& port);
+int8_t chooseBroker();
+bool selectBroker(IPAddress& ip, bool& resolved);
+void brokerConnected(uint8_t n, uint32_t ms);
+void brokerFailed(uint8_t n);
+void showBrokerHealth();
+void prepareTls();
+void saveTlsSession(uint32_t handshakeMs);
+bool usingAsyncMqtt();
+void serviceAsyncMqtt();
+bool commandsDrained();
+void restartAfterCommand();
+void showSub(const char* topic, bool subgood);
 void initializeSettings();
+void dropStaleCaches();
 boolean saveSettings();
 void setup();
 void loop();
-void incomingSerialData();
+void finishSerialLine();
+int settingsJson(char* buf, size_t size);
+int memStatsJson(char* buf, size_t size);
 char* generateMqttClientId(char* mqttId);
+bool upgradeSettings();
+void loadRtcState();
+void saveRtcState();
+uint16_t readPortLevels();
+void rebuildActivePorts();
+void rebuildTopics();
+void showPortWarnings(uint8_t gpio, bool usePullup);
+void latchWakeState();
+void takeSample(uint16_t levels);
+ulong sampleIntervalSeconds();
+void goToSleep(uint64_t sleepMicros, RFMode rfMode);
+void sleepUntilNextWake();
+uint64_t sleepSegmentMicros();
+void continueSleep();
+bool clockSynced();
+void updateClock();
+uint64_t estimatedEpochMs();
+uint64_t slottedSleepMicros(uint32_t periodSeconds);
+bool unattendedWake();
+void enterPhase(uint8_t phase);
+void checkAwakeBudget();
+void giveUpOnWake();
+void wakeSucceeded();
+uint32_t clockSeconds();
+RFMode nextWakeRfMode(bool radioNeeded);
+void initNetworkSettings();
+bool configureAddress();
+void cacheConnection();
+void clearNetworkCache();
+bool resolveBroker(uint8_t n, const char* host, IPAddress& brokerIp);
+void networkTask();
+void mdnsTask();
+bool serialReady();
+void serialTask();
+void reportTask();
+void sleepTask();
+void idleTask();
+void noteActivity();
 
 //MQTT status for reference only
 // MQTT_CONNECTION_TIMEOUT     -4
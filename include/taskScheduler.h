@@ -0,0 +1,38 @@
+/* A small cooperative scheduler for the work done in loop() while awake.
+ *
+ * Each task has a period, an optional readiness check, and a run time budget.
+ * Tasks are checked in the order they appear in the table, so higher priority
+ * ones go first. A task runs when its period has passed or when its ready()
+ * function says there is something waiting. When nothing is due, runTasks()
+ * returns how long it is until something will be, so loop() can idle the CPU
+ * instead of spinning.
+ */
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <Arduino.h>
+
+#define MAX_IDLE_MS 10 //longest loop() will normally idle, so ready() checks still happen often
+
+typedef void (*taskRunFunction)();
+typedef bool (*taskReadyFunction)(); //returns true if the task has work waiting
+
+typedef struct
+  {
+  const char* name;
+  taskRunFunction run;
+  taskReadyFunction ready; //NULL if the task only runs on its period
+  uint32_t periodMs; //0 if the task only runs when ready
+  uint32_t budgetUs; //runs longer than this are counted as overruns
+  uint32_t nextRunMs; //millis() when the task is next due
+  uint32_t runs; //number of times the task has run
+  uint32_t overruns; //number of runs that went over budget
+  uint32_t maxUs; //longest run
+  uint64_t totalUs; //total time spent running
+  } task;
+
+uint32_t runTasks(task* tasks, uint8_t count, uint32_t maxIdleMs=MAX_IDLE_MS);
+void scheduleNow(task& t);
+void printTaskStats(task* tasks, uint8_t count);
+
+#endif
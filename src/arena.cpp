@@ -0,0 +1,29 @@
+#include "arena.h"
+
+// Returns NULL if there isn't room, so the caller can fail the one request
+void* arenaAlloc(arena& a, size_t size)
+  {
+  size=(size+3)&~(size_t)3; //keep the next one aligned
+  if (size>a.size-a.used)
+    {
+    a.failures++;
+    return NULL;
+    }
+  void* p=a.base+a.used;
+  a.used+=size;
+  if (a.used>a.highWater)
+    a.highWater=a.used;
+  return p;
+  }
+
+size_t arenaMark(arena& a)
+  {
+  return a.used;
+  }
+
+// Free everything allocated since the mark was taken
+void arenaRelease(arena& a, size_t mark)
+  {
+  if (mark<a.used)
+    a.used=mark;
+  }
@@ -0,0 +1,698 @@
+#include "asyncMqtt.h"
+
+#define MQTT_CONNECT     0x10
+#define MQTT_CONNACK     0x20
+#define MQTT_PUBLISH     0x30
+#define MQTT_PUBACK      0x40
+#define MQTT_SUBSCRIBE   0x82 //the low bits are required by the spec
+#define MQTT_SUBACK      0x90
+#define MQTT_PINGREQ     0xC0
+#define MQTT_PINGRESP    0xD0
+#define MQTT_DISCONNECT  0xE0
+
+#define MQTT_FIXED_HEADER_MAX 5 //type byte plus up to four bytes of remaining length
+
+// MQTT 5 property identifiers that are sent or read here
+#define MQTT_PROP_MESSAGE_EXPIRY      0x02
+#define MQTT_PROP_RESPONSE_TOPIC      0x08
+#define MQTT_PROP_CORRELATION_DATA    0x09
+#define MQTT_PROP_SESSION_EXPIRY      0x11
+#define MQTT_PROP_RECEIVE_MAXIMUM     0x21
+#define MQTT_PROP_TOPIC_ALIAS_MAXIMUM 0x22
+#define MQTT_PROP_TOPIC_ALIAS         0x23
+
+// The properties of a received packet that matter to us
+typedef struct
+  {
+  uint16_t receiveMax; //0 if not sent
+  uint16_t topicAliasMax;
+  const uint8_t* responseTopic; //not null terminated
+  uint16_t responseTopicLength;
+  const uint8_t* correlation;
+  uint16_t correlationLength;
+  } receivedProperties;
+
+// Read a variable byte integer. Returns the bytes it took, or 0 if it's cut short or malformed.
+static size_t readVarint(const uint8_t* p, size_t available, size_t& value)
+  {
+  value=0;
+  for (size_t i=0;i<available && i<4;i++)
+    {
+    value|=(size_t)(p[i]&0x7F)<<(7*i);
+    if (!(p[i]&0x80))
+      return i+1;
+    }
+  return 0;
+  }
+
+/*
+ * Read an MQTT 5 property list, starting with its length, and pick out the
+ * properties we use. Returns the bytes it took, or 0 if it's malformed.
+ */
+static size_t readProperties(const uint8_t* p, size_t available, receivedProperties& props)
+  {
+  memset(&props,0,sizeof(props));
+  size_t length;
+  size_t used=readVarint(p,available,length);
+  if (used==0 || used+length>available)
+    return 0;
+  const uint8_t* end=p+used+length;
+  p+=used;
+  while (p<end)
+    {
+    uint8_t id=*p++;
+    size_t left=end-p;
+    size_t size;
+    switch (id)
+      {
+      case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        size=1;
+        break;
+      case 0x13: case 0x21: case 0x22: case 0x23:
+        size=2;
+        break;
+      case 0x02: case 0x11: case 0x18: case 0x27:
+        size=4;
+        break;
+      case 0x0B: //subscription identifier
+        {
+        size_t ignored;
+        size=readVarint(p,left,ignored);
+        if (size==0)
+          return 0;
+        break;
+        }
+      case 0x26: //user property, a pair of strings
+        if (left<2)
+          return 0;
+        size=2+((p[0]<<8)|p[1]);
+        if (size+2>left)
+          return 0;
+        size+=2+((p[size]<<8)|p[size+1]);
+        break;
+      default: //the rest are strings or binary data with a two byte length
+        if (left<2)
+          return 0;
+        size=2+((p[0]<<8)|p[1]);
+        break;
+      }
+    if (size>left)
+      return 0;
+
+    switch (id)
+      {
+      case MQTT_PROP_RECEIVE_MAXIMUM:
+        props.receiveMax=(p[0]<<8)|p[1];
+        break;
+      case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+        props.topicAliasMax=(p[0]<<8)|p[1];
+        break;
+      case MQTT_PROP_RESPONSE_TOPIC:
+        props.responseTopic=p+2;
+        props.responseTopicLength=size-2;
+        break;
+      case MQTT_PROP_CORRELATION_DATA:
+        props.correlation=p+2;
+        props.correlationLength=size-2;
+        break;
+      }
+    p+=size;
+    }
+  return used+length;
+  }
+
+static size_t varintSize(size_t value)
+  {
+  return value<128?1:value<16384?2:value<2097152?3:4;
+  }
+
+asyncMqttClient::asyncMqttClient()
+  {
+  tcp.setNoDelay(true); //small packets are the whole point, don't let Nagle hold them
+  tcp.onConnect([](void* arg, AsyncClient* c) {((asyncMqttClient*)arg)->tcpUp=true;}, this);
+  tcp.onDisconnect([](void* arg, AsyncClient* c) {((asyncMqttClient*)arg)->tcpDown=true;}, this);
+  tcp.onError([](void* arg, AsyncClient* c, int8_t error) {((asyncMqttClient*)arg)->tcpDown=true;}, this);
+  tcp.onTimeout([](void* arg, AsyncClient* c, uint32_t time) {c->close(true);}, this);
+  tcp.onData([](void* arg, AsyncClient* c, void* data, size_t len) {((asyncMqttClient*)arg)->onTcpData((uint8_t*)data,len);}, this);
+  }
+
+asyncMqttClient::~asyncMqttClient()
+  {
+  free(txBuffer);
+  }
+
+void asyncMqttClient::setServer(IPAddress ip, uint16_t port)
+  {
+  serverIp=ip;
+  serverHost=NULL;
+  serverPort=port;
+  }
+
+void asyncMqttClient::setServer(const char* host, uint16_t port)
+  {
+  serverHost=host;
+  serverPort=port;
+  }
+
+// The largest packet that can be sent. Allocated once, not per publish.
+bool asyncMqttClient::setBufferSize(uint16_t size)
+  {
+  if (size<=txSize)
+    return true;
+  uint8_t* buf=(uint8_t*)realloc(txBuffer,size);
+  if (!buf)
+    return false;
+  txBuffer=buf;
+  txSize=size;
+  return true;
+  }
+
+// Runs in the TCP stack's context, so only copy the bytes and let loop() look at them
+void asyncMqttClient::onTcpData(uint8_t* data, size_t len)
+  {
+  if (rxLength+len>sizeof(rxBuffer))
+    {
+    rxOverflow=true;
+    return;
+    }
+  memcpy(rxBuffer+rxLength,data,len);
+  rxLength+=len;
+  }
+
+/*
+ * Start connecting and return right away. loop() sends the CONNECT when the
+ * TCP connection is up, and connected() goes true when the CONNACK arrives.
+ * The strings must stay put until then, which the settings always do.
+ */
+bool asyncMqttClient::connect(const char* id, const char* user, const char* pass, bool cleanSession)
+  {
+  if (state!=ASYNC_MQTT_DISCONNECTED)
+    return false;
+  if (!txBuffer && !setBufferSize(256))
+    return false;
+
+  clientId=id;
+  username=user;
+  password=pass;
+  cleanStart=cleanSession;
+  aliasSent=0; //aliases only last as long as the connection
+  brokerAliasMax=0;
+  receiveMax=ASYNC_MQTT_WINDOW;
+  tcpUp=false;
+  tcpDown=false;
+  rxLength=0;
+  rxOverflow=false;
+  connackCode=0;
+  connectStartMs=millis();
+  state=ASYNC_MQTT_TCP_CONNECTING;
+
+  bool started=serverHost?tcp.connect(serverHost,serverPort):tcp.connect(serverIp,serverPort);
+  if (!started)
+    state=ASYNC_MQTT_DISCONNECTED;
+  return started;
+  }
+
+void asyncMqttClient::disconnect()
+  {
+  if (state==ASYNC_MQTT_CONNECTED)
+    sendSimple(MQTT_DISCONNECT);
+  tcp.close();
+  state=ASYNC_MQTT_DISCONNECTED;
+  dropWindow();
+  }
+
+uint16_t asyncMqttClient::packetId()
+  {
+  if (nextPacketId==0) //0 isn't a valid packet id
+    nextPacketId=1;
+  return nextPacketId++;
+  }
+
+// Hand a whole packet to TCP, or nothing if it won't all fit right now
+bool asyncMqttClient::send(const uint8_t* buf, size_t len)
+  {
+  if (tcp.space()<len)
+    return false;
+  tcp.add((const char*)buf,len);
+  tcp.send();
+  lastSendMs=millis();
+  return true;
+  }
+
+// Write the type byte and remaining length at the start of txBuffer. Returns where the rest goes.
+size_t asyncMqttClient::writeHeader(uint8_t type, size_t remaining)
+  {
+  txBuffer[0]=type;
+  return writeVarint(1,remaining);
+  }
+
+// Write a variable byte integer. Returns the position after it.
+size_t asyncMqttClient::writeVarint(size_t pos, size_t value)
+  {
+  do
+    {
+    uint8_t digit=value%128;
+    value/=128;
+    txBuffer[pos++]=value>0?digit|0x80:digit;
+    } while (value>0);
+  return pos;
+  }
+
+// Write a length-prefixed string. Returns the position after it.
+size_t asyncMqttClient::writeString(size_t pos, const char* text, size_t len)
+  {
+  txBuffer[pos++]=len>>8;
+  txBuffer[pos++]=len&0xFF;
+  memcpy(txBuffer+pos,text,len);
+  return pos+len;
+  }
+
+void asyncMqttClient::sendConnect()
+  {
+  size_t idLen=strlen(clientId);
+  size_t userLen=username?strlen(username):0;
+  size_t passLen=(userLen>0 && password)?strlen(password):0; //3.1.1 only allows a password with a user name
+
+  uint8_t flags=cleanStart?0x02:0;
+  size_t propLen=mqtt5 && sessionExpiry>0?5:0;
+  size_t remaining=10+(mqtt5?varintSize(propLen)+propLen:0)+2+idLen;
+  if (userLen>0)
+    {
+    flags|=0x80;
+    remaining+=2+userLen;
+    }
+  if (passLen>0)
+    {
+    flags|=0x40;
+    remaining+=2+passLen;
+    }
+  if (MQTT_FIXED_HEADER_MAX+remaining>txSize)
+    {
+    tcp.close(true);
+    return;
+    }
+
+  size_t pos=writeHeader(MQTT_CONNECT,remaining);
+  pos=writeString(pos,"MQTT",4);
+  txBuffer[pos++]=mqtt5?5:4; //protocol level
+  txBuffer[pos++]=flags;
+  txBuffer[pos++]=keepAlive>>8;
+  txBuffer[pos++]=keepAlive&0xFF;
+  if (mqtt5)
+    {
+    pos=writeVarint(pos,propLen);
+    if (propLen>0) //without it, MQTT 5 drops the session when the connection closes
+      {
+      txBuffer[pos++]=MQTT_PROP_SESSION_EXPIRY;
+      for (int shift=24;shift>=0;shift-=8)
+        txBuffer[pos++]=(sessionExpiry>>shift)&0xFF;
+      }
+    }
+  pos=writeString(pos,clientId,idLen);
+  if (userLen>0)
+    pos=writeString(pos,username,userLen);
+  if (passLen>0)
+    pos=writeString(pos,password,passLen);
+  if (!send(txBuffer,pos))
+    tcp.close(true);
+  }
+
+void asyncMqttClient::sendSimple(uint8_t type)
+  {
+  uint8_t buf[2]={type,0};
+  send(buf,sizeof(buf));
+  }
+
+void asyncMqttClient::sendPuback(uint16_t id)
+  {
+  uint8_t buf[4]={MQTT_PUBACK,2,(uint8_t)(id>>8),(uint8_t)(id&0xFF)};
+  send(buf,sizeof(buf));
+  }
+
+bool asyncMqttClient::canPublish()
+  {
+  return connected() && windowCount<windowLimit();
+  }
+
+/*
+ * Publishes to these topics use alias i+1 for list[i]. The strings are
+ * compared by address, so pass the same pointers to publish(). Calling it
+ * again, for instance after the topics changed, makes every alias be sent
+ * with its topic again.
+ */
+void asyncMqttClient::setTopicAliases(const char* const* list, uint8_t count)
+  {
+  aliasTopics=list;
+  aliasCount=count<ASYNC_MQTT_MAX_ALIASES?count:ASYNC_MQTT_MAX_ALIASES;
+  aliasSent=0;
+  }
+
+// The alias for a topic, or 0 if it doesn't have one the broker will take
+uint8_t asyncMqttClient::topicAlias(const char* topic)
+  {
+  if (!mqtt5)
+    return 0;
+  for (uint8_t i=0;i<aliasCount && i<brokerAliasMax;i++)
+    {
+    if (aliasTopics[i]==topic)
+      return i+1;
+    }
+  return 0;
+  }
+
+/*
+ * Queue a publish and return without waiting for the broker. QoS1 publishes
+ * take a slot in the window until their PUBACK comes back. Returns false if
+ * not connected, the window is full, or TCP has no room for it yet.
+ */
+bool asyncMqttClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retain, uint8_t qos,
+                              const asyncMqttProperties* props)
+  {
+  if (!connected())
+    return false;
+  if (qos>0 && windowCount>=windowLimit())
+    return false;
+  qos=qos>0?1:0; //QoS2 isn't supported
+
+  uint8_t alias=topicAlias(topic);
+  bool aliasKnown=alias && (aliasSent&(1UL<<(alias-1)));
+  size_t topicLen=aliasKnown?0:strlen(topic); //the broker already knows what the alias means
+  size_t propLen=0;
+  if (mqtt5)
+    {
+    if (alias)
+      propLen+=3;
+    if (props && props->expirySeconds>0)
+      propLen+=5;
+    if (props && props->correlation)
+      propLen+=3+props->correlationLength;
+    }
+  size_t remaining=2+topicLen+(qos?2:0)+(mqtt5?varintSize(propLen)+propLen:0)+length;
+  if (MQTT_FIXED_HEADER_MAX+remaining>txSize)
+    return false;
+
+  size_t pos=writeHeader(MQTT_PUBLISH|(qos<<1)|(retain?1:0),remaining);
+  pos=writeString(pos,topic,topicLen);
+  uint16_t id=0;
+  if (qos)
+    {
+    id=packetId();
+    txBuffer[pos++]=id>>8;
+    txBuffer[pos++]=id&0xFF;
+    }
+  if (mqtt5)
+    {
+    pos=writeVarint(pos,propLen);
+    if (alias)
+      {
+      txBuffer[pos++]=MQTT_PROP_TOPIC_ALIAS;
+      txBuffer[pos++]=0;
+      txBuffer[pos++]=alias;
+      }
+    if (props && props->expirySeconds>0)
+      {
+      txBuffer[pos++]=MQTT_PROP_MESSAGE_EXPIRY;
+      for (int shift=24;shift>=0;shift-=8)
+        txBuffer[pos++]=(props->expirySeconds>>shift)&0xFF;
+      }
+    if (props && props->correlation)
+      {
+      txBuffer[pos++]=MQTT_PROP_CORRELATION_DATA;
+      pos=writeString(pos,(const char*)props->correlation,props->correlationLength);
+      }
+    }
+  memcpy(txBuffer+pos,payload,length);
+  pos+=length;
+
+  if (!send(txBuffer,pos))
+    return false;
+  if (alias)
+    aliasSent|=1UL<<(alias-1);
+  if (qos)
+    {
+    window[windowCount].id=id;
+    window[windowCount].sentMs=millis();
+    windowCount++;
+    }
+  return true;
+  }
+
+bool asyncMqttClient::subscribe(const char* topic, uint8_t qos)
+  {
+  if (!connected())
+    return false;
+  size_t topicLen=strlen(topic);
+  size_t remaining=2+(mqtt5?1:0)+2+topicLen+1;
+  if (MQTT_FIXED_HEADER_MAX+remaining>txSize)
+    return false;
+
+  size_t pos=writeHeader(MQTT_SUBSCRIBE,remaining);
+  uint16_t id=packetId();
+  txBuffer[pos++]=id>>8;
+  txBuffer[pos++]=id&0xFF;
+  if (mqtt5)
+    txBuffer[pos++]=0; //no properties
+  pos=writeString(pos,topic,topicLen);
+  txBuffer[pos++]=qos>0?1:0;
+  return send(txBuffer,pos);
+  }
+
+// A PUBACK came back, so free its slot in the window
+void asyncMqttClient::acknowledged(uint16_t id)
+  {
+  for (uint8_t i=0;i<windowCount;i++)
+    {
+    if (window[i].id==id)
+      {
+      window[i]=window[--windowCount];
+      return;
+      }
+    }
+  }
+
+// Everything still in the window is lost with the connection
+void asyncMqttClient::dropWindow()
+  {
+  failures+=windowCount;
+  windowCount=0;
+  pingSentMs=0;
+  }
+
+uint16_t asyncMqttClient::takeFailures()
+  {
+  uint16_t f=failures;
+  failures=0;
+  return f;
+  }
+
+void asyncMqttClient::handlePacket(uint8_t header, uint8_t* body, size_t length)
+  {
+  switch (header&0xF0)
+    {
+    case MQTT_CONNACK:
+      if (length>=2 && body[1]==0)
+        {
+        state=ASYNC_MQTT_CONNECTED;
+        pingSentMs=0;
+        receivedProperties props;
+        if (mqtt5 && readProperties(body+2,length-2,props))
+          {
+          brokerAliasMax=props.topicAliasMax;
+          if (props.receiveMax>0)
+            receiveMax=props.receiveMax;
+          }
+        }
+      else
+        {
+        connackCode=length>=2?body[1]:-1;
+        tcp.close(true);
+        }
+      break;
+
+    case MQTT_PUBLISH:
+      {
+      uint8_t qos=(header>>1)&0x03;
+      if (length<2)
+        break;
+      size_t topicLen=(body[0]<<8)|body[1];
+      size_t pos=2+topicLen+(qos?2:0);
+      if (pos>length)
+        break;
+      uint16_t id=qos?(body[2+topicLen]<<8)|body[3+topicLen]:0;
+
+      replyTopic[0]='\0';
+      correlationLength=0;
+      if (mqtt5)
+        {
+        receivedProperties props;
+        size_t used=readProperties(body+pos,length-pos,props);
+        if (used==0)
+          break;
+        pos+=used;
+        if (props.responseTopic && props.responseTopicLength<sizeof(replyTopic))
+          {
+          memcpy(replyTopic,props.responseTopic,props.responseTopicLength);
+          replyTopic[props.responseTopicLength]='\0';
+          }
+        if (props.correlation && props.correlationLength<=sizeof(correlation))
+          {
+          memcpy(correlation,props.correlation,props.correlationLength);
+          correlationLength=props.correlationLength;
+          }
+        }
+      if (qos)
+        sendPuback(id); //before the callback, which might restart the device
+
+      memmove(body,body+2,topicLen); //make room to null terminate the topic
+      body[topicLen]='\0';
+      if (callback)
+        callback((char*)body,body+pos,length-pos);
+      replyTopic[0]='\0';
+      correlationLength=0;
+      break;
+      }
+
+    case MQTT_PUBACK:
+      if (length>=2)
+        acknowledged((body[0]<<8)|body[1]);
+      break;
+
+    case MQTT_PINGRESP:
+      pingSentMs=0;
+      break;
+
+    default: //SUBACK and anything else need nothing from us
+      break;
+    }
+  }
+
+/*
+ * Act on whatever the TCP callbacks have noted, parse the received packets,
+ * and keep the connection alive. Call it often. It can be called again from
+ * inside the message callback, for instance while a publish waits for room in
+ * the window; then it only handles acknowledgements, not more messages.
+ */
+void asyncMqttClient::loop()
+  {
+  static bool inCallback=false;
+  uint32_t now=millis();
+
+  if (tcpDown || rxOverflow)
+    {
+    if (rxOverflow)
+      tcp.close(true);
+    tcpDown=false;
+    tcpUp=false;
+    rxOverflow=false;
+    if (state!=ASYNC_MQTT_DISCONNECTED)
+      {
+      state=ASYNC_MQTT_DISCONNECTED;
+      dropWindow();
+      }
+    return;
+    }
+
+  if (state==ASYNC_MQTT_TCP_CONNECTING && tcpUp)
+    {
+    state=ASYNC_MQTT_CONNECTING;
+    sendConnect();
+    }
+  if (connecting() && now-connectStartMs>ASYNC_MQTT_CONNECT_TIMEOUT_MS)
+    {
+    tcp.close(true);
+    state=ASYNC_MQTT_DISCONNECTED;
+    return;
+    }
+
+  while (rxLength>=2)
+    {
+    size_t remaining=0;
+    size_t hdrLen=1;
+    uint32_t multiplier=1;
+    bool complete=false;
+    while (hdrLen<rxLength && hdrLen<MQTT_FIXED_HEADER_MAX)
+      {
+      uint8_t digit=rxBuffer[hdrLen++];
+      remaining+=(digit&0x7F)*multiplier;
+      multiplier*=128;
+      if (!(digit&0x80))
+        {
+        complete=true;
+        break;
+        }
+      }
+    if (!complete)
+      break; //the rest of the length hasn't arrived
+    size_t total=hdrLen+remaining;
+    if (total>sizeof(rxBuffer)) //can never fit, so the stream can't be followed any more
+      {
+      tcp.close(true);
+      rxLength=0;
+      break;
+      }
+    if (rxLength<total)
+      break;
+
+    uint8_t header=rxBuffer[0];
+    if (inCallback && (header&0xF0)==MQTT_PUBLISH)
+      break; //leave messages for the outer loop()
+
+    // Take the packet out of the receive buffer before acting on it, since the
+    // TCP callbacks can add to the buffer while the message callback runs.
+    bool fits=remaining<=ASYNC_MQTT_PACKET_SIZE;
+    if (fits)
+      memcpy(packet,rxBuffer+hdrLen,remaining);
+    else if ((header&0xF0)==MQTT_PUBLISH && (header&0x06) && remaining>=4) //too big for us, but still ack it
+      {
+      size_t topicLen=(rxBuffer[hdrLen]<<8)|rxBuffer[hdrLen+1];
+      if (hdrLen+4+topicLen<=total)
+        sendPuback((rxBuffer[hdrLen+2+topicLen]<<8)|rxBuffer[hdrLen+3+topicLen]);
+      }
+    memmove(rxBuffer,rxBuffer+total,rxLength-total);
+    rxLength-=total;
+
+    if (fits)
+      {
+      bool outer=!inCallback;
+      inCallback=true;
+      handlePacket(header,packet,remaining);
+      if (outer)
+        inCallback=false;
+      }
+    }
+
+  for (uint8_t i=0;i<windowCount;)
+    {
+    if (now-window[i].sentMs>ASYNC_MQTT_ACK_TIMEOUT_MS)
+      {
+      window[i]=window[--windowCount];
+      failures++;
+      }
+    else
+      i++;
+    }
+
+  if (state==ASYNC_MQTT_CONNECTED && keepAlive>0)
+    {
+    uint32_t keepAliveMs=keepAlive*1000UL;
+    if (pingSentMs!=0 && now-pingSentMs>keepAliveMs) //the broker has gone quiet
+      tcp.close(true);
+    else if (pingSentMs==0 && now-lastSendMs>=keepAliveMs)
+      {
+      sendSimple(MQTT_PINGREQ);
+      pingSentMs=now;
+      }
+    }
+  }
+
+// Wait for the window to empty, so nothing is lost by sleeping or restarting
+bool asyncMqttClient::flush(uint32_t timeoutMs)
+  {
+  uint32_t start=millis();
+  while (windowCount>0 && connected() && millis()-start<timeoutMs)
+    {
+    loop();
+    delay(1); //lets the TCP stack deliver the acknowledgements
+    }
+  return windowCount==0;
+  }
@@ -0,0 +1,211 @@
+#include <string.h>
+#include "commandParser.h"
+
+static bool isSpace(char c)
+  {
+  return c==' ' || c=='\t' || c=='\r' || c=='\n';
+  }
+
+// Remove spaces and line endings from both ends of a view
+static textView trim(textView view)
+  {
+  while (view.length>0 && isSpace(view.text[0]))
+    {
+    view.text++;
+    view.length--;
+    }
+  while (view.length>0 && isSpace(view.text[view.length-1]))
+    view.length--;
+  return view;
+  }
+
+// Remove the line ending from a value. Spaces are kept since a password can have them.
+static textView trimLineEnd(textView view)
+  {
+  while (view.length>0 && (view.text[view.length-1]=='\r' || view.text[view.length-1]=='\n'))
+    view.length--;
+  return view;
+  }
+
+/*
+ * Split a command line into its name and value. Everything before the first "="
+ * is the name and everything after it is the value, so values can contain "=".
+ * The line doesn't need to be null terminated and is never changed.
+ */
+parseResult parseCommand(const char* line, size_t length, command& cmd)
+  {
+  textView rest={line,length};
+  const char* equals=(const char*)memchr(line,'=',length);
+  if (equals)
+    {
+    cmd.name=trim({line,(size_t)(equals-line)});
+    cmd.value=trimLineEnd({equals+1,length-(size_t)(equals-line)-1});
+    }
+  else
+    {
+    cmd.name=trim(rest);
+    cmd.value={line+length,0};
+    }
+
+  if (cmd.name.length==0)
+    return PARSE_EMPTY;
+  if (cmd.name.length>=MAX_COMMAND_SIZE)
+    return PARSE_NAME_TOO_LONG;
+  return PARSE_OK;
+  }
+
+/*
+ * Take the next separated field off the front of rest, like strtok() but without
+ * writing into the buffer. Empty fields are returned as empty rather than skipped.
+ * Returns false when there are no fields left.
+ */
+bool nextField(textView& rest, char separator, textView& field)
+  {
+  if (rest.text==NULL)
+    return false;
+
+  const char* sep=(const char*)memchr(rest.text,separator,rest.length);
+  if (sep)
+    {
+    field=trim({rest.text,(size_t)(sep-rest.text)});
+    rest.length-=sep-rest.text+1;
+    rest.text=sep+1;
+    }
+  else
+    {
+    field=trim(rest);
+    rest.text=NULL; //that was the last one
+    rest.length=0;
+    }
+  return true;
+  }
+
+// True if the view holds exactly this text
+bool viewIs(textView view, const char* text)
+  {
+  return strlen(text)==view.length && memcmp(view.text,text,view.length)==0;
+  }
+
+// Convert a view of decimal digits to a number between minValue and maxValue
+parseResult viewToUnsigned(textView view, uint32_t minValue, uint32_t maxValue, uint32_t& result)
+  {
+  if (view.length==0)
+    return PARSE_NO_VALUE;
+
+  uint64_t value=0;
+  for (size_t i=0;i<view.length;i++)
+    {
+    char c=view.text[i];
+    if (c<'0' || c>'9')
+      return PARSE_NOT_A_NUMBER;
+    value=value*10+(c-'0');
+    if (value>maxValue)
+      return PARSE_OUT_OF_RANGE; //stop before a long string of digits can overflow
+    }
+  if (value<minValue)
+    return PARSE_OUT_OF_RANGE;
+
+  result=(uint32_t)value;
+  return PARSE_OK;
+  }
+
+// "1" is true, "0" is false
+parseResult viewToBool(textView view, bool& result)
+  {
+  uint32_t value;
+  parseResult rc=viewToUnsigned(view,0,1,value);
+  if (rc==PARSE_OK)
+    result=value==1;
+  return rc;
+  }
+
+/*
+ * Copy a view into a settings field and null terminate it. The value "NULL" is
+ * copied as an empty string, because clearing a setting should be on purpose.
+ */
+parseResult copyView(textView view, char* dest, size_t destSize)
+  {
+  if (viewIs(view,"NULL"))
+    view.length=0;
+  if (view.length>=destSize)
+    return PARSE_VALUE_TOO_LONG;
+
+  memcpy(dest,view.text,view.length);
+  dest[view.length]='\0';
+  return PARSE_OK;
+  }
+
+static int hexDigit(char c)
+  {
+  if (c>='0' && c<='9') return c-'0';
+  if (c>='a' && c<='f') return c-'a'+10;
+  if (c>='A' && c<='F') return c-'A'+10;
+  return -1;
+  }
+
+/*
+ * Convert hex, with or without a ":" or space between the bytes, into count
+ * bytes. False unless it is exactly that long and nothing but hex and separators.
+ */
+static bool viewToHex(textView view, uint8_t* bytes, size_t count)
+  {
+  size_t done=0;
+  size_t i=0;
+  while (i<view.length)
+    {
+    if (view.text[i]==':' || view.text[i]==' ')
+      {
+      i++;
+      continue;
+      }
+    if (i+1>=view.length || done>=count)
+      return false;
+    int hi=hexDigit(view.text[i]);
+    int lo=hexDigit(view.text[i+1]);
+    if (hi<0 || lo<0)
+      return false;
+    bytes[done++]=(uint8_t)(hi<<4|lo);
+    i+=2;
+    }
+  return done==count;
+  }
+
+// A certificate fingerprint, FINGERPRINT_BYTES of hex
+bool viewToFingerprint(textView view, uint8_t* bytes)
+  {
+  return viewToHex(view,bytes,FINGERPRINT_BYTES);
+  }
+
+// A MAC address, MAC_BYTES of hex
+bool viewToMac(textView view, uint8_t* bytes)
+  {
+  return viewToHex(view,bytes,MAC_BYTES);
+  }
+
+// An ESP-NOW key, ESPNOW_KEY_BYTES of hex
+bool viewToKey(textView view, uint8_t* bytes)
+  {
+  return viewToHex(view,bytes,ESPNOW_KEY_BYTES);
+  }
+
+const char* parseResultText(parseResult result)
+  {
+  switch (result)
+    {
+    case PARSE_OK: return "OK";
+    case PARSE_EMPTY: return "(empty)";
+    case PARSE_NAME_TOO_LONG: return "Command name too long";
+    case PARSE_UNKNOWN_COMMAND: return "Unknown command";
+    case PARSE_NO_VALUE: return "Missing value";
+    case PARSE_NOT_A_NUMBER: return "Value is not a number";
+    case PARSE_OUT_OF_RANGE: return "Value out of range";
+    case PARSE_VALUE_TOO_LONG: return "Value too long";
+    case PARSE_BAD_PORT: return "Invalid GPIO port";
+    case PARSE_BAD_FINGERPRINT: return "Fingerprint must be 20 bytes of hex";
+    case PARSE_BAD_MAC: return "MAC address must be 6 bytes of hex";
+    case PARSE_BAD_HOST: return "Host may only have letters, digits, '.' and '/'";
+    case PARSE_BAD_KEY: return "Key must be 16 bytes of hex";
+    case PARSE_LIST_FULL: return "No room for another entry";
+    }
+  return "Unknown error";
+  }
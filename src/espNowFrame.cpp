@@ -0,0 +1,83 @@
+#include <string.h>
+#include "espNowFrame.h"
+
+/*
+ * Put one publish into a frame. Returns the frame's length, or 0 if the topic
+ * and payload don't fit in size bytes.
+ */
+size_t espNowEncode(uint8_t* frame, size_t size, uint16_t sequence, bool retain,
+                    const char* topic, const uint8_t* payload, size_t length)
+  {
+  size_t topicLength=strlen(topic);
+  if (topicLength==0 || topicLength>255 || ESPNOW_HEADER_SIZE+topicLength+length>size)
+    return 0;
+
+  frame[0]=ESPNOW_FRAME_MAGIC;
+  frame[1]=ESPNOW_FRAME_VERSION;
+  frame[2]=sequence&0xFF;
+  frame[3]=sequence>>8;
+  frame[4]=retain?ESPNOW_FLAG_RETAIN:0;
+  frame[5]=(uint8_t)topicLength;
+  memcpy(frame+ESPNOW_HEADER_SIZE,topic,topicLength);
+  memcpy(frame+ESPNOW_HEADER_SIZE+topicLength,payload,length);
+  return ESPNOW_HEADER_SIZE+topicLength+length;
+  }
+
+// Take a frame apart. False if it isn't one of ours or is cut short.
+bool espNowDecode(const uint8_t* frame, size_t length, espNowMessage& msg)
+  {
+  if (length<ESPNOW_HEADER_SIZE
+      || frame[0]!=ESPNOW_FRAME_MAGIC
+      || frame[1]!=ESPNOW_FRAME_VERSION)
+    return false;
+  size_t topicLength=frame[5];
+  if (topicLength==0 || ESPNOW_HEADER_SIZE+topicLength>length)
+    return false;
+
+  msg.sequence=frame[2]|frame[3]<<8;
+  msg.retain=frame[4]&ESPNOW_FLAG_RETAIN;
+  memcpy(msg.topic,frame+ESPNOW_HEADER_SIZE,topicLength);
+  msg.topic[topicLength]='\0';
+  msg.payload=frame+ESPNOW_HEADER_SIZE+topicLength;
+  msg.length=length-ESPNOW_HEADER_SIZE-topicLength;
+  return true;
+  }
+
+/*
+ * True if this is the first time this node's frame with this sequence number
+ * has turned up, and remember it. A node the gateway hasn't heard from takes
+ * the place of the one it heard from longest ago once the table is full.
+ */
+bool espNowIsNew(espNowSeen& seen, const uint8_t* mac, uint16_t sequence)
+  {
+  seen.clock++;
+  espNowPeer* peer=NULL;
+  for (uint8_t i=0;i<seen.count && !peer;i++)
+    {
+    if (memcmp(seen.peers[i].mac,mac,ESPNOW_MAC_BYTES)==0)
+      peer=&seen.peers[i];
+    }
+  if (peer && peer->sequence==sequence)
+    {
+    peer->heard=seen.clock;
+    return false;
+    }
+  if (!peer)
+    {
+    if (seen.count<ESPNOW_GATEWAY_PEERS)
+      peer=&seen.peers[seen.count++];
+    else
+      {
+      peer=&seen.peers[0];
+      for (uint8_t i=1;i<seen.count;i++)
+        {
+        if (seen.clock-seen.peers[i].heard>seen.clock-peer->heard)
+          peer=&seen.peers[i];
+        }
+      }
+    memcpy(peer->mac,mac,ESPNOW_MAC_BYTES);
+    }
+  peer->sequence=sequence;
+  peer->heard=seen.clock;
+  return true;
+  }
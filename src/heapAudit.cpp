@@ -0,0 +1,119 @@
+#ifdef HEAP_AUDIT
+
+#include <Arduino.h>
+#include "heapAudit.h"
+
+heapSubsystem currentSubsystem=SUBSYSTEM_OTHER;
+heapCounts heapAudit[SUBSYSTEM_COUNT];
+static uint32_t heapSize=0; //free heap before the first allocation we saw
+
+/*
+ * Count one allocation against the current subsystem. The free heap size is a
+ * counter kept by the allocator, so reading it here is cheap and doesn't need
+ * a size header on every block.
+ */
+static void countAlloc(size_t size, void* p)
+  {
+  heapCounts& c=heapAudit[currentSubsystem];
+  if (!p)
+    {
+    c.failures++;
+    return;
+    }
+  c.bytes+=size;
+  if (size>c.largest)
+    c.largest=size;
+
+  uint32_t freeHeap=ESP.getFreeHeap();
+  if (heapSize==0)
+    heapSize=freeHeap+size;
+  uint32_t inUse=heapSize>freeHeap?heapSize-freeHeap:0;
+  if (inUse>c.highWater)
+    c.highWater=inUse;
+  }
+
+// The linker sends every call to malloc() and friends here when given -Wl,--wrap
+extern "C"
+  {
+  void* __real_malloc(size_t size);
+  void* __real_calloc(size_t count, size_t size);
+  void* __real_realloc(void* ptr, size_t size);
+  void __real_free(void* ptr);
+
+  void* __wrap_malloc(size_t size)
+    {
+    void* p=__real_malloc(size);
+    heapAudit[currentSubsystem].allocs++;
+    countAlloc(size,p);
+    return p;
+    }
+
+  void* __wrap_calloc(size_t count, size_t size)
+    {
+    void* p=__real_calloc(count,size);
+    heapAudit[currentSubsystem].allocs++;
+    countAlloc(count*size,p);
+    return p;
+    }
+
+  void* __wrap_realloc(void* ptr, size_t size)
+    {
+    void* p=__real_realloc(ptr,size);
+    if (ptr)
+      heapAudit[currentSubsystem].reallocs++;
+    else
+      heapAudit[currentSubsystem].allocs++;
+    if (size>0)
+      countAlloc(size,p);
+    return p;
+    }
+
+  void __wrap_free(void* ptr)
+    {
+    if (ptr)
+      heapAudit[currentSubsystem].frees++;
+    __real_free(ptr);
+    }
+  }
+
+const char* subsystemName(heapSubsystem s)
+  {
+  static const char* names[SUBSYSTEM_COUNT]={"other","web","mqtt","serial","settings","network"};
+  return s<SUBSYSTEM_COUNT?names[s]:"?";
+  }
+
+void printHeapAudit()
+  {
+  Serial.println("Subsystem\tallocs\treallocs\tfrees\tfailures\tbytes\tlargest\thighWater");
+  for (uint8_t i=0;i<SUBSYSTEM_COUNT;i++)
+    {
+    heapCounts& c=heapAudit[i];
+    Serial.printf("%s\t\t%u\t%u\t\t%u\t%u\t\t%u\t%u\t%u\n",
+                  subsystemName((heapSubsystem)i),
+                  c.allocs,c.reallocs,c.frees,c.failures,c.bytes,c.largest,c.highWater);
+    }
+  }
+
+// Write the counts as a JSON object keyed by subsystem. Returns the length like snprintf().
+int heapAuditJson(char* buf, size_t size)
+  {
+  int len=snprintf(buf,size,"{");
+  for (uint8_t i=0;i<SUBSYSTEM_COUNT && len<(int)size;i++)
+    {
+    heapCounts& c=heapAudit[i];
+    len+=snprintf(buf+len,size-len,
+                  "%s\"%s\":{\"allocs\":%u, \"reallocs\":%u, \"frees\":%u, \"failures\":%u, \"bytes\":%u, \"largest\":%u, \"highWater\":%u}",
+                  i==0?"":", ",subsystemName((heapSubsystem)i),
+                  c.allocs,c.reallocs,c.frees,c.failures,c.bytes,c.largest,c.highWater);
+    }
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,"}");
+  return len;
+  }
+
+void clearHeapAudit()
+  {
+  memset(heapAudit,0,sizeof(heapAudit));
+  }
+
+#endif
@@ -0,0 +1,48 @@
+#include "latencyProfiler.h"
+
+static latencyHistogram histograms[PROFILE_COUNT];
+static const char* probeNames[PROFILE_COUNT]={"loop","mqtt","mdns","web","serial","report"};
+
+void recordLatency(uint8_t probe, uint32_t elapsedUs)
+  {
+  if (probe>=PROFILE_COUNT)
+    return;
+
+  uint8_t bucket=0;
+  if (elapsedUs>=(1UL<<LATENCY_FIRST_BUCKET_SHIFT))
+    bucket=min(LATENCY_BUCKETS-1,32-__builtin_clz(elapsedUs)-LATENCY_FIRST_BUCKET_SHIFT);
+
+  latencyHistogram& h=histograms[probe];
+  h.count++;
+  h.totalUs+=elapsedUs;
+  if (elapsedUs>h.maxUs)
+    h.maxUs=elapsedUs;
+  h.buckets[bucket]++;
+  }
+
+/*
+ * Write all of the histograms as JSON. "bucketsUs" holds the upper edge of each
+ * bucket, and the last bucket is everything longer. Returns the length like snprintf().
+ */
+int latencyJson(char* buf, size_t size)
+  {
+  int len=snprintf(buf,size,"{\"bucketsUs\":[");
+  for (uint8_t b=0;b<LATENCY_BUCKETS-1 && len<(int)size;b++)
+    len+=snprintf(buf+len,size-len,"%s%lu",b==0?"":",",1UL<<(b+LATENCY_FIRST_BUCKET_SHIFT));
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,"]");
+
+  for (uint8_t i=0;i<PROFILE_COUNT && len<(int)size;i++)
+    {
+    latencyHistogram& h=histograms[i];
+    len+=snprintf(buf+len,size-len,", \"%s\":{\"count\":%u, \"maxUs\":%u, \"avgUs\":%u, \"hist\":[",
+                  probeNames[i],h.count,h.maxUs,h.count>0?(uint32_t)(h.totalUs/h.count):0);
+    for (uint8_t b=0;b<LATENCY_BUCKETS && len<(int)size;b++)
+      len+=snprintf(buf+len,size-len,"%s%u",b==0?"":",",h.buckets[b]);
+    if (len<(int)size)
+      len+=snprintf(buf+len,size-len,"]}");
+    }
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,"}");
+  return len;
+  }
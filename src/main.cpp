@@ -20,10 +20,10 @@
 
  * 
  * Once connected to an MQTT broker, configuration can be done similarly via the 
- * <topicroot>/command topic. Because this program sleeps most of the time, you will need
- * to send a <topicroot>/command with the RETAIN bit set and a message of "reportinterval=0"
- * to keep it awake while you make changes. Reset the reportinterval when you are finished
- * and don't forget to remove the retained MQTT message.
+ * <topicroot>/command topic. The device keeps a persistent session and subscribes at QoS 1,
+ * so a command published with QoS 1 while it is asleep is kept by the broker and handled the
+ * next time it wakes. To keep it awake while you make changes, publish "reportinterval=0"
+ * with QoS 1; no retained message is needed. Reset the reportinterval when you are finished.
  * 
  * NOTE1: If you're using an ESP8266-01s, don't forget to bodge GPIO16 to the reset pin! 
  * 
@@ -43,24 +43,89 @@
 #include <math.h>    
 #include <ESP8266WiFi.h>
 #include <PubSubClient.h>
+#include <WiFiClientSecure.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266mDNS.h>
 #include <ESPAsyncWebServer.h>
 #include <FS.h>
 #include <LittleFS.h>
 #include <EEPROM.h>
+#include <coredecls.h>
+#include <sys/time.h>
+extern "C" 
+  {
+  #include <user_interface.h> //for the light sleep GPIO wakeup
+  #include <gpio.h>
+  #include <espnow.h>
+  }
+#include "commandParser.h"
+#include "gpioMap.h"
+#include "binaryReport.h"
+#include "asyncMqtt.h"
+#include "espNowFrame.h"
 #include "switchMonitor.h"
+#include "taskScheduler.h"
+#include "arena.h"
+#include "heapAudit.h"
+#include "latencyProfiler.h"
 
-#define VERSION "25.05.17.0"  //remember to update this after every change! YY.MM.DD.REV
+#define VERSION "26.10.18.24"  //remember to update this after every change! YY.MM.DD.REV
 
 ADC_MODE(ADC_VCC); //use the ADC to measure battery voltage
 
 WiFiClient wifiClient;
+WiFiClientSecure secureClient; //BearSSL, used instead of wifiClient when settings.mqttTls is set
+BearSSL::Session tlsSession; //the last TLS session, offered again so the handshake can be abbreviated
 PubSubClient mqttClient(wifiClient);
+asyncMqttClient mqttAsync; //used instead of mqttClient when settings.asyncMqtt is set
+bool asyncSubscribed=false; //the async client has subscribed since it last connected
+ulong lastAsyncConnect=0; //millis() when the async client last started connecting
+ulong brokerConnectedAt=0; //millis() when the broker connection was last made, 0 if never
+ulong lastCommandAt=0; //millis() when the last MQTT command arrived
+bool restartPending=false; //restart once the command that asked for it has been acknowledged
+char brokerHost[ADDRESS_SIZE]=""; //the broker being connected to. The MQTT clients keep a pointer to it.
+uint16_t brokerPort=0;
+int8_t brokerIndex=-1; //which broker that is, 0 for the main one, -1 before one is chosen
+bool wifiConnecting=false; //startWiFi() has started a connection that serviceWiFi() hasn't finished
+bool wifiFastPath=false; //trying the cached channel and access point
+bool wifiCachedLease=false; //and the cached DHCP lease
+ulong wifiStartMs=0; //millis() when the connection was started
+ulong wifiDotMs=0; //millis() when the last progress dot was printed
+bool espNowActive=false; //this wake publishes to the ESP-NOW gateway instead of the broker
+uint8_t espNowGatewayMac[MAC_BYTES];
+uint8_t espNowLmk[ESPNOW_KEY_BYTES]; //settings.espNowKey as bytes, to encrypt the frames to the gateway with
+volatile int8_t espNowSendStatus=-1; //0 once the gateway has acknowledged the last frame, -1 while waiting
+#ifdef ESPNOW_GATEWAY
+// Frames heard from the nodes, put here by the receive callback for gatewayTask() to forward
+typedef struct
+  {
+  uint8_t mac[MAC_BYTES];
+  uint8_t length;
+  uint8_t data[ESPNOW_MAX_FRAME];
+  } queuedFrame;
+queuedFrame espNowQueue[ESPNOW_QUEUE_SIZE];
+volatile uint8_t espNowHead=0; //next one to forward
+volatile uint8_t espNowTail=0; //next free entry
+espNowSeen espNowHeard; //the last sequence number forwarded for each node
+bool espNowListening=false; //ESP-NOW has started, so the paired nodes can be made peers
+uint8_t espNowPeers[ESPNOW_NODE_COUNT][MAC_BYTES]; //the nodes that are ESP-NOW peers with the key
+uint8_t espNowPeerCount=0;
+struct
+  {
+  uint32_t forwarded;
+  uint32_t duplicates; //sent again by a node that missed the acknowledgement
+  uint32_t dropped; //the queue was full
+  uint32_t bad; //not one of our frames
+  uint32_t failed; //couldn't publish it
+  uint32_t unknown; //from a node that isn't paired
+  uint32_t refused; //for a topic outside the node's topic root, or a command topic
+  } gatewayStats;
+#endif
 AsyncWebServer server(80);
 
-String commandString = "";     // a String to hold incoming commands from serial
-bool commandComplete = false;  // goes true when enter is pressed
+char serialLine[SERIAL_LINE_SIZE]; // the command being typed on the serial port
+size_t serialLineLength=0;
+bool serialLineTooLong=false;  // the line being typed didn't fit and will be thrown away
 
 typedef struct //these are the ports to monitor
   {
@@ -71,6 +136,13 @@ typedef struct //these are the ports to monitor
   bool usePullup;
   } port;
 
+// A node the ESP-NOW gateway forwards for, and the topic root it may publish under
+typedef struct
+  {
+  uint8_t mac[MAC_BYTES];
+  char topicRoot[MQTT_TOPIC_SIZE]; //empty if this entry isn't being used
+  } espNowNode;
+
 // These are the settings that get stored in EEPROM.  They are all in one struct which
 // makes it easier to store and retrieve.
 typedef struct 
@@ -90,17 +162,203 @@ typedef struct
   ulong reportInterval=DEFAULT_REPORT_INTERVAL; //How long to wait between checks
   char mdnsName[ADDRESS_SIZE]=""; //Name to use for MDNS (without .local suffix)
   port ports[PORT_COUNT];
+
+  // Fields below were added after the original layout. Always append, never insert,
+  // and bump SETTINGS_VERSION so upgradeSettings() can fill in the defaults.
+  uint16_t settingsVersion=SETTINGS_VERSION;
+  bool changeOnly=false; //only publish values that changed since they were last published
+  uint16_t fullSyncInterval=DEFAULT_FULL_SYNC_INTERVAL; //publish everything every this many reports anyway
+  uint8_t rssiDeadband=DEFAULT_RSSI_DEADBAND; //dBm
+  uint16_t vccDeadband=DEFAULT_VCC_DEADBAND; //millivolts
+  uint16_t heapDeadband=DEFAULT_HEAP_DEADBAND; //bytes, for both freeHeap and maxBlockSize
+  uint8_t fragDeadband=DEFAULT_FRAG_DEADBAND; //percent
+  int8_t wakePort=NO_WAKE_PORT; //GPIO that also pulses the reset pin through the wake circuit
+  uint8_t samplesPerReport=DEFAULT_SAMPLES_PER_REPORT; //wakes per reportInterval, all but the last with the radio off
+  uint32_t rfCalInterval=DEFAULT_RF_CAL_INTERVAL; //seconds between full RF calibrations, 0 for every wake
+  char gateway[ADDRESS_SIZE]=""; //router address to use with a static address
+  char dns[ADDRESS_SIZE]=""; //DNS server to use with a static address
+  uint32_t cacheTtl=DEFAULT_CACHE_TTL; //seconds to trust the cached lease, channel and broker address
+  bool lightSleep=true; //let the radio and CPU light sleep while waiting for configuration changes
+  bool binaryReport=false; //publish each report as one packed struct on <topicroot>/bin instead of text
+  bool asyncMqtt=false; //use the non-blocking MQTT client with a window of QoS1 publishes
+  bool persistentSession=true; //keep the broker session, so commands sent while asleep are delivered on waking
+  bool mqtt5=false; //speak MQTT 5 on the async client, for topic aliases and correlated command replies
+  bool mqttTls=false; //connect to the broker with TLS
+  char tlsFingerprint[TLS_FINGERPRINT_SIZE]=""; //SHA-1 fingerprint of the broker's certificate, in hex
+  char backupBrokers[BACKUP_BROKER_COUNT][BROKER_ENTRY_SIZE]={"",""}; //host or host:port, tried in turn if the main broker is down
+  bool espNow=false; //on wakes from deep sleep, publish through an ESP-NOW gateway instead of joining WiFi
+  char espNowGateway[MAC_TEXT_SIZE]=""; //the gateway's MAC address
+  uint8_t espNowChannel=0; //the gateway's WiFi channel, 0 for the one the access point was on last time
+  uint16_t awakeBudget=DEFAULT_AWAKE_BUDGET; //seconds a timer or change wake gets to report, 0 for no limit
+  uint8_t apAfterFailures=DEFAULT_AP_AFTER_FAILURES; //such wakes that can't join WiFi in a row before opening AP mode, 0 for never
+  uint32_t maxSleep=DEFAULT_MAX_SLEEP; //longest single deep sleep in seconds, 0 for as long as the chip allows
+  bool slotted=false; //wake at this device's own point in each interval, kept there with the time from SNTP
+  char timeServer[ADDRESS_SIZE]=DEFAULT_TIME_SERVER; //SNTP server for slotted wakes
+  char espNowKey[ESPNOW_KEY_SIZE]=""; //the key frames between the nodes and the gateway are encrypted with, in hex
+  espNowNode espNowNodes[ESPNOW_NODE_COUNT]; //on a gateway, the nodes it forwards for
   } conf;
 conf settings; //all settings in one struct makes it easier to store in EEPROM
 boolean settingsAreValid=false;
+static_assert(PORT_COUNT==GPIO_PORT_COUNT, "settings.ports[] must match the GPIO map");
+
+// Every topic that is published or subscribed to, indexed by TOPIC_*. Rebuilt from
+// the topic root whenever the settings are loaded or saved, so a publish doesn't
+// have to put its topic together. The strings all live in one block, topicStore.
+const char* topics[TOPIC_COUNT];
+char* topicStore=NULL;
+const char* const topicSuffixes[TOPIC_COUNT]=
+  {
+  MQTT_PAYLOAD_STATUS_COMMAND, //TOPIC_STATUS
+  MQTT_TOPIC_PORT_STATE,
+  MQTT_TOPIC_WAKE_CAUSE,
+  MQTT_TOPIC_WAKE_PORT,
+  MQTT_TOPIC_SUMMARY,
+  MQTT_TOPIC_RSSI,
+  MQTT_TOPIC_BATTERY,
+  MQTT_TOPIC_FREE_HEAP,
+  MQTT_TOPIC_HEAP_FRAGMENTATION,
+  MQTT_TOPIC_MAX_FREE_BLOCK_SIZE,
+  MQTT_TOPIC_BINARY_REPORT,
+  MQTT_TOPIC_COMMAND_REQUEST,
+  };
+
+// The active ports, rebuilt from settings.ports[] whenever the settings are loaded or saved
+uint16_t activePortMask=0; //one bit per port index
+uint8_t activePortCount=0;
+uint8_t activePorts[PORT_COUNT]; //port indexes of the active ports, in order
 
 IPAddress ip;
 IPAddress mask;
+IPAddress gateway;
+IPAddress dns;
+
+// The last value published for each port and metric, so unchanged ones can be skipped
+typedef struct
+  {
+  uint16_t validMask; //one bit per port index, then the CACHE_BIT_* metric bits
+  uint16_t portLevels; //one bit per port index
+  int16_t rssi;
+  uint16_t vccMilliVolts;
+  uint32_t freeHeap;
+  uint32_t maxFreeBlockSize;
+  uint8_t heapFragmentation;
+  uint16_t reportsSinceSync; //reports since the last one that published everything
+  } publishCache;
+
+// The levels of all active ports, read at the same instant
+typedef struct
+  {
+  uint16_t levels; //one bit per port index
+  uint32_t millis; //when they were read
+  uint32_t clockSeconds; //the same, as estimated seconds since power up
+  } portSnapshot;
+
+// Summary of the samples taken on the short wakes between reports
+typedef struct
+  {
+  uint16_t count; //samples taken since the last summary was published
+  uint16_t lastLevels; //port levels at the previous sample, for counting transitions
+  uint16_t highCount[PORT_COUNT]; //number of samples each port was high
+  uint16_t transitions[PORT_COUNT]; //number of times each port changed between samples
+  uint16_t vccMin; //millivolts
+  uint16_t vccMax;
+  } sampleSummary;
+
+// Network details from the last good connection. With these a wake can skip DHCP,
+// the scan for the access point, and the DNS lookup of the broker.
+typedef struct
+  {
+  uint32_t ip; //DHCP lease, 0 if there isn't one cached
+  uint32_t gateway;
+  uint32_t netmask;
+  uint32_t dns;
+  uint32_t leaseSeconds; //clockSeconds when the lease was cached
+  uint8_t bssid[6]; //the access point we were connected to
+  uint8_t channel; //its channel, 0 if not cached
+  bool tlsSessionValid; //tlsSession holds the session from the last TLS connection
+  int8_t tlsBroker; //the broker it is a session with
+  uint8_t tlsSession[sizeof(BearSSL::Session)];
+  } networkCache;
+
+// How each broker has been doing, so the quickest one that is up can be tried first
+typedef struct
+  {
+  uint32_t ip; //its resolved address, 0 if not cached
+  uint32_t ipSeconds; //clockSeconds when the address was resolved
+  uint16_t connectMs; //recent time to connect, averaged, 0 if never measured
+  uint8_t failures; //connection attempts that failed in a row
+  uint32_t failSeconds; //clockSeconds of the last failure
+  } brokerHealth;
+
+// Everything that needs to survive deep sleep. This lives in the RTC user memory,
+// which is kept through deep sleep but is garbage after a power cycle.
+typedef struct
+  {
+  uint32_t crc; //crc32 of everything after this field
+  uint16_t size; //sizeof(rtcState) when written, so a new layout after an update is not misread
+  publishCache cache;
+  uint16_t sleepLevels; //port levels just before going to sleep, one bit per port index
+  uint16_t sleepLevelsValid; //ports whose bit in sleepLevels was actually read
+  sampleSummary summary;
+  uint8_t nextWakeRf; //the RFMode given to the last deep sleep, so we know if the radio is on
+  bool changePending; //a port changed on a wake with the radio off, so we rebooted to report it
+  int8_t pendingGpio; //the port that changed
+  uint32_t clockSeconds; //estimated seconds since power up, as of the last time we went to sleep
+  uint32_t lastRfCalSeconds; //clockSeconds at the last wake with a full RF calibration
+  bool rfCalNeeded; //calibrate on the next wake that uses the radio, whatever the interval says
+  networkCache net;
+  brokerHealth brokers[MAX_BROKERS]; //the main broker, then the backups
+  uint8_t currentBroker; //the broker last connected to
+  uint16_t espNowSequence; //of the last frame sent to the ESP-NOW gateway
+  bool espNowFailed; //the gateway didn't answer on the last wake, so this one uses WiFi
+  uint8_t wakeFailures; //wakes in a row that used up the awake budget without reporting
+  uint8_t failedPhase; //the PHASE_* the last one was in
+  uint8_t wifiFailures; //wakes in a row that gave up before joining WiFi, for apafterfailures
+  uint32_t sleepRemaining; //seconds still to sleep after this segment of a chained sleep, 0 if it's the last
+  uint8_t chainRf; //the RFMode for the wake at the end of the chain
+  uint64_t clockBaseMs; //Unix time in ms at the start of the last wake SNTP answered on, 0 if not known
+  uint32_t awakeMs; //time spent awake since then, by the CPU clock
+  uint32_t askedSleepMs; //deep sleep asked for since then, by the slower and less exact RTC clock
+  int32_t driftPpm; //how much longer than asked a deep sleep actually lasts, in parts per million
+  bool driftMeasured; //driftPpm has been measured at least once
+  } rtcState;
+static_assert(sizeof(rtcState)<=512,"rtcState must fit in the 512 bytes of RTC user memory");
+rtcState rtc;
+
+portSnapshot bootSnapshot; //port levels read as early as possible after waking
+const char* wakeCause=WAKE_CAUSE_POWER; //why we woke up, one of the WAKE_CAUSE_* values
+int8_t wakeGpio=NO_WAKE_PORT; //the port that caused the wake, if we know
+bool wakeReported=false; //the wake cause goes out with the first report only
+ulong sntpStartMs=0; //when the time was asked for on this wake, 0 if it wasn't
+bool budgetActive=false; //this wake has to report within settings.awakeBudget or go back to sleep
+uint8_t wakePhase=PHASE_STARTING;
+ulong phaseStartMs=0; //millis() when this phase started
+const uint32_t phaseBudgetMs[PHASE_COUNT]=
+  {
+  UINT32_MAX, //starting, only limited by the whole budget
+  WIFI_PHASE_BUDGET_MS,
+  DHCP_PHASE_BUDGET_MS,
+  BROKER_PHASE_BUDGET_MS,
+  PUBLISH_PHASE_BUDGET_MS,
+  };
+const char* const phaseNames[PHASE_COUNT]=
+  {
+  "starting",
+  "joining WiFi",
+  "getting an address",
+  "connecting to the broker",
+  "publishing",
+  };
 
 ulong keepAwake=0; //this will be updated to allow more time to change settings on the web page
+ulong lastActivity=0; //millis() of the last web request, command or keystroke
+bool lowPowerIdle=false; //true while idling in light sleep
 
-String webMessage="";
+char webMessage[WEB_MESSAGE_SIZE]=""; //shown once on the next page load
+uint8_t requestArenaBuffer[REQUEST_ARENA_SIZE]; //working space for one request at a time
+arena requestArena=ARENA_INIT(requestArenaBuffer);
 bool apModeActive=false;
+extern task tasks[TASK_COUNT]; //the table is at the end, below the functions it runs
 
 // These are handy ESP metrics that can be used to measure performance and status.
 // --- System/Resource Metrics ---
@@ -131,46 +389,15 @@ bool apModeActive=false;
 // uint8_t connectedApClients = WiFi.softAPgetStationNum(); // Only if in AP mode
 
 
-// Accept a port number, and return the index into the settings.ports[] for that port
-// Only works for ports 0-5 and 12-16.  Returns -1 otherwise.
-int8_t portIndex(int8_t portNumber)
-  {
-  if (portNumber>16 || (portNumber>5 && portNumber<12))
-    {
-    Serial.print("Port ");
-    Serial.print(portNumber);
-    Serial.println(" is invalid.");
-    return -1;
-    }
-  if (portNumber<=5)
-    return portNumber;
-  else
-    return portNumber-6;
-  }
-
-// Accept an index into the ports[] array, and return the GPIO number for that port
-// Index must be 0-10. This function is the opposite of portIndex()
-int8_t indexPort(uint8_t index)
-  {
-  if (index>10)
-    {
-    Serial.print("Index ");
-    Serial.print(index);
-    Serial.println(" is invalid.");
-    return -1;
-    }
-  if (index<=5)
-    return index;
-  else
-    return index+6;
-  }
-
 // This will replace placeholders in the HTML with actual settings
 String processor(const String& var) 
   {
+  AUDIT_SUBSYSTEM(SUBSYSTEM_WEB);
   char buf[max(SSID_SIZE,max(PASSWORD_SIZE,max(USERNAME_SIZE,MQTT_TOPIC_SIZE)))];
   if (var =="broker")           return settings.mqttBrokerAddress;
   if (var =="port")             return itoa(settings.mqttBrokerPort,buf,10);
+  if (var =="broker2")          return settings.backupBrokers[0];
+  if (var =="broker3")          return settings.backupBrokers[1];
   if (var =="topicroot")        return settings.mqttTopicRoot;
   if (var =="user")             return settings.mqttUsername;
   if (var =="pass")             return settings.mqttPassword; 
@@ -178,9 +405,37 @@ String processor(const String& var)
   if (var =="wifipass")         return settings.wifiPassword;
   if (var =="address")          return settings.address     ;
   if (var =="netmask")          return settings.netmask     ;
+  if (var =="gateway")          return settings.gateway     ;
+  if (var =="dns")              return settings.dns         ;
+  if (var =="cachettl")         return ultoa(settings.cacheTtl,buf,10);
+  if (var =="lightsleepChecked") return settings.lightSleep?" checked":"";
+  if (var =="binaryreportChecked") return settings.binaryReport?" checked":"";
+  if (var =="mqttasyncChecked") return settings.asyncMqtt?" checked":"";
+  if (var =="persistentsessionChecked") return settings.persistentSession?" checked":"";
+  if (var =="mqtt5Checked")     return settings.mqtt5?" checked":"";
+  if (var =="mqtttlsChecked")   return settings.mqttTls?" checked":"";
+  if (var =="tlsfingerprint")   return settings.tlsFingerprint;
+  if (var =="espnowChecked")    return settings.espNow?" checked":"";
+  if (var =="espnowgateway")    return settings.espNowGateway;
+  if (var =="espnowchannel")    return itoa(settings.espNowChannel,buf,10);
+  if (var =="espnowkey")        return settings.espNowKey;
   if (var =="debugChecked")     return settings.debug?" checked":"";
   if (var =="reportinterval")   return itoa(settings.reportInterval,buf,10);
   if (var =="mdnsname")         return settings.mdnsName     ;
+  if (var =="changeonlyChecked") return settings.changeOnly?" checked":"";
+  if (var =="fullsync")         return itoa(settings.fullSyncInterval,buf,10);
+  if (var =="rssideadband")     return itoa(settings.rssiDeadband,buf,10);
+  if (var =="vccdeadband")      return itoa(settings.vccDeadband,buf,10);
+  if (var =="heapdeadband")     return itoa(settings.heapDeadband,buf,10);
+  if (var =="fragdeadband")     return itoa(settings.fragDeadband,buf,10);
+  if (var =="wakeport")         return settings.wakePort==NO_WAKE_PORT?"":itoa(settings.wakePort,buf,10);
+  if (var =="samples")          return itoa(settings.samplesPerReport,buf,10);
+  if (var =="rfcalinterval")    return ultoa(settings.rfCalInterval,buf,10);
+  if (var =="awakebudget")      return itoa(settings.awakeBudget,buf,10);
+  if (var =="apafterfailures")  return itoa(settings.apAfterFailures,buf,10);
+  if (var =="maxsleep")         return ultoa(settings.maxSleep,buf,10);
+  if (var =="slottedChecked")   return settings.slotted?" checked":"";
+  if (var =="timeserver")       return settings.timeServer;
   if (var =="gpio0Checked")     return settings.ports[0].isActive?" checked":"";
   if (var =="gpio0highval")     return settings.ports[0].highMessage;
   if (var =="gpio0lowval")      return settings.ports[0].lowMessage;
@@ -239,7 +494,7 @@ String processor(const String& var)
   if (var =="message")       
     {
     String msg=webMessage;
-    webMessage="";    //only display the message once
+    webMessage[0]='\0';    //only display the message once
     Serial.println(msg);
     return msg; 
     }
@@ -254,6 +509,14 @@ void showSettings()
   Serial.print("port=<port number>   (");
   Serial.print(settings.mqttBrokerPort);
   Serial.println(")");
+  for (uint8_t i=0;i<BACKUP_BROKER_COUNT;i++)
+    {
+    Serial.printf("broker%d=<backup broker host name or address[:port]> (",i+2);
+    Serial.print(settings.backupBrokers[i]);
+    Serial.println(")");
+    }
+  if (settings.debug)
+    showBrokerHealth();
   Serial.print("topicroot=<topic root> (");
   Serial.print(settings.mqttTopicRoot);
   Serial.println(")  Note: must end with \"/\"");  
@@ -275,6 +538,15 @@ void showSettings()
   Serial.print("netmask=<Network mask to be used with static IP> (");
   Serial.print(settings.netmask);
   Serial.println(")");
+  Serial.print("gateway=<Router address to be used with static IP> (");
+  Serial.print(settings.gateway);
+  Serial.println(")");
+  Serial.print("dns=<DNS server to be used with static IP> (");
+  Serial.print(settings.dns);
+  Serial.println(")");
+  Serial.print("cachettl=<seconds> (");
+  Serial.print(settings.cacheTtl);
+  Serial.println(")  How long to reuse the DHCP lease, WiFi channel and broker address between wakes");
   Serial.print("mdnsname=<Name to use (without .local) for MDNS> (");
   Serial.print(settings.mdnsName);
   Serial.println(")");
@@ -284,6 +556,104 @@ void showSettings()
   Serial.print("reportinterval=<seconds>   (");
   Serial.print(settings.reportInterval);
   Serial.println(")");
+  Serial.print("changeonly=1|0 (");
+  Serial.print(settings.changeOnly);
+  Serial.println(")  Only publish values that have changed");
+  Serial.print("fullsync=<reports> (");
+  Serial.print(settings.fullSyncInterval);
+  Serial.println(")  In changeonly mode, publish everything every this many reports (0=never)");
+  Serial.print("rssideadband=<dBm> (");
+  Serial.print(settings.rssiDeadband);
+  Serial.println(")");
+  Serial.print("vccdeadband=<millivolts> (");
+  Serial.print(settings.vccDeadband);
+  Serial.println(")");
+  Serial.print("heapdeadband=<bytes> (");
+  Serial.print(settings.heapDeadband);
+  Serial.println(")");
+  Serial.print("fragdeadband=<percent> (");
+  Serial.print(settings.fragDeadband);
+  Serial.println(")");
+  Serial.print("wakeport=<GPIO wired to the wake circuit, NULL for none> (");
+  if (settings.wakePort!=NO_WAKE_PORT)
+    Serial.print(settings.wakePort);
+  Serial.println(")");
+  Serial.print("samples=<samples per report> (");
+  Serial.print(settings.samplesPerReport);
+  Serial.println(")  1 to only read the ports when reporting");
+  Serial.print("rfcalinterval=<seconds> (");
+  Serial.print(settings.rfCalInterval);
+  Serial.println(")  Time between full radio calibrations, 0 for every wake");
+  Serial.print("awakebudget=<seconds> (");
+  Serial.print(settings.awakeBudget);
+  Serial.println(")  Longest a timer or change wake can take to report, 0 for no limit");
+  Serial.print("apafterfailures=<wakes> (");
+  Serial.print(settings.apAfterFailures);
+  Serial.println(")  Open AP mode after this many such wakes in a row can't join WiFi, 0 for never");
+  Serial.print("maxsleep=<seconds> (");
+  Serial.print(settings.maxSleep);
+  Serial.println(")  Longest single deep sleep, longer ones are chained. 0 for as long as the chip allows");
+  Serial.print("slotted=1|0 (");
+  Serial.print(settings.slotted);
+  Serial.println(")  Wake at this device's own time in each interval, set from the client ID");
+  Serial.print("timeserver=<SNTP server> (");
+  Serial.print(settings.timeServer);
+  Serial.println(")  Where slotted wakes get the time");
+  Serial.print("lightsleep=1|0 (");
+  Serial.print(settings.lightSleep);
+  Serial.println(")  Light sleep while waiting for configuration changes");
+  Serial.print("binaryreport=1|0 (");
+  Serial.print(settings.binaryReport);
+  Serial.println(")  Publish each report as one binary message on <topicroot>/" MQTT_TOPIC_BINARY_REPORT);
+  Serial.print("mqttasync=1|0 (");
+  Serial.print(settings.asyncMqtt);
+  Serial.println(")  Publish without waiting on the broker, several at a time");
+  Serial.print("persistentsession=1|0 (");
+  Serial.print(settings.persistentSession);
+  Serial.println(")  Have the broker keep commands sent while asleep");
+  Serial.print("mqtt5=1|0 (");
+  Serial.print(settings.mqtt5);
+  Serial.println(")  Use MQTT 5 topic aliases and command replies, with mqttasync only");
+  Serial.print("mqtttls=1|0 (");
+  Serial.print(settings.mqttTls);
+  Serial.println(")  Connect to the broker with TLS, usually on port 8883");
+  Serial.print("tlsfingerprint=<SHA-1 fingerprint of the broker's certificate> (");
+  Serial.print(settings.tlsFingerprint);
+  Serial.println(")");
+  Serial.print("espnow=1|0 (");
+  Serial.print(settings.espNow);
+  Serial.println(")  Report through an ESP-NOW gateway when waking from sleep");
+  Serial.print("espnowgateway=<MAC address of the ESP-NOW gateway> (");
+  Serial.print(settings.espNowGateway);
+  Serial.println(")");
+  Serial.print("espnowchannel=<gateway's WiFi channel, 0 for the last one used> (");
+  Serial.print(settings.espNowChannel);
+  Serial.println(")");
+  Serial.print("espnowkey=<16 byte key shared by the nodes and the gateway> (");
+  Serial.print(settings.espNowKey);
+  Serial.println(")");
+#ifdef ESPNOW_GATEWAY
+  Serial.printf("This is an ESP-NOW gateway with MAC address %s, on channel %d\n",
+                WiFi.macAddress().c_str(),WiFi.channel());
+  Serial.printf("Forwarded %u, duplicates %u, dropped %u, bad %u, failed %u, unknown %u, refused %u\n",
+                gatewayStats.forwarded,gatewayStats.duplicates,gatewayStats.dropped,
+                gatewayStats.bad,gatewayStats.failed,gatewayStats.unknown,gatewayStats.refused);
+  bool noNodes=true;
+  for (uint8_t i=0;i<ESPNOW_NODE_COUNT;i++)
+    {
+    espNowNode& n=settings.espNowNodes[i];
+    if (n.topicRoot[0]!='\0')
+      {
+      Serial.printf("Node %02x:%02x:%02x:%02x:%02x:%02x\tTopic Root=%s\n",
+                    n.mac[0],n.mac[1],n.mac[2],n.mac[3],n.mac[4],n.mac[5],n.topicRoot);
+      noNodes=false;
+      }
+    }
+  if (noNodes)
+    Serial.println("No ESP-NOW nodes paired.");
+  Serial.println("To pair a node, use \"espnowpair=mac,topicroot\"");
+  Serial.println("To unpair a node, use \"espnowunpair=mac\"");
+#endif
   
   Serial.println("Ports:");
   bool noActivePorts=true;
@@ -318,220 +688,347 @@ void showSettings()
   }
 
   
+// Point out the things about a GPIO that can keep a switch on it from working
+void showPortWarnings(uint8_t gpio, bool usePullup)
+  {
+  uint8_t flags=gpioFlags(gpio);
+  if (usePullup && !(flags&GPIO_CAN_PULLUP))
+    Serial.printf("GPIO%d has no internal pullup, so an external resistor is needed.\n",gpio);
+  if (flags&GPIO_BOOT_HIGH)
+    Serial.printf("GPIO%d must be high at boot, so the switch must not hold it low when waking.\n",gpio);
+  if (flags&GPIO_BOOT_LOW)
+    Serial.printf("GPIO%d must be low at boot, so the switch must not hold it high when waking.\n",gpio);
+  if (flags&(GPIO_IS_TX|GPIO_IS_RX))
+    Serial.printf("GPIO%d is used by the serial port, which will be turned off.\n",gpio);
+  }
+
 /*
- * Check for configuration input via the serial port.  Return a null string 
- * if no input is available or return the complete line otherwise.
+ * Apply one "name=value" command from the serial port or MQTT. The line is
+ * parsed where it sits, so it doesn't need to be null terminated and isn't
+ * changed. Returns PARSE_OK if a setting was changed, or the reason it wasn't.
  */
-String getConfigCommand()
+parseResult processCommand(const char* line, size_t length)
   {
-  if (commandComplete) 
+  command cmd;
+  parseResult rc=parseCommand(line,length,cmd);
+  if (rc==PARSE_EMPTY) //a single cr means show current settings
+    {
+    showSettings();
+    return rc;
+    }
+  if (rc!=PARSE_OK)
     {
-    Serial.println(commandString);
-    String newCommand=commandString;
-    if (newCommand.length()==0)
-      newCommand='\n'; //to show available commands
+    Serial.print("Incoming command rejected: ");
+    Serial.println(parseResultText(rc));
+    return rc;
+    }
 
-    commandString = "";
-    commandComplete = false;
-    return newCommand;
+  keepAwake=millis()+STAY_AWAKE_INCREMENT; //stay awake a little longer for more web changes
+  noteActivity();
+
+  if (cmd.value.length==0) //nothing after the =, so there is nothing to set
+    {
+    Serial.println(parseResultText(PARSE_NO_VALUE));
+    return PARSE_NO_VALUE;
     }
-  else return "";
-  }
 
-bool processCommand(String cmd)
-  {
-  bool commandFound=true; //saves a lot of code
-  char nme[MAX_COMMAND_SIZE]; //shouldn't get any commands larger than this
-  const char *str=cmd.c_str();
-  char *val=NULL;
-  char *nme_t=strtok((char *)str,"=");
-  if (strlen(nme_t)<MAX_COMMAND_SIZE)
+  textView val=cmd.value;
+  uint32_t number=0;
+  if (viewIs(cmd.name,"broker"))
+    rc=copyView(val,settings.mqttBrokerAddress,sizeof(settings.mqttBrokerAddress));
+  else if (viewIs(cmd.name,"port"))
+    {
+    rc=viewToUnsigned(val,0,65535,number);
+    if (rc==PARSE_OK)
+      settings.mqttBrokerPort=number;
+    }
+  else if (viewIs(cmd.name,"broker2") || viewIs(cmd.name,"broker3"))
+    {
+    rc=checkBrokerEntry(val);
+    if (rc==PARSE_OK)
+      rc=copyView(val,settings.backupBrokers[cmd.name.text[6]-'2'],BROKER_ENTRY_SIZE);
+    }
+  else if (viewIs(cmd.name,"topicroot"))
+    {
+    rc=copyView(val,settings.mqttTopicRoot,sizeof(settings.mqttTopicRoot)-1); //leave room for the /
+    size_t len=strlen(settings.mqttTopicRoot);
+    if (rc==PARSE_OK && (len==0 || settings.mqttTopicRoot[len-1]!='/')) // must end with a /
+      strcat(settings.mqttTopicRoot,"/");
+    }
+  else if (viewIs(cmd.name,"user"))
+    rc=copyView(val,settings.mqttUsername,sizeof(settings.mqttUsername));
+  else if (viewIs(cmd.name,"pass"))
+    rc=copyView(val,settings.mqttPassword,sizeof(settings.mqttPassword));
+  else if (viewIs(cmd.name,"ssid"))
+    rc=copyView(val,settings.ssid,sizeof(settings.ssid));
+  else if (viewIs(cmd.name,"wifipass"))
+    rc=copyView(val,settings.wifiPassword,sizeof(settings.wifiPassword));
+  else if (viewIs(cmd.name,"address"))
+    rc=copyView(val,settings.address,sizeof(settings.address));
+  else if (viewIs(cmd.name,"mdnsname"))
+    rc=copyView(val,settings.mdnsName,sizeof(settings.mdnsName));
+  else if (viewIs(cmd.name,"netmask"))
+    rc=copyView(val,settings.netmask,sizeof(settings.netmask));
+  else if (viewIs(cmd.name,"gateway"))
+    rc=copyView(val,settings.gateway,sizeof(settings.gateway));
+  else if (viewIs(cmd.name,"dns"))
+    rc=copyView(val,settings.dns,sizeof(settings.dns));
+  else if (viewIs(cmd.name,"cachettl"))
+    rc=viewToUnsigned(val,0,UINT32_MAX,settings.cacheTtl);
+  else if (viewIs(cmd.name,"debug"))
+    rc=viewToBool(val,settings.debug);
+  else if (viewIs(cmd.name,"reportinterval"))
+    {
+    rc=viewToUnsigned(val,0,UINT32_MAX,number);
+    if (rc==PARSE_OK)
+      settings.reportInterval=number;
+    }
+  else if (viewIs(cmd.name,"changeonly"))
+    rc=viewToBool(val,settings.changeOnly);
+  else if (viewIs(cmd.name,"fullsync"))
+    {
+    rc=viewToUnsigned(val,0,UINT16_MAX,number);
+    if (rc==PARSE_OK)
+      settings.fullSyncInterval=number;
+    }
+  else if (viewIs(cmd.name,"rssideadband"))
+    {
+    rc=viewToUnsigned(val,0,UINT8_MAX,number);
+    if (rc==PARSE_OK)
+      settings.rssiDeadband=number;
+    }
+  else if (viewIs(cmd.name,"vccdeadband"))
+    {
+    rc=viewToUnsigned(val,0,UINT16_MAX,number);
+    if (rc==PARSE_OK)
+      settings.vccDeadband=number;
+    }
+  else if (viewIs(cmd.name,"heapdeadband"))
     {
-    strcpy(nme,nme_t);//Don't modify c_str() pointers
-    if (nme_t!=NULL)
-      val=strtok(NULL,"=");
+    rc=viewToUnsigned(val,0,UINT16_MAX,number);
+    if (rc==PARSE_OK)
+      settings.heapDeadband=number;
+    }
+  else if (viewIs(cmd.name,"fragdeadband"))
+    {
+    rc=viewToUnsigned(val,0,100,number);
+    if (rc==PARSE_OK)
+      settings.fragDeadband=number;
+    }
+  else if (viewIs(cmd.name,"wakeport"))
+    {
+    if (viewIs(val,"NULL"))
+      settings.wakePort=NO_WAKE_PORT;
     else
-      strcpy(nme,"\n"); 
-    
-    if (nme[0]=='\n' || nme[0]=='\r' || nme[0]=='\0') //a single cr means show current settings
       {
-      showSettings();
-      commandFound=false; //command not found
+      rc=viewToUnsigned(val,0,16,number);
+      if (rc==PARSE_OK && portIndex(number)<0)
+        rc=PARSE_BAD_PORT;
+      if (rc==PARSE_OK)
+        settings.wakePort=number;
       }
+    }
+  else if (viewIs(cmd.name,"samples"))
+    {
+    rc=viewToUnsigned(val,1,MAX_SAMPLES_PER_REPORT,number);
+    if (rc==PARSE_OK)
+      settings.samplesPerReport=number;
+    }
+  else if (viewIs(cmd.name,"lightsleep"))
+    rc=viewToBool(val,settings.lightSleep);
+  else if (viewIs(cmd.name,"binaryreport"))
+    rc=viewToBool(val,settings.binaryReport);
+  else if (viewIs(cmd.name,"mqttasync"))
+    rc=viewToBool(val,settings.asyncMqtt);
+  else if (viewIs(cmd.name,"persistentsession"))
+    rc=viewToBool(val,settings.persistentSession);
+  else if (viewIs(cmd.name,"mqtt5"))
+    rc=viewToBool(val,settings.mqtt5);
+  else if (viewIs(cmd.name,"mqtttls"))
+    rc=viewToBool(val,settings.mqttTls);
+  else if (viewIs(cmd.name,"tlsfingerprint"))
+    {
+    uint8_t fingerprint[FINGERPRINT_BYTES];
+    if (!viewIs(val,"NULL") && !viewToFingerprint(val,fingerprint))
+      rc=PARSE_BAD_FINGERPRINT;
     else
-      {
-      //Get rid of the carriage return
-      if (val!=NULL && strlen(val)>0 && val[strlen(val)-1]==13)
-        val[strlen(val)-1]=0; 
+      rc=copyView(val,settings.tlsFingerprint,sizeof(settings.tlsFingerprint));
+    }
+  else if (viewIs(cmd.name,"espnow"))
+    rc=viewToBool(val,settings.espNow);
+  else if (viewIs(cmd.name,"espnowgateway"))
+    {
+    uint8_t mac[MAC_BYTES];
+    if (!viewIs(val,"NULL") && !viewToMac(val,mac))
+      rc=PARSE_BAD_MAC;
+    else
+      rc=copyView(val,settings.espNowGateway,sizeof(settings.espNowGateway));
+    }
+  else if (viewIs(cmd.name,"espnowchannel"))
+    {
+    rc=viewToUnsigned(val,0,ESPNOW_MAX_CHANNEL,number);
+    if (rc==PARSE_OK)
+      settings.espNowChannel=number;
+    }
+  else if (viewIs(cmd.name,"espnowkey"))
+    {
+    uint8_t key[ESPNOW_KEY_BYTES];
+    if (!viewIs(val,"NULL") && !viewToKey(val,key))
+      rc=PARSE_BAD_KEY;
+    else
+      rc=copyView(val,settings.espNowKey,sizeof(settings.espNowKey));
+    }
+  else if (viewIs(cmd.name,"rfcalinterval"))
+    rc=viewToUnsigned(val,0,UINT32_MAX,settings.rfCalInterval);
+  else if (viewIs(cmd.name,"awakebudget"))
+    {
+    rc=viewToUnsigned(val,0,MAX_AWAKE_BUDGET,number);
+    if (rc==PARSE_OK)
+      settings.awakeBudget=number;
+    }
+  else if (viewIs(cmd.name,"apafterfailures"))
+    {
+    rc=viewToUnsigned(val,0,UINT8_MAX,number);
+    if (rc==PARSE_OK)
+      settings.apAfterFailures=number;
+    }
+  else if (viewIs(cmd.name,"maxsleep"))
+    {
+    rc=viewToUnsigned(val,0,UINT32_MAX,number);
+    if (rc==PARSE_OK)
+      settings.maxSleep=number==0?0:max(number,(uint32_t)MIN_MAX_SLEEP);
+    }
+  else if (viewIs(cmd.name,"slotted"))
+    rc=viewToBool(val,settings.slotted);
+  else if (viewIs(cmd.name,"timeserver"))
+    rc=copyView(val,settings.timeServer,sizeof(settings.timeServer));
+
+#ifdef ESPNOW_GATEWAY
+  // "espnowpair=mac,topicroot" forwards what that node sends under topicroot
+  else if (viewIs(cmd.name,"espnowpair"))
+    {
+    textView macText={NULL,0}, root={NULL,0};
+    nextField(val,',',macText);
+    nextField(val,',',root);
 
-      if (val!=NULL)
+    uint8_t mac[MAC_BYTES];
+    int8_t index=-1;
+    if (!viewToMac(macText,mac))
+      rc=PARSE_BAD_MAC;
+    else
+      {
+      index=findEspNowNode(mac);
+      for (uint8_t i=0;i<ESPNOW_NODE_COUNT && index<0;i++)
         {
-        if (strcmp(val,"NULL")==0) //to nullify a value, you have to really mean it
-          {
-          strcpy(val,"");
-          }
-        
-        if (strcmp(nme,"broker")==0)
-          {
-          strcpy(settings.mqttBrokerAddress,val);
-          saveSettings();
-          }
-        else if (strcmp(nme,"port")==0)
-          {
-          if (!val)
-            strcpy(val,"0");
-          settings.mqttBrokerPort=atoi(val);
-          saveSettings();
-          }
-        else if (strcmp(nme,"topicroot")==0)
-          {
-          strcpy(settings.mqttTopicRoot,val);
-          if (val[strlen(val)-1] !='/') // must end with a /
-            {
-            strcat(settings.mqttTopicRoot,"/");
-            }
-          saveSettings();
-          }
-        else if (strcmp(nme,"user")==0)
-          {
-          strcpy(settings.mqttUsername,val);
-          saveSettings();
-          }
-        else if (strcmp(nme,"pass")==0)
-          {
-          strcpy(settings.mqttPassword,val);
-          saveSettings();
-          }
-        else if (strcmp(nme,"ssid")==0)
-          {
-          strcpy(settings.ssid,val);
-          saveSettings();
-          }
-        else if (strcmp(nme,"wifipass")==0)
-          {
-          strcpy(settings.wifiPassword,val);
-          saveSettings();
-          }
-        else if (strcmp(nme,"address")==0)
-          {
-          strcpy(settings.address,val);
-          saveSettings();
-          }
-        else if (strcmp(nme,"mdnsname")==0)
-          {
-          strcpy(settings.mdnsName,val);
-          saveSettings();
-          }
-        else if (strcmp(nme,"netmask")==0)
-          {
-          strcpy(settings.netmask,val);
-          saveSettings();
-          }
-        else if (strcmp(nme,"debug")==0)
-          {
-          if (!val)
-            strcpy(val,"0");
-          settings.debug=atoi(val)==1?true:false;
-          saveSettings();
-          }
-        else if (strcmp(nme,"reportinterval")==0)
-          {
-          if (!val)
-            strcpy(val,"0");
-          settings.reportInterval=atoi(val);
-          saveSettings();
-          }
+        if (settings.espNowNodes[i].topicRoot[0]=='\0')
+          index=i;
+        }
+      if (index<0)
+        rc=PARSE_LIST_FULL;
+      }
+    if (rc==PARSE_OK)
+      {
+      espNowNode newNode; //only change the settings if the topic root fits
+      memcpy(newNode.mac,mac,MAC_BYTES);
+      rc=copyView(root,newNode.topicRoot,sizeof(newNode.topicRoot)-1); //leave room for the /
+      size_t len=strlen(newNode.topicRoot);
+      if (rc==PARSE_OK && len==0)
+        rc=PARSE_NO_VALUE;
+      else if (rc==PARSE_OK && newNode.topicRoot[len-1]!='/') // must end with a /
+        strcat(newNode.topicRoot,"/");
+      if (rc==PARSE_OK)
+        settings.espNowNodes[index]=newNode;
+      }
+    }
 
-        // "portadd=gpio,highmessage,lowmessage,usePullup" should add a port
-        else if (strcmp(nme,"portadd")==0)
-          {
-          if (val)
-            {
-            char *portnum=strtok(val,",");
-            char *hitopic=strtok(NULL,",");
-            char *lotopic=strtok(NULL,",");
-            char *usePullup=strtok(NULL,",");
-            uint8_t port=atoi(portnum);
-            int8_t index=portIndex(port);
-            if (index>=0)
-              {
-              settings.ports[index].isActive=true;
-              settings.ports[index].gpioNumber=port;
-              if (hitopic)
-                {  
-                strncpy(settings.ports[index].highMessage,hitopic,MQTT_TOPIC_SUFFIX_SIZE-1);
-                settings.ports[index].highMessage[MQTT_TOPIC_SUFFIX_SIZE-1]='\0'; //ensure null termination
-                }
-              else
-                strcpy(settings.ports[index].highMessage,"high");
-
-              if (lotopic)
-                {  
-                strncpy(settings.ports[index].lowMessage,lotopic,MQTT_TOPIC_SUFFIX_SIZE-1);
-                settings.ports[index].lowMessage[MQTT_TOPIC_SUFFIX_SIZE-1]='\0'; //ensure null termination
-                }
-              else
-                strcpy(settings.ports[index].lowMessage,"low");
-
-              if (usePullup)
-                settings.ports[index].usePullup=true;
-              else
-                settings.ports[index].usePullup=false;
-
-              saveSettings();
-              }
-            else
-              commandFound=false;
-            }
-          }
+  // "espnowunpair=mac" stops forwarding for that node
+  else if (viewIs(cmd.name,"espnowunpair"))
+    {
+    uint8_t mac[MAC_BYTES];
+    if (!viewToMac(val,mac))
+      rc=PARSE_BAD_MAC;
+    else
+      {
+      int8_t index=findEspNowNode(mac);
+      if (index>=0)
+        memset(&settings.espNowNodes[index],0,sizeof(espNowNode));
+      }
+    }
+#endif
 
-        // "portremove=gpio" should remove a port
-      else if (strcmp(nme,"portremove")==0)
-          {
-          if (val)
-            {
-            uint8_t port=atoi(val);
-            int8_t index=portIndex(port);
-            if (index>=0)
-              {
-              settings.ports[index].isActive=false;
-              saveSettings();
-              }
-            else
-              commandFound=false;
-            }
-          }
+  // "portadd=gpio,highmessage,lowmessage,usePullup" should add a port
+  else if (viewIs(cmd.name,"portadd"))
+    {
+    textView portnum, hitopic={NULL,0}, lotopic={NULL,0}, usePullup={NULL,0};
+    nextField(val,',',portnum);
+    nextField(val,',',hitopic);
+    nextField(val,',',lotopic);
+    nextField(val,',',usePullup);
 
-        else if ((strcmp(nme,"resetmqttid")==0)&& (strcmp(val,"yes")==0))
-          {
-          generateMqttClientId(settings.mqttClientId);
-          saveSettings();
-          }
-        else if ((strcmp(nme,"factorydefaults")==0) && (strcmp(val,"yes")==0)) //reset all eeprom settings
-          {
-          Serial.println("\n*********************** Resetting EEPROM Values ************************");
-          initializeSettings();
-          saveSettings();
-          delay(2000);
-          ESP.restart();
-          }
-        else
-          {
-          showSettings();
-          commandFound=false; //command not found
-          }
+    rc=viewToUnsigned(portnum,0,16,number);
+    int8_t index=rc==PARSE_OK?portIndex(number):-1;
+    if (rc==PARSE_OK && index<0)
+      rc=PARSE_BAD_PORT;
+    if (rc==PARSE_OK)
+      {
+      port newPort=settings.ports[index]; //only change the settings if every field fits
+      newPort.isActive=true;
+      newPort.gpioNumber=number;
+      if (hitopic.length>0)
+        rc=copyView(hitopic,newPort.highMessage,sizeof(newPort.highMessage));
+      else
+        strcpy(newPort.highMessage,"high");
+
+      if (rc==PARSE_OK && lotopic.length>0)
+        rc=copyView(lotopic,newPort.lowMessage,sizeof(newPort.lowMessage));
+      else if (rc==PARSE_OK)
+        strcpy(newPort.lowMessage,"low");
+
+      newPort.usePullup=usePullup.length>0;
+
+      if (rc==PARSE_OK)
+        {
+        settings.ports[index]=newPort;
+        showPortWarnings(number,newPort.usePullup);
         }
       }
-    keepAwake=millis()+STAY_AWAKE_INCREMENT; //stay awake a little longer for more web changes
+    }
+
+  // "portremove=gpio" should remove a port
+  else if (viewIs(cmd.name,"portremove"))
+    {
+    rc=viewToUnsigned(val,0,16,number);
+    int8_t index=rc==PARSE_OK?portIndex(number):-1;
+    if (rc==PARSE_OK && index<0)
+      rc=PARSE_BAD_PORT;
+    if (rc==PARSE_OK)
+      settings.ports[index].isActive=false;
+    }
+
+  else if (viewIs(cmd.name,"resetmqttid") && viewIs(val,"yes"))
+    generateMqttClientId(settings.mqttClientId);
+  else if (viewIs(cmd.name,"factorydefaults") && viewIs(val,"yes")) //reset all eeprom settings
+    {
+    Serial.println("\n*********************** Resetting EEPROM Values ************************");
+    initializeSettings();
+    saveSettings();
+    delay(2000);
+    ESP.restart();
     }
   else
     {
-    Serial.print("Incoming command too large: ");
-    Serial.println(nme_t);
-    commandFound=false;
+    showSettings();
+    return PARSE_UNKNOWN_COMMAND;
     }
 
-  return commandFound;
+  if (rc==PARSE_OK)
+    saveSettings();
+  else
+    {
+    Serial.print("Incoming command rejected: ");
+    Serial.println(parseResultText(rc));
+    }
+  return rc;
   }
 
 void initializeSettings()
@@ -551,924 +1048,3070 @@ void initializeSettings()
   generateMqttClientId(settings.mqttClientId);
   for (int i=0;i<PORT_COUNT;i++)
     settings.ports[i].isActive=false;
+  settings.settingsVersion=0; //set all of the newer fields to their defaults too
+  upgradeSettings();
   }
 
-void checkForCommand()
-  {
-  if (Serial.available())
-    {
-    incomingSerialData();
-    String cmd=getConfigCommand();
-    if (cmd.length()>0)
-      {
-      yield();
-      processCommand(cmd);
-      }
-    }
-  }
-
-
-/************************
- * Do the MQTT thing
- ************************/
-bool report()
+/*
+ * Newer settings are appended to the end of the struct. When the settings in EEPROM
+ * were written by an older version, the new fields hold whatever was in flash, so
+ * give them their defaults here. Returns true if anything was changed.
+ */
+bool upgradeSettings()
   {
-  char topic[MQTT_TOPIC_SIZE+9];
-  char reading[18];
-  bool ok=true;
+  if (settings.settingsVersion==SETTINGS_VERSION)
+    return false;
 
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_PAYLOAD_STATUS_COMMAND);
+  if (settings.settingsVersion>SETTINGS_VERSION) //never written, erased flash reads as 0xFFFF
+    settings.settingsVersion=0;
 
-  for (int i=0;i<PORT_COUNT;i++)
+  if (settings.settingsVersion<1)
     {
-    if (settings.ports[i].isActive)
-      {
-      bool switchStatus=digitalRead(settings.ports[i].gpioNumber);
-      publish(topic,switchStatus?settings.ports[i].highMessage:settings.ports[i].lowMessage,false);
-      }
+    settings.changeOnly=false;
+    settings.fullSyncInterval=DEFAULT_FULL_SYNC_INTERVAL;
+    settings.rssiDeadband=DEFAULT_RSSI_DEADBAND;
+    settings.vccDeadband=DEFAULT_VCC_DEADBAND;
+    settings.heapDeadband=DEFAULT_HEAP_DEADBAND;
+    settings.fragDeadband=DEFAULT_FRAG_DEADBAND;
     }
-  yield();
-
-  //publish the radio strength reading while we're at it
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_TOPIC_RSSI);
-  sprintf(reading,"%d",WiFi.RSSI()); 
-  ok=ok & publish(topic,reading,true); //retain
-  yield();
-
-  //publish the battery voltage
-  uint32_t vccMilliVolts = ESP.getVcc(); // millivolts
-  float vccVolts = (float)vccMilliVolts / 1000.0;// Convert to Volts
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_TOPIC_BATTERY);
-  sprintf(reading,"%.2f",vccVolts); 
-  ok=ok & publish(topic,reading,true); //retain
-  yield();
-
-  // Publish some memory usage info
-  uint32_t freeHeap = ESP.getFreeHeap();
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_TOPIC_FREE_HEAP);
-  sprintf(reading,"%d",freeHeap); 
-  ok=ok & publish(topic,reading,true); //retain
-  yield();
-
-  uint8_t heapFragmentation = ESP.getHeapFragmentation(); // Returns a percentage (0-100)
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_TOPIC_HEAP_FRAGMENTATION);
-  sprintf(reading,"%d%%",heapFragmentation); 
-  ok=ok & publish(topic,reading,true); //retain
-  yield();
-
-  uint32_t maxFreeBlockSize = ESP.getMaxFreeBlockSize();
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_TOPIC_MAX_FREE_BLOCK_SIZE);
-  sprintf(reading,"%d",maxFreeBlockSize); 
-  ok=ok & publish(topic,reading,true); //retain
-  yield();
-  
-  if (settings.debug)
+  if (settings.settingsVersion<2)
     {
-    Serial.print("Publish ");
-    Serial.println(ok?"OK":"Failed");
+    settings.wakePort=NO_WAKE_PORT;
     }
-  return ok;
-  }
-
-
-boolean publish(char* topic, const char* reading, boolean retain)
-  {
-  if (settings.debug)
+  if (settings.settingsVersion<3)
     {
-    Serial.print(topic);
-    Serial.print(" ");
-    Serial.println(reading);
+    settings.samplesPerReport=DEFAULT_SAMPLES_PER_REPORT;
     }
-  boolean ok=false;
-  connectToWiFi(); //just in case we're disconnected from WiFi
-  reconnectToBroker(); //also just in case we're disconnected from the broker
-
-  if (mqttClient.connected() && 
-      settings.mqttTopicRoot &&
-      WiFi.status()==WL_CONNECTED)
+  if (settings.settingsVersion<4)
     {
-    ok=mqttClient.publish(topic,reading,retain); 
+    settings.rfCalInterval=DEFAULT_RF_CAL_INTERVAL;
     }
-  else
+  if (settings.settingsVersion<5)
     {
-    Serial.print("Can't publish due to ");
-    if (WiFi.status()!=WL_CONNECTED)
-      Serial.println("no WiFi connection.");
-    else if (!mqttClient.connected())
-      Serial.println("not connected to broker.");
+    strcpy(settings.gateway,"");
+    strcpy(settings.dns,"");
+    settings.cacheTtl=DEFAULT_CACHE_TTL;
     }
-  return ok;
-  }
-
-
-
-/**
- * Handler for incoming MQTT messages.  The payload is the command to perform. 
- * The MQTT message topic sent is the topic root plus the command.
- * Implemented commands are: 
- * MQTT_PAYLOAD_SETTINGS_COMMAND: sends a JSON payload of all user-specified settings
- * MQTT_PAYLOAD_REBOOT_COMMAND: Reboot the controller
- * MQTT_PAYLOAD_VERSION_COMMAND Show the version number
- * MQTT_PAYLOAD_STATUS_COMMAND Show the most recent flow values
- */
-void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) 
-  {
-  if (settings.debug)
+  if (settings.settingsVersion<6)
     {
-    Serial.println("====================================> Callback works.");
+    settings.lightSleep=true;
     }
-  boolean rebootScheduled=false; //so we can reboot after sending the reboot response
-  char charbuf[MQTT_MAX_INCOMING_PAYLOAD_SIZE];
-  if (length < MQTT_MAX_INCOMING_PAYLOAD_SIZE)
+  if (settings.settingsVersion<7)
     {
-    payload[length]='\0'; //this should have been done in the calling code, shouldn't have to do it here
-    sprintf(charbuf,"%s",payload);
-    const char* response;
-    
-    
-    //if the command is MQTT_PAYLOAD_SETTINGS_COMMAND, send all of the settings
-    if (strcmp(charbuf,MQTT_PAYLOAD_SETTINGS_COMMAND)==0)
-      {
-      char tempbuf[35]; //for converting numbers to strings
-      char jsonStatus[JSON_STATUS_SIZE];
-      
-      strcpy(jsonStatus,"{");
-      strcat(jsonStatus,"\"broker\":\"");
-      strcat(jsonStatus,settings.mqttBrokerAddress);
-      strcat(jsonStatus,"\", \"port\":");
-      sprintf(tempbuf,"%d",settings.mqttBrokerPort);
-      strcat(jsonStatus,tempbuf);
-      strcat(jsonStatus,", \"topicroot\":\"");
-      strcat(jsonStatus,settings.mqttTopicRoot);
-      strcat(jsonStatus,"\", \"user\":\"");
-      strcat(jsonStatus,settings.mqttUsername);
-      strcat(jsonStatus,"\", \"pass\":\"");
-      strcat(jsonStatus,settings.mqttPassword);
-      strcat(jsonStatus,"\", \"ssid\":\"");
-      strcat(jsonStatus,settings.ssid);
-      strcat(jsonStatus,"\", \"wifipass\":\"");
-      strcat(jsonStatus,settings.wifiPassword);
-      strcat(jsonStatus,"\", \"mqttClientId\":\"");
-      strcat(jsonStatus,settings.mqttClientId);
-      strcat(jsonStatus,"\", \"address\":\"");
-      strcat(jsonStatus,settings.address);
-      strcat(jsonStatus,"\", \"netmask\":\"");
-      strcat(jsonStatus,settings.netmask);
-      strcat(jsonStatus,"\", \"mdnsname\":\"");
-      strcat(jsonStatus,settings.mdnsName);
-      strcat(jsonStatus,"\", \"debug\":\"");
-      strcat(jsonStatus,settings.debug?"true":"false");
-      strcat(jsonStatus,"\", \"reportinterval\":");
-      sprintf(tempbuf,"%lu",settings.reportInterval);
-      strcat(jsonStatus,tempbuf);
-      strcat(jsonStatus,", \"IPAddress\":\"");
-      strcat(jsonStatus,wifiClient.localIP().toString().c_str());
-      strcat(jsonStatus,"\",");
-      strcat(jsonStatus,"\"ports\":[");
-      for (int i=0;i<PORT_COUNT;i++)
-        {
-        if (settings.ports[i].isActive)
-          {
-          strcat(jsonStatus,"{\"GPIO\":");
-          sprintf(tempbuf,"%d",settings.ports[i].gpioNumber);
-          strcat(jsonStatus,tempbuf);
-          strcat(jsonStatus,", \"highmessage\":\"");
-          strcat(jsonStatus,settings.ports[i].highMessage);
-          strcat(jsonStatus,"\", \"lowmessage\":\"");
-          strcat(jsonStatus,settings.ports[i].lowMessage);
-          strcat(jsonStatus,"\", \"usePullup\":\"");
-          strcat(jsonStatus,settings.ports[i].usePullup?"true":"false");
-          strcat(jsonStatus,"\"},");
-          }
-        yield();
-        }
-      size_t len = strlen(jsonStatus);
-      if (jsonStatus[len - 1] == ',')
-        jsonStatus[len - 1] = ']';   //replace the last comma to close the array
-      else
-        strcat(jsonStatus,"]"); //happens when port array is empty
-      
-      strcat(jsonStatus,"}");
-      response=jsonStatus;
-      }
-    else if (strcmp(charbuf,MQTT_PAYLOAD_VERSION_COMMAND)==0) //show the version number
-      {
-      char tmp[15];
-      strcpy(tmp,VERSION);
-      response=tmp;
-      }
-    else if (strcmp(charbuf,MQTT_PAYLOAD_STATUS_COMMAND)==0) //show the latest value
-      {
-      report();
-      char tmp[25];
-      strcpy(tmp,"Status report complete");
-      response=tmp;
-      }
-    else if (strcmp(charbuf,MQTT_PAYLOAD_REBOOT_COMMAND)==0) //reboot the controller
-      {
-      char tmp[10];
-      strcpy(tmp,"REBOOTING");
-      response=tmp;
-      rebootScheduled=true;
-      }
-    else if (processCommand(charbuf))
-      {
-      response="OK";
-      }
-    else
-      {
-      char badCmd[18];
-      strcpy(badCmd,"(empty)");
-      response=badCmd;
-      }
-      
-    char topic[MQTT_TOPIC_SIZE];
-    strcpy(topic,settings.mqttTopicRoot);
-    strcat(topic,charbuf); //the incoming command becomes the topic suffix
-
-    if (!publish(topic,response,false)) //do not retain
-      Serial.println("************ Failure when publishing status response!");
-      
-    delay(2000); //give publish time to complete
-    
-    if (rebootScheduled)
-      {
-      ESP.restart();
-      }
+    settings.binaryReport=false;
     }
-  else
-    Serial.println("Incoming MQTT message too large.");
-  }
-
-
-//Generate an MQTT client ID.  This should not be necessary very often
-char* generateMqttClientId(char* mqttId)
-  {
-  strcpy(mqttId,MQTT_CLIENT_ID_ROOT);
-  strcat(mqttId, String(random(0xffff), HEX).c_str());
-  if (settings.debug)
+  if (settings.settingsVersion<8)
     {
-    Serial.print("New MQTT userid is ");
-    Serial.println(mqttId);
+    settings.asyncMqtt=false;
     }
-  return mqttId;
+  if (settings.settingsVersion<9)
+    {
+    settings.persistentSession=true;
+    }
+  if (settings.settingsVersion<10)
+    {
+    settings.mqtt5=false;
+    }
+  if (settings.settingsVersion<11)
+    {
+    settings.mqttTls=false;
+    strcpy(settings.tlsFingerprint,"");
+    }
+  if (settings.settingsVersion<12)
+    {
+    for (uint8_t i=0;i<BACKUP_BROKER_COUNT;i++)
+      strcpy(settings.backupBrokers[i],"");
+    }
+  if (settings.settingsVersion<13)
+    {
+    settings.espNow=false;
+    strcpy(settings.espNowGateway,"");
+    settings.espNowChannel=0;
+    }
+  if (settings.settingsVersion<14)
+    {
+    settings.awakeBudget=DEFAULT_AWAKE_BUDGET;
+    settings.apAfterFailures=DEFAULT_AP_AFTER_FAILURES;
+    }
+  if (settings.settingsVersion<15)
+    settings.maxSleep=DEFAULT_MAX_SLEEP;
+  if (settings.settingsVersion<16)
+    {
+    settings.slotted=false;
+    strcpy(settings.timeServer,DEFAULT_TIME_SERVER);
+    }
+  if (settings.settingsVersion<17)
+    {
+    strcpy(settings.espNowKey,"");
+    memset(settings.espNowNodes,0,sizeof(settings.espNowNodes));
+    }
+
+  settings.settingsVersion=SETTINGS_VERSION;
+  return true;
   }
 
 /*
- * Reconnect to the MQTT broker
+ * Check for configuration input via the serial port. Everything the UART has
+ * received is taken a chunk at a time, and each command is run as soon as its
+ * line is finished, so a pasted configuration script is applied all at once.
  */
-void reconnectToBroker() 
+void checkForCommand()
   {
-  if (strlen(settings.mqttBrokerAddress)>0)
+  AUDIT_SUBSYSTEM(SUBSYSTEM_SERIAL);
+  PROFILE(PROFILE_SERIAL);
+  static char lastLineEnd=0; // the \r or \n that finished the last line
+  char chunk[SERIAL_CHUNK_SIZE];
+
+  if (Serial.available())
+    noteActivity();
+
+  while (Serial.available()>0)
     {
-    if (WiFi.status() != WL_CONNECTED)
-      {
-      Serial.println("WiFi not ready, skipping MQTT connection");
-      }
-    else
+    size_t count=Serial.read(chunk,sizeof(chunk));
+    size_t echoed=0; //chunk is echoed back to the terminal a run at a time, up to each line end or backspace
+
+    for (size_t i=0;i<count;i++)
       {
-      // Loop until we're reconnected
-      while (!mqttClient.connected()) 
+      char inChar=chunk[i];
+      if (inChar=='\b' || inChar==0x7F) //backspace or delete takes back the last character
         {
-        Serial.print("Attempting MQTT connection...");
-
-        mqttClient.setBufferSize(JSON_STATUS_SIZE); //default (256) isn't big enough
-        mqttClient.setKeepAlive(120); //seconds
-        mqttClient.setServer(settings.mqttBrokerAddress, settings.mqttBrokerPort);
-        mqttClient.setCallback(incomingMqttHandler);
-        yield();
-
-        // Attempt to connect
-        if (mqttClient.connect(settings.mqttClientId,settings.mqttUsername,settings.mqttPassword))
+        Serial.write((const uint8_t*)chunk+echoed,i-echoed);
+        echoed=i+1;
+        lastLineEnd=0;
+        if (serialLineLength>0)
           {
-          Serial.println("connected to MQTT broker.");
-
-          //resubscribe to the incoming message topic
-          char topic[MQTT_TOPIC_SIZE];
-          strcpy(topic,settings.mqttTopicRoot);
-          strcat(topic,MQTT_TOPIC_COMMAND_REQUEST);
-          bool subgood=mqttClient.subscribe(topic);
-          showSub(topic,subgood);
+          serialLineLength--;
+          Serial.print("\b \b");
           }
-        else 
+        }
+      else if (inChar=='\n' || inChar=='\r') 
+        {
+        Serial.write((const uint8_t*)chunk+echoed,i+1-echoed);
+        echoed=i+1;
+        if (lastLineEnd!=0 && inChar!=lastLineEnd) //some serial ports send both CR and LF, We want to ignore the second one
+          lastLineEnd=0;
+        else
           {
-          Serial.print("failed, rc=");
-          Serial.println(mqttClient.state());
-          Serial.println("Will try again in a second");
-          
-          // Wait a second before retrying
-          // In the meantime check for input in case something needs to be changed to make it work
-        //  checkForCommand(); 
-          yield();
-          delay(1000);
-          yield();
+          lastLineEnd=inChar;
+          finishSerialLine();
           }
-        checkForCommand();
         }
-      mqttClient.loop(); //This has to happen every so often or we get disconnected for some reason
+      else
+        {
+        lastLineEnd=0;
+        if (serialLineLength<sizeof(serialLine)-1)
+          serialLine[serialLineLength++]=inChar;
+        else
+          serialLineTooLong=true;
+        }
       }
+    Serial.write((const uint8_t*)chunk+echoed,count-echoed);
+    yield();
     }
-  else if (settings.debug)
+  }
+
+// A line has been entered on the serial port. Run it, unless it was too long.
+void finishSerialLine()
+  {
+  serialLine[serialLineLength]='\0';
+  Serial.println();
+  if (serialLineTooLong)
     {
-    Serial.println("Broker address not set, ignoring MQTT");
+    Serial.print("Incoming command too long, ignored. The limit is ");
+    Serial.print(sizeof(serialLine)-1);
+    Serial.println(" characters.");
     }
+  else
+    processCommand(serialLine,serialLineLength); //an empty line shows the settings
+
+  serialLineLength=0;
+  serialLineTooLong=false;
   }
 
-void showSub(char* topic, bool subgood)
+
+/*
+ * Read the state that was saved in RTC memory before the last deep sleep. If it
+ * isn't there (power up) or doesn't match this version's layout, start fresh.
+ */
+void loadRtcState()
   {
-  if (settings.debug)
+  bool ok=ESP.rtcUserMemoryRead(0,(uint32_t*)&rtc,sizeof(rtc))
+      && rtc.size==sizeof(rtc)
+      && rtc.crc==crc32(((uint8_t*)&rtc)+sizeof(rtc.crc),sizeof(rtc)-sizeof(rtc.crc));
+  if (!ok)
     {
-    Serial.print("++++++Subscribing to ");
-    Serial.print(topic);
-    Serial.print(":");
-    Serial.println(subgood);
+    memset(&rtc,0,sizeof(rtc));
+    rtc.size=sizeof(rtc);
     }
+  if (settings.debug)
+    Serial.println(ok?"Restored state from RTC memory.":"No saved state in RTC memory.");
   }
 
-/**
- * @brief Checks if a C-style string (char array) contains only
- * alphanumeric characters (a-z, A-Z, 0-9).
- *
- * @param str The null-terminated char array to check.
- * @return true if all characters are alphanumeric or the string is empty.
- * @return false if any character is not alphanumeric.
+void saveRtcState()
+  {
+  rtc.size=sizeof(rtc);
+  rtc.crc=crc32(((uint8_t*)&rtc)+sizeof(rtc.crc),sizeof(rtc)-sizeof(rtc.crc));
+  ESP.rtcUserMemoryWrite(0,(uint32_t*)&rtc,sizeof(rtc));
+  }
+
+/*
+ * Read all of the active ports at once. GPIO0-15 are all in the GPI register
+ * and GPIO16 is in the RTC block's GP16I, so two register reads give every
+ * level at the same instant, rather than one digitalRead() after another.
  */
-bool checkString(const char* str) 
+portSnapshot takePortSnapshot()
   {
-    if (str == nullptr) 
-      {
-      return false; // A null pointer is not a valid string
-      }
+  portSnapshot snap;
+  uint32_t gpi=GPI;
+  uint32_t gpio16=GP16I & 0x01;
+  snap.millis=millis();
+  snap.clockSeconds=clockSeconds();
 
-    // Iterate through the string until the null terminator
-    for (size_t i = 0; str[i] != '\0'; ++i) 
-      {
-      // Cast char to unsigned char to avoid potential issues with 
-      // negative char values when passed to ctype functions.
-      unsigned char ch = static_cast<unsigned char>(str[i]); // Cast once
-      if (!isalnum(ch) && ch != '/' && ch != '.')
-        {
-        return false; // Found a non-alphanumeric character
-        }
-      }
+  snap.levels=0;
+  for (uint8_t n=0;n<activePortCount;n++)
+    {
+    uint8_t i=activePorts[n];
+    uint8_t gpio=settings.ports[i].gpioNumber;
+    if (gpio==16?gpio16:(gpi>>gpio)&1)
+      snap.levels|=1<<i;
+    }
+  return snap;
+  }
 
-  // If the loop completes, all characters were alphanumeric (or the string was empty)
-  return true;
+// Read all of the active ports, one bit per port index
+uint16_t readPortLevels()
+  {
+  return takePortSnapshot().levels;
   }
 
-// Check all of the text in all active ports for sanity
-bool checkPorts()
+// Make the list of active ports so the hot paths don't have to look at the rest
+void rebuildActivePorts()
   {
-  bool hasOne=false; //settings are incomplete unless we have at least one port activated
-  for (int i=0;i<PORT_COUNT;i++)
+  activePortMask=0;
+  activePortCount=0;
+  for (uint8_t i=0;i<PORT_COUNT;i++)
     {
     if (settings.ports[i].isActive)
       {
-      hasOne=true;
-      if (!(checkString(settings.ports[i].highMessage) &&
-             checkString(settings.ports[i].lowMessage)))
-        return false;
-      }
-    else //clear out any that are inactive
-      {
-      settings.ports[i].gpioNumber=0;
-      settings.ports[i].highMessage[0]='\0';
-      settings.ports[i].lowMessage[0]='\0';
-      settings.ports[i].usePullup=false;
+      activePortMask|=1<<i;
+      activePorts[activePortCount++]=i;
       }
-//    yield();
     }
-  return true && hasOne;
   }
 
-/*
- * Check all of the strings in the settings.   If any of the
- * character strings in the settings fail the test, it's 
- * likely that the settings are corrupt. 
-*/  
-bool settingsSanityCheck()
+// Put together every topic from the topic root, and tell the async client their aliases
+void rebuildTopics()
   {
-  return checkString(settings.ssid)
-      && checkString(settings.wifiPassword)
-      && checkString(settings.mqttBrokerAddress)
-      && checkString(settings.mqttUsername)
-      && checkString(settings.mqttPassword)
-      && checkString(settings.mqttTopicRoot)
-      && checkString(settings.mqttClientId)
-      && checkString(settings.address)
-      && checkString(settings.mdnsName)
-      && checkString(settings.netmask)
-      && checkPorts()
-      ;
+  size_t rootLen=strlen(settings.mqttTopicRoot);
+  size_t size=0;
+  for (uint8_t i=0;i<TOPIC_COUNT;i++)
+    size+=rootLen+strlen(topicSuffixes[i])+1;
+  char* store=(char*)realloc(topicStore,size);
+  if (!store)
+    {
+    Serial.println("No room for the topic table");
+    return; //the old one is still there
+    }
+  topicStore=store;
+  for (uint8_t i=0;i<TOPIC_COUNT;i++)
+    {
+    topics[i]=store;
+    strcpy(store,settings.mqttTopicRoot);
+    strcat(store,topicSuffixes[i]);
+    store+=strlen(store)+1;
+    }
+  mqttAsync.setTopicAliases(topics,TOPIC_COUNT);
   }
 
 /*
- * Save the settings to EEPROM. Set the valid flag if everything is filled in.
+ * Figure out why we woke up. A timer wake and a pulse on the reset pin both
+ * report as a deep sleep wake, so compare the port levels with what they were
+ * when we went to sleep. If one changed, it woke us up through the wake circuit.
+ * This should be called as early as possible, before the switch can change back.
  */
-boolean saveSettings()
+void latchWakeState()
   {
-  if (strlen(settings.ssid)>0 &&
-      strlen(settings.wifiPassword)>0 &&
-      // strlen(settings.mqttBrokerAddress)>0 &&
-      // settings.mqttBrokerPort!=0 &&
-      strlen(settings.mqttTopicRoot)>0 &&
-      strlen(settings.mqttClientId)>0 &&
-      settingsSanityCheck())
+  bootSnapshot=takePortSnapshot();
+  wakeGpio=NO_WAKE_PORT;
+
+  uint32_t reason=ESP.getResetInfoPtr()->reason;
+  if (reason==REASON_DEEP_SLEEP_AWAKE && rtc.changePending) //rebooted with the radio on to report a change
     {
-    Serial.println("Settings deemed complete");
-    settings.validConfig=VALID_SETTINGS_FLAG;
-    settingsAreValid=true;
+    wakeCause=WAKE_CAUSE_CHANGE;
+    wakeGpio=rtc.pendingGpio;
+    rtc.changePending=false;
     }
-  else
+  else if (reason==REASON_DEEP_SLEEP_AWAKE)
     {
-    Serial.println("Settings still incomplete");
-    settings.validConfig=0;
-    settingsAreValid=false;
+    uint16_t changed=(bootSnapshot.levels ^ rtc.sleepLevels) & rtc.sleepLevelsValid;
+    if (changed)
+      {
+      wakeCause=WAKE_CAUSE_CHANGE;
+      int8_t wakeIndex=settings.wakePort==NO_WAKE_PORT?-1:portIndex(settings.wakePort);
+      if (wakeIndex>=0 && (changed & (1<<wakeIndex))) //prefer the configured wake port
+        wakeGpio=settings.wakePort;
+      else
+        {
+        for (uint8_t n=0;n<activePortCount && wakeGpio==NO_WAKE_PORT;n++)
+          {
+          if (changed & (1<<activePorts[n]))
+            wakeGpio=settings.ports[activePorts[n]].gpioNumber;
+          }
+        }
+      }
+    else
+      wakeCause=WAKE_CAUSE_TIMER;
     }
-    
-  //The mqttClientId is not set by the user, but we need to make sure it's set  
-  if (strlen(settings.mqttClientId)==0)
+  else if (reason==REASON_EXT_SYS_RST)
     {
-    generateMqttClientId(settings.mqttClientId);
+    wakeCause=WAKE_CAUSE_RESET;
+    wakeGpio=settings.wakePort;
     }
-    
-  EEPROM.put(0,settings);
-  if (settings.debug)
-    Serial.println("Committing settings to eeprom");
-  return EEPROM.commit();
-  }
+  else if (reason==REASON_DEFAULT_RST)
+    wakeCause=WAKE_CAUSE_POWER;
+  else
+    wakeCause=WAKE_CAUSE_RESTART;
 
-  //This is a special initialization function. Do not call except when necessary.
-void initTopicForTesting()
-  {
-  strcpy(settings.mqttTopicRoot,"buteomont/mousetest/"); // To keep from messing up the real mousetrap
-  saveSettings();
+  if (settings.debug)
+    {
+    Serial.print("Wake cause: ");
+    Serial.print(wakeCause);
+    if (wakeGpio!=NO_WAKE_PORT)
+      {
+      Serial.print(", GPIO ");
+      Serial.print(wakeGpio);
+      }
+    Serial.println();
+    }
   }
 
-void erasePortsForTesting()
+// Add one sample of the ports and battery to the summary in RTC memory
+void takeSample(uint16_t levels)
   {
-  for (int i=0;i<PORT_COUNT;i++)
+  sampleSummary& sum=rtc.summary;
+  uint16_t vcc=ESP.getVcc();
+  if (sum.count==0)
     {
-    settings.ports[i].isActive=false;
-    settings.ports[i].highMessage[0]='\0';
-    settings.ports[i].lowMessage[0]='\0';
+    memset(&sum,0,sizeof(sum));
+    sum.vccMin=vcc;
+    sum.vccMax=vcc;
     }
-  saveSettings();
+  else
+    {
+    sum.vccMin=min(sum.vccMin,vcc);
+    sum.vccMax=max(sum.vccMax,vcc);
+    }
+  for (uint8_t n=0;n<activePortCount;n++)
+    {
+    uint8_t i=activePorts[n];
+    if (levels & (1<<i))
+      sum.highCount[i]++;
+    if (sum.count>0 && ((levels ^ sum.lastLevels) & (1<<i)))
+      sum.transitions[i]++;
+    }
+  sum.lastLevels=levels;
+  sum.count++;
   }
 
-void initSerial()
+// How long to sleep between samples so that samplesPerReport of them fit in a reportInterval
+ulong sampleIntervalSeconds()
   {
-  Serial.begin(115200);
-  Serial.setTimeout(10000);
-  
-  while (!Serial); // wait here for serial port to connect.
-  Serial.println();
-  Serial.println("Serial communications established.");
-  delay(5000);
-  commandString.reserve(200); // reserve 200 bytes of serial buffer space for incoming command string
+  return max(1UL,settings.reportInterval/max((uint8_t)1,settings.samplesPerReport));
   }
 
-void initFS()
+// Estimated seconds since power up. There's no clock that runs through deep sleep,
+// so this adds up the time spent awake and the time we asked to sleep.
+uint32_t clockSeconds()
   {
-  if (!LittleFS.begin()) 
-    Serial.println("Failed to mount FS");
-  else
-    {
-    Serial.println("File system started.");
-    //   Serial.println("Listing LittleFS contents:");
-    // Dir dir = LittleFS.openDir("/"); // Open the root directory
-    // while (dir.next())
-    //   {
-    //   Serial.print("  FILE: ");
-    //   Serial.print(dir.fileName());
-    //   Serial.print("  SIZE: ");
-    //   Serial.println(dir.fileSize());
-    //   }
-    // Serial.println("-------------------------");
-    }
-
+  return rtc.clockSeconds+millis()/1000;
   }
 
 /*
-*  Initialize the settings from eeprom and determine if they are valid
-*/
-void loadSettings()
+ * Choose the RF mode for the next wake. Wakes that won't use WiFi leave the radio
+ * off entirely. Wakes that will use it skip the RF calibration, which costs time
+ * and current at boot, unless rfCalInterval has passed since the last one or the
+ * last connection attempt failed.
+ */
+RFMode nextWakeRfMode(bool radioNeeded)
   {
-  EEPROM.get(0,settings);
+  if (!radioNeeded)
+    return WAKE_RF_DISABLED;
+  if (rtc.rfCalNeeded
+      || settings.rfCalInterval==0
+      || clockSeconds()-rtc.lastRfCalSeconds>=settings.rfCalInterval)
+    return WAKE_RFCAL;
+  return WAKE_NO_RFCAL;
+  }
 
-  if (!settingsSanityCheck()) //if something is wildly off then don't run, allow setup
-    {
-    settings.validConfig=0;
-    settingsAreValid=false;
-    Serial.println(F("Settings are corrupt, marking invalid."));
-    }
-  else if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
+// The longest deep sleep to ask for at once, from maxsleep and what the chip can do
+uint64_t sleepSegmentMicros()
+  {
+  uint64_t chipMax=ESP.deepSleepMax(); //depends on how the RTC clock calibrated on this boot
+  uint64_t wanted=(uint64_t)settings.maxSleep*1000000;
+  if (settings.maxSleep==0 || (chipMax>0 && wanted>chipMax))
+    return chipMax;
+  return wanted;
+  }
+
+/*
+ * Save what needs to survive and go into deep sleep. The RF mode is for the
+ * next wake, so sampling wakes can leave the radio off. A sleep longer than
+ * one segment is split up: the segments in between wake with the radio off
+ * and go straight back to sleep, and the remaining time is kept in RTC memory.
+ */
+void goToSleep(uint64_t sleepMicros, RFMode rfMode)
+  {
+  uint64_t segment=sleepSegmentMicros();
+  if (segment>0 && sleepMicros>segment)
     {
-    settingsAreValid=true;
+    rtc.sleepRemaining=(sleepMicros-segment)/1000000;
+    rtc.chainRf=rfMode;
+    sleepMicros=segment;
+    rfMode=WAKE_RF_DISABLED;
     if (settings.debug)
-      {
-      Serial.println("\nLoaded configuration values from EEPROM");
-      }
+      Serial.printf("Sleeping in segments, %u seconds to go after this one\n",rtc.sleepRemaining);
     }
   else
+    rtc.sleepRemaining=0;
+  if (rtc.clockBaseMs!=0)
     {
-    Serial.println("Skipping load from EEPROM, device not configured.");    
-    settingsAreValid=false;
+    rtc.awakeMs+=millis();
+    rtc.askedSleepMs+=sleepMicros/1000;
+    if (rtc.askedSleepMs>UINT32_MAX/2) //SNTP hasn't answered in weeks, so the estimate is no good anyway
+      rtc.clockBaseMs=0;
     }
-    showSettings();
-  }
 
-void reconfigSerial()
-  {
-  if (settings.ports[TX_PIN].isActive && settings.ports[RX_PIN].isActive)
+  if (usingAsyncMqtt())
     {
-    Serial.println("*******************************************");
-    Serial.println("* Both TX and RX are being used for GPIO. *");
-    Serial.println("* Serial UART is being deactivated!       *");
-    Serial.println("*******************************************");
-    Serial.flush();
-    Serial.end();
+    mqttAsync.flush(ASYNC_MQTT_ACK_TIMEOUT_MS); //don't sleep with publishes still on their way
+    checkAsyncFailures();
     }
-  else if (settings.ports[RX_PIN].isActive)
-    {
-    Serial.println("****************************************");
-    Serial.println("* The RX port is being used for GPIO.  *");
-    Serial.println("* Serial receive is being deactivated! *");
-    Serial.println("****************************************");
-    Serial.flush();
-    Serial.begin(115200,SERIAL_8N1,SERIAL_TX_ONLY); 
-    }    
-  else if (settings.ports[RX_PIN].isActive)
+  rtc.sleepLevels=readPortLevels(); //so a change while asleep can be recognized
+  rtc.sleepLevelsValid=activePortMask;
+  rtc.nextWakeRf=rfMode;
+  rtc.clockSeconds+=millis()/1000+sleepMicros/1000000;
+  if (settings.debug)
     {
-    Serial.println("***************************************");
-    Serial.println("* The TX port is being used for GPIO. *");
-    Serial.println("* Serial.print is being deactivated!  *");
-    Serial.println("***************************************");
-    Serial.flush();
-    Serial.begin(115200,SERIAL_8N1,SERIAL_TX_ONLY); 
+    Serial.print("Next wake radio mode: ");
+    Serial.println(rfMode==WAKE_RF_DISABLED?"off":rfMode==WAKE_RFCAL?"calibrate":"no calibration");
     }
-  else
-    Serial.println("No port adjustments necessary.");  
+  saveRtcState();
+  Serial.flush();
+  ESP.deepSleep(sleepMicros, rfMode);
   }
 
-void initPorts()
+// True once SNTP has set the clock on this wake
+bool clockSynced()
   {
-  for (int i=0;i<PORT_COUNT;i++)
+  return time(NULL)>=SNTP_VALID_AFTER;
+  }
+
+/*
+ * If SNTP has answered, see how long the deep sleeps since the last time it
+ * did really took, and fold that into driftPpm. Time spent awake is taken
+ * out, since the CPU clock that measures it is accurate. Then start counting
+ * again from the start of this wake.
+ */
+void updateClock()
+  {
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  if (tv.tv_sec<SNTP_VALID_AFTER)
+    return;
+  uint64_t now=(uint64_t)tv.tv_sec*1000+tv.tv_usec/1000;
+  if (rtc.clockBaseMs!=0 && rtc.askedSleepMs>=DRIFT_MIN_SLEEP_MS)
     {
-    if (settings.ports[i].isActive)
+    int64_t slept=(int64_t)(now-rtc.clockBaseMs)-rtc.awakeMs-millis();
+    int64_t ppm=(slept-(int64_t)rtc.askedSleepMs)*1000000/rtc.askedSleepMs;
+    if (ppm>=-MAX_DRIFT_PPM && ppm<=MAX_DRIFT_PPM)
       {
-      int8_t port=indexPort(i);
-      if (port>=0)
-        {
-        pinMode(port,settings.ports[i].usePullup?INPUT_PULLUP:INPUT);
-        }
+      rtc.driftPpm=rtc.driftMeasured?(rtc.driftPpm*3+(int32_t)ppm)/4:(int32_t)ppm; //smoothed, one wake can be off
+      rtc.driftMeasured=true;
       }
+    if (settings.debug)
+      Serial.printf("Slept %d ms when %u was asked for, drift now %d ppm\n",
+                    (int32_t)slept,rtc.askedSleepMs,rtc.driftPpm);
     }
+  rtc.clockBaseMs=now-millis();
+  rtc.awakeMs=0;
+  rtc.askedSleepMs=0;
   }
 
-void initSettings()
+// Unix time in ms, from SNTP or else from the last time it answered plus the corrected sleeps since. 0 if not known.
+uint64_t estimatedEpochMs()
   {
-  EEPROM.begin(sizeof(settings)); //fire up the eeprom section of flash
-  loadSettings(); //set the values from eeprom 
+  if (rtc.clockBaseMs==0)
+    return 0;
+  uint64_t slept=(uint64_t)rtc.askedSleepMs*(1000000+rtc.driftPpm)/1000000;
+  return rtc.clockBaseMs+rtc.awakeMs+slept+millis();
+  }
 
-  //show the MAC address
-  Serial.print("ESP8266 MAC Address: ");
-  Serial.println(WiFi.macAddress());
+/*
+ * How long to ask to sleep so the next wake is in this device's slot, the
+ * point in each period set by a hash of its client ID. That spreads a fleet on
+ * the same interval over the whole of it instead of letting them all drift
+ * into the same second. The RTC clock runs fast or slow by a few percent, so
+ * the sleep asked for is corrected by the measured drift. Without slotted, or
+ * before SNTP has ever answered, it's just the period.
+ */
+uint64_t slottedSleepMicros(uint32_t periodSeconds)
+  {
+  uint64_t plain=(uint64_t)periodSeconds*1000000;
+  if (!settings.slotted || periodSeconds==0)
+    return plain;
+  updateClock();
+  uint64_t now=estimatedEpochMs();
+  if (now==0)
+    return plain;
 
-  if (settings.mqttBrokerPort < 0) //then this must be the first powerup
-    {
-    Serial.println("\n*********************** Resetting All EEPROM Values ************************");
-    initializeSettings();
-    saveSettings();
-    delay(2000);
-    ESP.restart();
-    }
+  uint64_t periodMs=(uint64_t)periodSeconds*1000;
+  uint64_t slotMs=crc32(settings.mqttClientId,strlen(settings.mqttClientId))%periodMs;
+  uint64_t next=now-now%periodMs+slotMs;
+  while (next<now+periodMs/2) //a wake a little early or late doesn't get an extra one in
+    next+=periodMs;
+  uint64_t wait=next-now;
+  if (settings.debug)
+    Serial.printf("Next slot is %u ms into the period, %u ms from now\n",(uint32_t)slotMs,(uint32_t)wait);
+  return wait*1000000/(1000000+rtc.driftPpm)*1000;
   }
 
-void startAPMode() 
+// Sleep until the next sample, or the next report if there are none in between
+void sleepUntilNextWake()
   {
-  Serial.println("\nStarting SoftAP Mode...");
-  WiFi.mode(WIFI_AP); // Set mode to AP
-  // Optional: Set a static IP for the AP (defaults to 192.168.4.1)
-  WiFi.softAPConfig(IPAddress(192, 168, 4, 1), IPAddress(192, 168, 4, 1), IPAddress(255, 255, 255, 0));
-  bool result = WiFi.softAP(STANDALONE_SSID, "password");
-  apModeActive=true;
-
-  if (result) 
+  if (settings.samplesPerReport>1) //wake up for samples with the radio off in between reports
     {
-    Serial.print("SoftAP '" + String(STANDALONE_SSID) + "' started. IP: ");
-    Serial.println(WiFi.softAPIP());
-    } 
-  else 
+    uint64_t sleepMicros=slottedSleepMicros(sampleIntervalSeconds());
+    Serial.print("Sleeping for ");
+    Serial.print((uint32_t)(sleepMicros/1000000));
+    Serial.println(" seconds until the next sample");
+    goToSleep(sleepMicros,nextWakeRfMode(false));
+    }
+  else
     {
-    Serial.println("Failed to start SoftAP!");
+    uint64_t sleepMicros=slottedSleepMicros(settings.reportInterval);
+    Serial.print("Sleeping for ");
+    Serial.print((uint32_t)(sleepMicros/1000000));
+    Serial.println(" seconds");
+    goToSleep(sleepMicros,nextWakeRfMode(true));
     }
-  keepAwake=millis()+STAY_AWAKE_INCREMENT; //stay awake a while for changes via web page
   }
 
-/**
- * @brief Checks if the ESP8266 SoftAP is actively running.
- *
- * This function verifies if the current WiFi mode includes AP functionality
- * and that the SoftAP interface has a valid IP address.
- *
- * @return true if SoftAP is running and initialized, false otherwise.
- */
-// bool isSoftAPRunning()
-//   {
-//   // Check if the current Wi-Fi mode is AP or AP_STA
-//   if (WiFi.getMode() == WIFI_AP || WiFi.getMode() == WIFI_AP_STA)
-//     {
-//     // Additionally, check if the SoftAP has successfully obtained an IP address.
-//     // If the IP is 0.0.0.0, it usually means the AP failed to start correctly.
-//     if (WiFi.softAPIP()[0] != 0)
-//       {
-//       return true; // AP mode is active and has an IP
-//       }
-//     }
-//   return false; // AP mode is not active or hasn't got an IP
-//   }
+// Woke up between the segments of a long sleep, so go back for the next one
+void continueSleep()
+  {
+  if (settings.debug)
+    Serial.printf("%u seconds of sleep to go\n",rtc.sleepRemaining);
+  goToSleep((uint64_t)rtc.sleepRemaining*1000000,(RFMode)rtc.chainRf);
+  }
 
 /*
- * If not connected to wifi, connect.
+ * True if nobody is likely to be around to fix things on this wake, so it
+ * shouldn't stay up trying. A reset while awake or a power up means someone is.
+ * The ESP8266 can't tell a reset pulse while asleep from a timer wake, so
+ * those count as unattended too.
  */
-void connectToWiFi()
+bool unattendedWake()
   {
-  if (settingsAreValid && WiFi.status() != WL_CONNECTED && !apModeActive)
-    {
-    Serial.print("Attempting to connect to WPA SSID \"");
-    Serial.print(settings.ssid);
-    Serial.println("\"");
+  return settingsAreValid
+      && settings.reportInterval>0
+      && strcmp(wakeCause,WAKE_CAUSE_RESET)!=0
+      && strcmp(wakeCause,WAKE_CAUSE_POWER)!=0;
+  }
 
-    WiFi.disconnect(true); // Completely reset Wi-Fi stack
-    delay(100); // Small delay to ensure reset is applied
-    WiFi.persistent(false); // Prevent saving to flash
-    WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
+// Note how far this wake has got, which also starts that phase's share of the budget
+void enterPhase(uint8_t phase)
+  {
+  wakePhase=phase;
+  phaseStartMs=millis();
+  }
 
-    if (ip.isSet()) //Go with a dynamic address if no valid IP has been entered
-      {
-      if (!WiFi.config(ip,ip,mask))
-        {
-        Serial.println("STA Failed to configure");
-        }
-      }
+/*
+ * Give up on a report that is taking too long, either altogether or in the
+ * phase it is stuck in, rather than let a bad access point or a broker that's
+ * down run the battery flat. This is the deadline that loop() and everything
+ * that waits on the network check, so none of them can hold the device awake.
+ */
+void checkAwakeBudget()
+  {
+  if (!budgetActive)
+    return;
+  uint32_t now=millis();
+  if (now>settings.awakeBudget*1000UL || now-phaseStartMs>phaseBudgetMs[wakePhase])
+    giveUpOnWake();
+  }
 
-    unsigned long connectTimeout = millis() + WIFI_TIMEOUT_SECONDS*1000; // 30 second timeout
-    WiFi.begin(settings.ssid, settings.wifiPassword);
-    //delay(1000);
-    unsigned long lastDotTime = millis(); // For printing dots without blocking
-    while (WiFi.status() != WL_CONNECTED && millis() < connectTimeout) 
-      {
-      // Not yet connected
-      if (millis() - lastDotTime > 500) // Print dot every 500ms, but don't block
-        {
-        Serial.print(".");
-        lastDotTime = millis();
-        yield();
-        }
-      checkForCommand(); // Check for input in case something needs to be changed to work
-      yield();
-      }
+/*
+ * Count the failure in RTC memory and go back to sleep, keeping what needed
+ * reporting for the next wake: everything is sent again, and a change is still
+ * reported as the wake cause. Only once WiFi has failed apafterfailures wakes
+ * in a row does it open AP mode, in case it's the WiFi settings that are wrong.
+ */
+void giveUpOnWake()
+  {
+  budgetActive=false;
+  if (rtc.wakeFailures<UINT8_MAX)
+    rtc.wakeFailures++;
+  rtc.failedPhase=wakePhase;
+  Serial.printf("Gave up %s after %lu ms, %u failed wakes in a row\n",
+                phaseNames[wakePhase],millis(),rtc.wakeFailures);
 
-    if (WiFi.status() != WL_CONNECTED)
-      {
-      Serial.println("\nConnection to network failed. Opening AP mode.");
-      startAPMode();  //fire up our own network
-      }
-    else 
+  if (wakePhase==PHASE_WIFI || wakePhase==PHASE_DHCP)
+    {
+    rtc.rfCalNeeded=true; //in case a stale calibration had something to do with it
+    if (rtc.wifiFailures<UINT8_MAX)
+      rtc.wifiFailures++;
+    if (settings.apAfterFailures>0 && rtc.wifiFailures>=settings.apAfterFailures)
       {
-      Serial.print("\nConnected to network with address ");
-      Serial.println(WiFi.localIP());
-      Serial.println();
+      Serial.println("Opening AP mode");
+      rtc.wakeFailures=0;
+      rtc.wifiFailures=0;
+      wifiConnecting=false;
+      startAPMode();
+      startMdns();
+      return;
       }
-    // server.begin();
     }
+
+  rtc.cache.validMask=0;
+  if (!wakeReported && strcmp(wakeCause,WAKE_CAUSE_CHANGE)==0)
+    {
+    rtc.changePending=true;
+    rtc.pendingGpio=wakeGpio;
+    }
+  if (usingAsyncMqtt())
+    mqttAsync.disconnect(); //nothing more is getting through, so don't wait on it
+  sleepUntilNextWake();
   }
 
-void initServer()
+// The report is out, so the rest of the wake is up to the usual rules
+void wakeSucceeded()
   {
-  connectToWiFi(); //will either connect to wifo or set up AP mode
-  server.begin();
+  budgetActive=false;
+  rtc.wakeFailures=0;
+  }
 
-  Serial.print("Setting MDNS name to ");
-  Serial.print(settings.mdnsName);
-  Serial.println(".local");
+// The wake cause as it is coded in the binary report
+uint8_t wakeCauseCode()
+  {
+  if (strcmp(wakeCause,WAKE_CAUSE_TIMER)==0)
+    return WAKE_CODE_TIMER;
+  if (strcmp(wakeCause,WAKE_CAUSE_CHANGE)==0)
+    return WAKE_CODE_CHANGE;
+  if (strcmp(wakeCause,WAKE_CAUSE_RESET)==0)
+    return WAKE_CODE_RESET;
+  if (strcmp(wakeCause,WAKE_CAUSE_POWER)==0)
+    return WAKE_CODE_POWER;
+  return WAKE_CODE_RESTART;
+  }
 
-  if (!MDNS.begin(settings.mdnsName)) // Always check return value!
+/*
+ * Publish everything as one binaryReport on <topicroot>/bin. It is a few dozen
+ * bytes on one topic, so change-only suppression isn't worth doing and every
+ * report is complete. The per-port part of the sample summary is only in the
+ * text report; the binary one carries the sample count and battery range.
+ */
+bool reportBinary()
+  {
+  portSnapshot snap=wakeReported?takePortSnapshot():bootSnapshot;
+  binaryReport bin;
+  memset(&bin,0,sizeof(bin));
+  bin.version=BINARY_REPORT_VERSION;
+  bin.flags=BINARY_FLAG_FULL;
+  bin.activeMask=activePortMask;
+  bin.levels=snap.levels;
+  bin.snapshotMillis=snap.millis;
+  bin.clockSeconds=snap.clockSeconds;
+  bin.rssi=espNowActive?0:constrain(WiFi.RSSI(),-128,127); //no access point to measure with ESP-NOW
+  bin.vccMilliVolts=ESP.getVcc();
+  bin.freeHeap=ESP.getFreeHeap();
+  bin.maxFreeBlockSize=ESP.getMaxFreeBlockSize();
+  bin.heapFragmentation=ESP.getHeapFragmentation();
+  bin.wakeGpio=NO_WAKE_PORT;
+  if (!wakeReported)
     {
-    Serial.println("Error setting up MDNS responder!");
+    bin.flags|=BINARY_FLAG_WAKE;
+    bin.wakeCause=wakeCauseCode();
+    bin.wakeGpio=wakeGpio;
     }
-    else
+  if (rtc.summary.count>0)
     {
-    Serial.println("mDNS responder started successfully.");
-    MDNS.addService("http", "tcp", 80); // Add service after mDNS is running
-    Serial.println("HTTP service added to mDNS.");
-    }  
+    bin.flags|=BINARY_FLAG_SUMMARY;
+    bin.samples=min(rtc.summary.count,(uint16_t)255);
+    bin.vccMin=rtc.summary.vccMin;
+    bin.vccMax=rtc.summary.vccMax;
+    }
+
+  const char* topic=topics[TOPIC_BINARY_REPORT];
+  if (settings.debug)
+    Serial.printf("%s (%u byte binary report, version %u)\n",topic,(unsigned)sizeof(bin),bin.version);
+  bool ok=publishBytes(topic,(const uint8_t*)&bin,sizeof(bin),false);
+  if (ok)
+    {
+    wakeReported=true;
+    rtc.summary.count=0; //start a new summary
+    }
+  rtc.cache.validMask=0; //so going back to text reports sends everything
+  saveRtcState();
+
+  if (settings.debug)
+    {
+    Serial.print("Publish ");
+    Serial.println(ok?"OK":"Failed");
+    }
+  return ok;
   }
 
-void notFound(AsyncWebServerRequest *request) 
+// Decide whether a value needs to be published. It does if this is a full report,
+// if it has never been published, or if it has moved more than the deadband.
+bool needsPublish(bool full, uint16_t cacheBit, long value, long lastValue, long deadband)
   {
-  request->send(404, "text/plain", "Not found");
+  return full 
+      || !(rtc.cache.validMask & cacheBit)
+      || labs(value-lastValue)>deadband;
   }
 
-void setup()
+/************************
+ * Do the MQTT thing
+ * In change-only mode, values that haven't changed since they were last published
+ * are skipped, except every fullSyncInterval reports when everything is sent.
+ ************************/
+bool report(bool forceAll)
   {
-  initSerial();
-  
-  initSettings();
+  PROFILE(PROFILE_REPORT);
+  if (settings.binaryReport)
+    return reportBinary(); //always complete, so forceAll has nothing to add
 
-  initFS();
- 
-  if (!settingsAreValid) //we need more settings, allow it via the web page
-    startAPMode();
+  const char* topic=topics[TOPIC_STATUS];
+  char reading[18];
+  bool ok=true;
+  int skipped=0;
+
+  bool full=forceAll 
+         || !settings.changeOnly
+         || (settings.fullSyncInterval>0 && rtc.cache.reportsSinceSync+1>=settings.fullSyncInterval);
+
+
+  // Every port in the report comes from one snapshot, however long the publishing
+  // takes. The first report after waking uses the one latched at boot, so a
+  // switch that has already gone back still gets reported.
+  portSnapshot snap=wakeReported?takePortSnapshot():bootSnapshot;
+  bool portsPublished=false;
+  for (uint8_t n=0;n<activePortCount;n++)
+    {
+    uint8_t i=activePorts[n];
+    bool switchStatus=(snap.levels>>i)&1;
+    bool lastStatus=rtc.cache.portLevels & (1<<i);
+    if (needsPublish(full,1<<i,switchStatus,lastStatus,0))
+      {
+      if (publish(topic,switchStatus?settings.ports[i].highMessage:settings.ports[i].lowMessage,false))
+        {
+        portsPublished=true;
+        rtc.cache.validMask|=1<<i;
+        if (switchStatus)
+          rtc.cache.portLevels|=1<<i;
+        else
+          rtc.cache.portLevels&=~(1<<i);
+        }
+      }
+    else
+      skipped++;
+    }
+  yield();
+
+  if (portsPublished && activePortCount>0) //the whole state vector, with the time it was read
+    {
+    char state[PORT_STATE_SIZE];
+    int len=snprintf(state,sizeof(state),"{\"ms\":%u, \"clock\":%u, \"ports\":{",snap.millis,snap.clockSeconds);
+    for (uint8_t n=0;n<activePortCount && len<(int)sizeof(state);n++)
+      {
+      uint8_t i=activePorts[n];
+      len+=snprintf(state+len,sizeof(state)-len,"%s\"%d\":%d",n==0?"":", ",
+                    settings.ports[i].gpioNumber,(snap.levels>>i)&1);
+      }
+    if (len<(int)sizeof(state))
+      snprintf(state+len,sizeof(state)-len,"}}");
+    topic=topics[TOPIC_PORT_STATE];
+    ok=ok & publish(topic,state,false);
+    yield();
+    }
+
+  if (!wakeReported)
+    {
+    topic=topics[TOPIC_WAKE_CAUSE];
+    bool published=publish(topic,wakeCause,false);
+    if (published && wakeGpio!=NO_WAKE_PORT)
+      {
+      topic=topics[TOPIC_WAKE_PORT];
+      sprintf(reading,"%d",wakeGpio);
+      published=publish(topic,reading,false);
+      }
+    wakeReported=published;
+    ok=ok & published;
+    yield();
+    }
+
+  if (rtc.summary.count>0) //samples were taken on the short wakes since the last report
+    {
+    sampleSummary& sum=rtc.summary;
+    size_t mark=arenaMark(requestArena);
+    char* summary=(char*)arenaAlloc(requestArena,SUMMARY_SIZE);
+    int len=summary?snprintf(summary,SUMMARY_SIZE,
+                     "{\"samples\":%u, \"vccMin\":%.2f, \"vccMax\":%.2f, \"ports\":[",
+                     sum.count,sum.vccMin/1000.0,sum.vccMax/1000.0):SUMMARY_SIZE;
+    bool first=true;
+    for (uint8_t n=0;n<activePortCount && len<SUMMARY_SIZE;n++)
+      {
+      uint8_t i=activePorts[n];
+      len+=snprintf(summary+len,SUMMARY_SIZE-len,
+                    "%s{\"GPIO\":%d, \"duty\":%u, \"transitions\":%u}",
+                    first?"":",",
+                    settings.ports[i].gpioNumber,
+                    (unsigned)(sum.highCount[i]*100UL/sum.count), //percent of samples that were high
+                    sum.transitions[i]);
+      first=false;
+      }
+    if (len<SUMMARY_SIZE)
+      snprintf(summary+len,SUMMARY_SIZE-len,"]}");
+    topic=topics[TOPIC_SUMMARY];
+    bool published=summary && publish(topic,summary,false); //no room means try again next report
+    if (published)
+      sum.count=0; //start a new summary
+    ok=ok & published;
+    arenaRelease(requestArena,mark);
+    yield();
+    }
+
+  //publish the radio strength reading while we're at it, if there is an access point to measure
+  int32_t rssi=WiFi.RSSI();
+  if (!espNowActive && needsPublish(full,CACHE_BIT_RSSI,rssi,rtc.cache.rssi,settings.rssiDeadband))
+    {
+    topic=topics[TOPIC_RSSI];
+    sprintf(reading,"%d",rssi); 
+    bool published=publish(topic,reading,true); //retain
+    if (published)
+      {
+      rtc.cache.rssi=rssi;
+      rtc.cache.validMask|=CACHE_BIT_RSSI;
+      }
+    ok=ok & published;
+    yield();
+    }
+  else
+    skipped++;
+
+  //publish the battery voltage
+  uint32_t vccMilliVolts = ESP.getVcc(); // millivolts
+  if (needsPublish(full,CACHE_BIT_VCC,vccMilliVolts,rtc.cache.vccMilliVolts,settings.vccDeadband))
+    {
+    float vccVolts = (float)vccMilliVolts / 1000.0;// Convert to Volts
+    topic=topics[TOPIC_BATTERY];
+    sprintf(reading,"%.2f",vccVolts); 
+    bool published=publish(topic,reading,true); //retain
+    if (published)
+      {
+      rtc.cache.vccMilliVolts=vccMilliVolts;
+      rtc.cache.validMask|=CACHE_BIT_VCC;
+      }
+    ok=ok & published;
+    yield();
+    }
+  else
+    skipped++;
+
+  // Publish some memory usage info
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (needsPublish(full,CACHE_BIT_FREE_HEAP,freeHeap,rtc.cache.freeHeap,settings.heapDeadband))
+    {
+    topic=topics[TOPIC_FREE_HEAP];
+    sprintf(reading,"%d",freeHeap); 
+    bool published=publish(topic,reading,true); //retain
+    if (published)
+      {
+      rtc.cache.freeHeap=freeHeap;
+      rtc.cache.validMask|=CACHE_BIT_FREE_HEAP;
+      }
+    ok=ok & published;
+    yield();
+    }
+  else
+    skipped++;
+
+  uint8_t heapFragmentation = ESP.getHeapFragmentation(); // Returns a percentage (0-100)
+  if (needsPublish(full,CACHE_BIT_HEAP_FRAGMENTATION,heapFragmentation,rtc.cache.heapFragmentation,settings.fragDeadband))
+    {
+    topic=topics[TOPIC_HEAP_FRAGMENTATION];
+    sprintf(reading,"%d%%",heapFragmentation); 
+    bool published=publish(topic,reading,true); //retain
+    if (published)
+      {
+      rtc.cache.heapFragmentation=heapFragmentation;
+      rtc.cache.validMask|=CACHE_BIT_HEAP_FRAGMENTATION;
+      }
+    ok=ok & published;
+    yield();
+    }
+  else
+    skipped++;
+
+  uint32_t maxFreeBlockSize = ESP.getMaxFreeBlockSize();
+  if (needsPublish(full,CACHE_BIT_MAX_FREE_BLOCK_SIZE,maxFreeBlockSize,rtc.cache.maxFreeBlockSize,settings.heapDeadband))
+    {
+    topic=topics[TOPIC_MAX_FREE_BLOCK_SIZE];
+    sprintf(reading,"%d",maxFreeBlockSize); 
+    bool published=publish(topic,reading,true); //retain
+    if (published)
+      {
+      rtc.cache.maxFreeBlockSize=maxFreeBlockSize;
+      rtc.cache.validMask|=CACHE_BIT_MAX_FREE_BLOCK_SIZE;
+      }
+    ok=ok & published;
+    yield();
+    }
+  else
+    skipped++;
+
+  if (full && ok)
+    rtc.cache.reportsSinceSync=0;
+  else if (rtc.cache.reportsSinceSync<0xFFFF)
+    rtc.cache.reportsSinceSync++;
+  saveRtcState();
+  
+  if (settings.debug)
+    {
+    Serial.print("Publish ");
+    Serial.println(ok?"OK":"Failed");
+    if (skipped>0)
+      Serial.printf("%d unchanged value(s) not published\n",skipped);
+    }
+  return ok;
+  }
+
+
+boolean publish(const char* topic, const char* reading, boolean retain)
+  {
+  if (settings.debug)
+    {
+    Serial.print(topic);
+    Serial.print(" ");
+    Serial.println(reading);
+    }
+  return publishBytes(topic,(const uint8_t*)reading,strlen(reading),retain);
+  }
+
+// Publish a payload that isn't text, or that has already been printed
+boolean publishBytes(const char* topic, const uint8_t* payload, unsigned int length, boolean retain)
+  {
+  boolean ok=false;
+  if (espNowActive)
+    return publishEspNow(topic,payload,length,retain);
+
+  connectToWiFi(); //just in case we're disconnected from WiFi
+  reconnectToBroker(); //also just in case we're disconnected from the broker
+
+  if (usingAsyncMqtt())
+    return publishAsync(topic,payload,length,retain);
+
+  if (mqttClient.connected() && 
+      settings.mqttTopicRoot &&
+      WiFi.status()==WL_CONNECTED)
+    {
+    ok=mqttClient.publish(topic,payload,length,retain); 
+    }
+  else
+    {
+    Serial.print("Can't publish due to ");
+    if (WiFi.status()!=WL_CONNECTED)
+      Serial.println("no WiFi connection.");
+    else if (!mqttClient.connected())
+      Serial.println("not connected to broker.");
+    }
+  return ok;
+  }
+
+/*
+ * Queue a publish on the async client and return without waiting for the
+ * broker. It only waits if the window of unacknowledged publishes is full or
+ * TCP has no room, and then only until a PUBACK makes room.
+ */
+boolean publishAsync(const char* topic, const uint8_t* payload, unsigned int length, boolean retain,
+                     const asyncMqttProperties* props)
+  {
+  if (!mqttAsync.connected())
+    {
+    Serial.println("Can't publish due to not connected to broker.");
+    return false;
+    }
+  uint32_t start=millis();
+  boolean ok;
+  while (!(ok=mqttAsync.publish(topic,payload,length,retain,1,props))
+         && mqttAsync.connected()
+         && millis()-start<ASYNC_MQTT_ACK_TIMEOUT_MS)
+    {
+    mqttAsync.loop();
+    checkAwakeBudget();
+    delay(1); //lets the TCP stack deliver the acknowledgements
+    }
+  return ok;
+  }
+
+/*
+ * A QoS1 publish that was never acknowledged means the broker may be missing a
+ * value, so forget what was last published and send everything next time.
+ */
+void checkAsyncFailures()
+  {
+  uint16_t lost=mqttAsync.takeFailures();
+  if (lost>0)
+    {
+    rtc.cache.validMask=0;
+    if (settings.debug)
+      {
+      Serial.print(lost);
+      Serial.println(" MQTT publishes were not acknowledged, the next report will be complete");
+      }
+    }
+  }
+
+// The channel to find the gateway on, or 0 if it isn't known yet
+uint8_t espNowChannel()
+  {
+  return settings.espNowChannel?settings.espNowChannel:rtc.net.channel;
+  }
+
+/*
+ * Publish through the ESP-NOW gateway on this wake? Only on a wake from deep
+ * sleep, so a reset or power up still joins WiFi where the device can be
+ * configured, and where it learns the access point's channel, which is the
+ * gateway's channel too.
+ */
+bool useEspNow()
+  {
+#ifdef ESPNOW_GATEWAY
+  return false; //this is the other end
+#else
+  return settings.espNow
+      && settingsAreValid
+      && ESP.getResetInfoPtr()->reason==REASON_DEEP_SLEEP_AWAKE
+      && espNowChannel()!=0
+      && !rtc.espNowFailed
+      && viewToMac({settings.espNowGateway,strlen(settings.espNowGateway)},espNowGatewayMac)
+      && viewToKey({settings.espNowKey,strlen(settings.espNowKey)},espNowLmk);
+#endif
+  }
+
+/*
+ * Get the radio ready to send to the gateway. ESP-NOW needs station mode but
+ * doesn't connect to anything, so there is no association, DHCP or broker
+ * connection to wait for, just the radio coming up on the gateway's channel.
+ */
+bool startEspNow()
+  {
+  uint8_t channel=espNowChannel();
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.disconnect(); //don't let the SDK join the last network on its own
+  wifi_set_channel(channel);
+  if (esp_now_init()!=0)
+    {
+    Serial.println("ESP-NOW didn't start, using WiFi");
+    return false;
+    }
+  esp_now_set_self_role(ESP_NOW_ROLE_CONTROLLER);
+  esp_now_register_send_cb(espNowSent);
+  esp_now_add_peer(espNowGatewayMac,ESP_NOW_ROLE_SLAVE,channel,espNowLmk,ESPNOW_KEY_BYTES); //the gateway only takes encrypted frames
+  if (rtc.espNowSequence==0) //after a power up, so the gateway doesn't take the first frame for one it has seen
+    rtc.espNowSequence=ESP.random();
+  espNowActive=true;
+  enterPhase(PHASE_PUBLISH);
+  if (settings.debug)
+    Serial.printf("Publishing through ESP-NOW gateway %s on channel %u\n",settings.espNowGateway,channel);
+  return true;
+  }
+
+/*
+ * The gateway didn't acknowledge part of the report. It may have forwarded it
+ * anyway and only the acknowledgement was lost, so sending the report to the
+ * broker now could deliver it twice. Leave it for the next wake instead, which
+ * joins WiFi, sends everything, and updates the cached channel in case the
+ * access point moved. A change that may not have got through gets that wake
+ * right away.
+ */
+void stopEspNow()
+  {
+  Serial.println("No answer from the ESP-NOW gateway, the next wake will use WiFi");
+  esp_now_deinit();
+  rtc.espNowFailed=true;
+  rtc.cache.validMask=0;
+  if (!wakeReported && strcmp(wakeCause,WAKE_CAUSE_CHANGE)==0)
+    {
+    rtc.changePending=true;
+    rtc.pendingGpio=wakeGpio;
+    goToSleep(RADIO_RESTART_MICROS,nextWakeRfMode(true));
+    }
+  sleepUntilNextWake();
+  }
+
+// Called by the SDK with the gateway's answer to a frame, 0 if it got it
+void espNowSent(uint8_t* mac, uint8_t status)
+  {
+  espNowSendStatus=status;
+  }
+
+/*
+ * Send one publish to the gateway for it to forward to the broker. Each try
+ * waits a few milliseconds for the gateway's radio to acknowledge it. They all
+ * have the same sequence number, so if it was the acknowledgement that got
+ * lost the gateway still only forwards it once.
+ */
+boolean publishEspNow(const char* topic, const uint8_t* payload, unsigned int length, boolean retain)
+  {
+  uint8_t frame[ESPNOW_MAX_FRAME];
+  size_t size=espNowEncode(frame,sizeof(frame),++rtc.espNowSequence,retain,topic,payload,length);
+  if (size==0)
+    {
+    Serial.print(topic);
+    Serial.println(" is too big for ESP-NOW");
+    return false;
+    }
+  for (uint8_t i=0;i<ESPNOW_SEND_TRIES;i++)
+    {
+    espNowSendStatus=-1;
+    if (esp_now_send(espNowGatewayMac,frame,size)!=0)
+      continue;
+    uint32_t start=millis();
+    while (espNowSendStatus<0 && millis()-start<ESPNOW_SEND_TIMEOUT_MS)
+      delay(1); //lets the SDK call espNowSent()
+    if (espNowSendStatus==0)
+      return true;
+    }
+  return false;
+  }
+
+#ifdef ESPNOW_GATEWAY
+/*
+ * Listen for the nodes. The gateway is on its access point's channel, and the
+ * receiver can't sleep between beacons or it would miss them.
+ */
+void startEspNowGateway()
+  {
+  static bool started=false; //this is called each time WiFi connects
+  if (started)
+    return;
+  started=true;
+  WiFi.setSleepMode(WIFI_NONE_SLEEP);
+  if (esp_now_init()!=0)
+    {
+    Serial.println("ESP-NOW didn't start");
+    return;
+    }
+  esp_now_set_self_role(ESP_NOW_ROLE_SLAVE);
+  esp_now_register_recv_cb(espNowReceived);
+  espNowListening=true;
+  pairEspNowNodes();
+  Serial.printf("ESP-NOW gateway listening on channel %d. Set espnowgateway=%s on the nodes.\n",
+                WiFi.channel(),WiFi.macAddress().c_str());
+  }
+
+/*
+ * Make each paired node an ESP-NOW peer with the key, so the SDK decrypts its
+ * frames. Called again whenever the settings are saved, so the peers from
+ * before are removed first. Without a key no node is a peer, and nothing is
+ * forwarded.
+ */
+void pairEspNowNodes()
+  {
+  if (!espNowListening)
+    return;
+  for (uint8_t i=0;i<espNowPeerCount;i++)
+    esp_now_del_peer(espNowPeers[i]);
+  espNowPeerCount=0;
+
+  uint8_t key[ESPNOW_KEY_BYTES];
+  if (!viewToKey({settings.espNowKey,strlen(settings.espNowKey)},key))
+    {
+    Serial.println("No espnowkey is set, so nothing from the ESP-NOW nodes is forwarded");
+    return;
+    }
+  for (uint8_t i=0;i<ESPNOW_NODE_COUNT;i++)
+    {
+    espNowNode& n=settings.espNowNodes[i];
+    if (n.topicRoot[0]=='\0')
+      continue;
+    if (esp_now_add_peer(n.mac,ESP_NOW_ROLE_CONTROLLER,WiFi.channel(),key,ESPNOW_KEY_BYTES)==0)
+      memcpy(espNowPeers[espNowPeerCount++],n.mac,MAC_BYTES);
+    else
+      Serial.printf("Couldn't pair with ESP-NOW node %02x:%02x:%02x:%02x:%02x:%02x\n",
+                    n.mac[0],n.mac[1],n.mac[2],n.mac[3],n.mac[4],n.mac[5]);
+    }
+  }
+
+// The settings entry for a paired node, or -1 if it isn't one
+int8_t findEspNowNode(const uint8_t* mac)
+  {
+  for (uint8_t i=0;i<ESPNOW_NODE_COUNT;i++)
+    {
+    espNowNode& n=settings.espNowNodes[i];
+    if (n.topicRoot[0]!='\0' && memcmp(n.mac,mac,MAC_BYTES)==0)
+      return i;
+    }
+  return -1;
+  }
+
+// Is this node one of the peers set up with the key?
+bool espNowPaired(const uint8_t* mac)
+  {
+  for (uint8_t i=0;i<espNowPeerCount;i++)
+    {
+    if (memcmp(espNowPeers[i],mac,MAC_BYTES)==0)
+      return true;
+    }
+  return false;
+  }
+
+// A node may only publish under its own topic root, never with wildcards, and never to a command topic
+bool espNowTopicAllowed(const char* root, const char* topic)
+  {
+  size_t rootLength=strlen(root);
+  if (strncmp(topic,root,rootLength)!=0 || topic[rootLength]=='\0' || strpbrk(topic,"+#"))
+    return false;
+  const char* last=strrchr(topic,'/');
+  return strcmp(last?last+1:topic,MQTT_TOPIC_COMMAND_REQUEST)!=0;
+  }
+
+// Called by the SDK for each frame. Just queue it, the publishing is done by gatewayTask().
+void espNowReceived(uint8_t* mac, uint8_t* data, uint8_t length)
+  {
+  if (!espNowPaired(mac))
+    {
+    gatewayStats.unknown++;
+    return;
+    }
+  uint8_t next=(espNowTail+1)%ESPNOW_QUEUE_SIZE;
+  if (next==espNowHead)
+    {
+    gatewayStats.dropped++;
+    return;
+    }
+  queuedFrame& f=espNowQueue[espNowTail];
+  memcpy(f.mac,mac,MAC_BYTES);
+  f.length=min(length,(uint8_t)ESPNOW_MAX_FRAME);
+  memcpy(f.data,data,f.length);
+  espNowTail=next;
+  }
+
+bool espNowQueued()
+  {
+  return espNowHead!=espNowTail;
+  }
+
+/*
+ * Forward what the nodes sent to the broker. Each frame has the full topic,
+ * which has to be under the topic root the node was paired with, so a node
+ * can't publish as another device or send one a command. A node's retries
+ * are only forwarded once.
+ */
+void gatewayTask()
+  {
+  AUDIT_SUBSYSTEM(SUBSYSTEM_NETWORK);
+  while (espNowQueued())
+    {
+    queuedFrame& f=espNowQueue[espNowHead];
+    espNowMessage msg;
+    int8_t node=findEspNowNode(f.mac);
+    if (!espNowDecode(f.data,f.length,msg))
+      gatewayStats.bad++;
+    else if (node<0) //unpaired since it was queued
+      gatewayStats.unknown++;
+    else if (!espNowTopicAllowed(settings.espNowNodes[node].topicRoot,msg.topic))
+      gatewayStats.refused++;
+    else if (!espNowIsNew(espNowHeard,f.mac,msg.sequence))
+      gatewayStats.duplicates++;
+    else if (publishBytes(msg.topic,msg.payload,msg.length,msg.retain))
+      gatewayStats.forwarded++;
+    else
+      gatewayStats.failed++;
+    if (settings.debug)
+      Serial.printf("From %02x:%02x:%02x:%02x:%02x:%02x, %u bytes\n",
+                    f.mac[0],f.mac[1],f.mac[2],f.mac[3],f.mac[4],f.mac[5],f.length);
+    espNowHead=(espNowHead+1)%ESPNOW_QUEUE_SIZE;
+    }
+  }
+#endif
+
+
+
+/**
+ * Handler for incoming MQTT messages.  The payload is the command to perform. 
+ * The MQTT message topic sent is the topic root plus the command.
+ * Implemented commands are: 
+ * MQTT_PAYLOAD_SETTINGS_COMMAND: sends a JSON payload of all user-specified settings
+ * MQTT_PAYLOAD_REBOOT_COMMAND: Reboot the controller
+ * MQTT_PAYLOAD_VERSION_COMMAND Show the version number
+ * MQTT_PAYLOAD_MEMSTATS_COMMAND Show heap and arena use
+ * MQTT_PAYLOAD_LATENCY_COMMAND Show the latency histograms
+ * MQTT_PAYLOAD_STATUS_COMMAND Show the most recent flow values
+ */
+void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) 
+  {
+  AUDIT_SUBSYSTEM(SUBSYSTEM_MQTT);
+  noteActivity();
+  lastCommandAt=millis();
+  if (settings.debug)
+    {
+    Serial.println("====================================> Callback works.");
+    }
+  boolean rebootScheduled=false; //so we can reboot after sending the reboot response
+  char charbuf[MQTT_MAX_INCOMING_PAYLOAD_SIZE];
+  if (length < MQTT_MAX_INCOMING_PAYLOAD_SIZE)
+    {
+    payload[length]='\0'; //this should have been done in the calling code, shouldn't have to do it here
+    sprintf(charbuf,"%s",payload);
+    const char* response;
+    size_t mark=arenaMark(requestArena); //everything from the arena is given back at the end
+    
+    
+    //if the command is MQTT_PAYLOAD_SETTINGS_COMMAND, send all of the settings
+    if (strcmp(charbuf,MQTT_PAYLOAD_SETTINGS_COMMAND)==0)
+      {
+      char* jsonStatus=(char*)arenaAlloc(requestArena,JSON_STATUS_SIZE);
+      if (!jsonStatus)
+        response="No room for the settings report";
+      else if (settingsJson(jsonStatus,JSON_STATUS_SIZE)<JSON_STATUS_SIZE)
+        response=jsonStatus;
+      else
+        response="Settings report too big";
+      }
+    else if (strcmp(charbuf,MQTT_PAYLOAD_MEMSTATS_COMMAND)==0) //show heap use
+      {
+      char* stats=(char*)arenaAlloc(requestArena,MEMSTATS_SIZE);
+      if (stats)
+        {
+        memStatsJson(stats,MEMSTATS_SIZE);
+        response=stats;
+        }
+      else
+        response="No room for memstats";
+      }
+    else if (strcmp(charbuf,MQTT_PAYLOAD_LATENCY_COMMAND)==0) //show where the time goes
+      {
+      char* stats=(char*)arenaAlloc(requestArena,LATENCY_JSON_SIZE);
+      if (stats)
+        {
+        latencyJson(stats,LATENCY_JSON_SIZE);
+        response=stats;
+        }
+      else
+        response="No room for latency";
+      }
+    else if (strcmp(charbuf,MQTT_PAYLOAD_VERSION_COMMAND)==0) //show the version number
+      {
+      char tmp[15];
+      strcpy(tmp,VERSION);
+      response=tmp;
+      }
+    else if (strcmp(charbuf,MQTT_PAYLOAD_STATUS_COMMAND)==0) //show the latest value
+      {
+      report(true); //asked for, so send everything
+      char tmp[25];
+      strcpy(tmp,"Status report complete");
+      response=tmp;
+      }
+    else if (strcmp(charbuf,MQTT_PAYLOAD_REBOOT_COMMAND)==0) //reboot the controller
+      {
+      char tmp[10];
+      strcpy(tmp,"REBOOTING");
+      response=tmp;
+      rebootScheduled=true;
+      }
+    else
+      response=parseResultText(processCommand(charbuf,length)); //"OK" or the reason it failed
+      
+    // An MQTT 5 request can say where its reply goes, and what to tag it with so the
+    // sender can match them up. Otherwise the command becomes the topic suffix.
+    char topic[MQTT_TOPIC_SIZE];
+    const char* replyTopic=usingAsyncMqtt()?mqttAsync.responseTopic():NULL;
+    if (!replyTopic)
+      {
+      strcpy(topic,settings.mqttTopicRoot);
+      strcat(topic,charbuf);
+      replyTopic=topic;
+      }
+
+    bool sent;
+    if (usingAsyncMqtt())
+      {
+      asyncMqttProperties props={MQTT5_REPLY_EXPIRY_S,NULL,0}; //a stale reply is no use to anyone
+      props.correlation=mqttAsync.correlationData(props.correlationLength);
+      if (settings.debug)
+        {
+        Serial.print(replyTopic);
+        Serial.print(" ");
+        Serial.println(response);
+        }
+      sent=publishAsync(replyTopic,(const uint8_t*)response,strlen(response),false,&props);
+      }
+    else
+      sent=publish(replyTopic,response,false); //do not retain
+    if (!sent)
+      Serial.println("************ Failure when publishing status response!");
+      
+    if (usingAsyncMqtt())
+      mqttAsync.flush(ASYNC_MQTT_ACK_TIMEOUT_MS); //done as soon as the broker has it
+    else
+      delay(2000); //give publish time to complete
+    
+    arenaRelease(requestArena,mark);
+    if (rebootScheduled)
+      restartPending=true; //not from here, the command hasn't been acknowledged yet
+    }
+  else
+    Serial.println("Incoming MQTT message too large.");
+  }
+
+
+/*
+ * Write all of the user settings as JSON, for the settings command. Returns
+ * the length like snprintf(), so anything size or over means it was cut short.
+ * JSON_STATUS_SIZE is worked out from the longest each field can be.
+ */
+int settingsJson(char* buf, size_t size)
+  {
+  int len=snprintf(buf,size,"{\"broker\":\"%s\", \"port\":%d",
+                   settings.mqttBrokerAddress,settings.mqttBrokerPort);
+  for (uint8_t i=0;i<BACKUP_BROKER_COUNT && len<(int)size;i++)
+    len+=snprintf(buf+len,size-len,", \"broker%d\":\"%s\"",i+2,settings.backupBrokers[i]);
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,
+                  ", \"topicroot\":\"%s\", \"user\":\"%s\", \"pass\":\"%s\", \"ssid\":\"%s\", \"wifipass\":\"%s\""
+                  ", \"mqttClientId\":\"%s\", \"address\":\"%s\", \"netmask\":\"%s\", \"gateway\":\"%s\""
+                  ", \"dns\":\"%s\", \"mdnsname\":\"%s\", \"debug\":\"%s\", \"reportinterval\":%lu",
+                  settings.mqttTopicRoot,settings.mqttUsername,settings.mqttPassword,settings.ssid,
+                  settings.wifiPassword,settings.mqttClientId,settings.address,settings.netmask,
+                  settings.gateway,settings.dns,settings.mdnsName,settings.debug?"true":"false",
+                  settings.reportInterval);
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,
+                  ", \"changeonly\":\"%s\", \"fullsync\":%u, \"rssideadband\":%u, \"vccdeadband\":%u"
+                  ", \"heapdeadband\":%u, \"fragdeadband\":%u, \"wakeport\":%d, \"samples\":%u"
+                  ", \"rfcalinterval\":%u, \"awakebudget\":%u, \"apafterfailures\":%u, \"maxsleep\":%u"
+                  ", \"slotted\":\"%s\", \"timeserver\":\"%s\", \"cachettl\":%u",
+                  settings.changeOnly?"true":"false",settings.fullSyncInterval,settings.rssiDeadband,
+                  settings.vccDeadband,settings.heapDeadband,settings.fragDeadband,settings.wakePort,
+                  settings.samplesPerReport,settings.rfCalInterval,settings.awakeBudget,
+                  settings.apAfterFailures,settings.maxSleep,settings.slotted?"true":"false",
+                  settings.timeServer,settings.cacheTtl);
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,
+                  ", \"lightsleep\":\"%s\", \"binaryreport\":\"%s\", \"mqttasync\":\"%s\""
+                  ", \"persistentsession\":\"%s\", \"mqtt5\":\"%s\", \"mqtttls\":\"%s\", \"tlsfingerprint\":\"%s\""
+                  ", \"espnow\":\"%s\", \"espnowgateway\":\"%s\", \"espnowchannel\":%u, \"espnowkey\":\"%s\"",
+                  settings.lightSleep?"true":"false",settings.binaryReport?"true":"false",
+                  settings.asyncMqtt?"true":"false",settings.persistentSession?"true":"false",
+                  settings.mqtt5?"true":"false",settings.mqttTls?"true":"false",settings.tlsFingerprint,
+                  settings.espNow?"true":"false",settings.espNowGateway,settings.espNowChannel,
+                  settings.espNowKey);
+  IPAddress ip=wifiClient.localIP();
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,", \"IPAddress\":\"%u.%u.%u.%u\",\"ports\":[",ip[0],ip[1],ip[2],ip[3]);
+  bool first=true;
+  for (int i=0;i<PORT_COUNT && len<(int)size;i++)
+    {
+    port& p=settings.ports[i];
+    if (p.isActive)
+      {
+      len+=snprintf(buf+len,size-len,"%s{\"GPIO\":%d, \"highmessage\":\"%s\", \"lowmessage\":\"%s\", \"usePullup\":\"%s\"}",
+                    first?"":",",p.gpioNumber,p.highMessage,p.lowMessage,p.usePullup?"true":"false");
+      first=false;
+      }
+    }
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,"]}");
+  return len;
+  }
+
+/*
+ * Heap and arena use as JSON, for the memstats command and /api/memstats.
+ * A heap audit build adds the allocation counts for each subsystem.
+ */
+int memStatsJson(char* buf, size_t size)
+  {
+  int len=snprintf(buf,size,
+                   "{\"freeHeap\":%u, \"maxBlockSize\":%u, \"heapFrag\":%u, "
+                   "\"arenaSize\":%u, \"arenaHighWater\":%u, \"arenaFailures\":%u, \"audit\":",
+                   ESP.getFreeHeap(),ESP.getMaxFreeBlockSize(),ESP.getHeapFragmentation(),
+                   (unsigned)requestArena.size,(unsigned)requestArena.highWater,requestArena.failures);
+#ifdef HEAP_AUDIT
+  if (len<(int)size)
+    len+=heapAuditJson(buf+len,size-len);
+#else
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,"null");
+#endif
+  if (len<(int)size)
+    len+=snprintf(buf+len,size-len,"}");
+  return len;
+  }
+
+//Generate an MQTT client ID.  This should not be necessary very often
+char* generateMqttClientId(char* mqttId)
+  {
+  snprintf(mqttId,MQTT_CLIENTID_SIZE,"%s%lx",MQTT_CLIENT_ID_ROOT,(unsigned long)random(0xffff));
+  if (settings.debug)
+    {
+    Serial.print("New MQTT userid is ");
+    Serial.println(mqttId);
+    }
+  return mqttId;
+  }
+
+/*
+ * Reconnect to the MQTT broker
+ */
+void reconnectToBroker() 
+  {
+  if (strlen(settings.mqttBrokerAddress)>0)
+    {
+    if (WiFi.status() != WL_CONNECTED)
+      {
+      Serial.println("WiFi not ready, skipping MQTT connection");
+      }
+    else if (usingAsyncMqtt())
+      {
+      connectAsync(); //doesn't wait, networkTask() finishes the job
+      }
+    else
+      {
+      // Loop until we're reconnected
+      while (!mqttClient.connected()) 
+        {
+        checkAwakeBudget();
+        Serial.print("Attempting MQTT connection...");
+
+        mqttClient.setBufferSize(max(JSON_STATUS_SIZE,max(MEMSTATS_SIZE,LATENCY_JSON_SIZE))+MQTT_TOPIC_SIZE); //default (256) isn't big enough
+        mqttClient.setKeepAlive(120); //seconds
+        mqttClient.setSocketTimeout(BROKER_CONNECT_TIMEOUT_MS/1000); //don't wait long on a broker that's down
+        wifiClient.setTimeout(BROKER_CONNECT_TIMEOUT_MS);
+        secureClient.setTimeout(BROKER_CONNECT_TIMEOUT_MS);
+        IPAddress brokerIp;
+        bool resolved;
+        if (!selectBroker(brokerIp,resolved))
+          break;
+        if (resolved)
+          mqttClient.setServer(brokerIp, brokerPort);
+        else
+          mqttClient.setServer(brokerHost, brokerPort);
+        mqttClient.setCallback(incomingMqttHandler);
+        if (settings.mqttTls)
+          {
+          prepareTls();
+          mqttClient.setClient(secureClient);
+          }
+        else
+          mqttClient.setClient(wifiClient);
+        yield();
+
+        // Attempt to connect
+        uint32_t connectStart=millis();
+        if (mqttClient.connect(settings.mqttClientId,settings.mqttUsername,settings.mqttPassword,
+                               NULL,0,false,NULL,!settings.persistentSession))
+          {
+          Serial.println("connected to MQTT broker.");
+          enterPhase(PHASE_PUBLISH);
+          brokerConnectedAt=millis();
+          brokerConnected(brokerIndex,brokerConnectedAt-connectStart);
+          if (settings.mqttTls)
+            saveTlsSession(brokerConnectedAt-connectStart);
+
+          //resubscribe to the incoming message topic
+          bool subgood=mqttClient.subscribe(topics[TOPIC_COMMAND],1); //QoS 1 so the broker queues commands while we sleep
+          showSub(topics[TOPIC_COMMAND],subgood);
+          }
+        else 
+          {
+          Serial.print("failed, rc=");
+          Serial.println(mqttClient.state());
+          brokerFailed(brokerIndex);
+          if (settings.mqttTls)
+            {
+            char reason[80];
+            secureClient.getLastSSLError(reason,sizeof(reason));
+            Serial.print("TLS: ");
+            Serial.println(reason); //a fingerprint mismatch shows up here
+            rtc.net.tlsSessionValid=false;
+            tlsSession=BearSSL::Session(); //or the retry offers the same session again
+            }
+          if (chooseBroker()==brokerIndex) //nowhere else to go, so wait a second before retrying
+            {
+            Serial.println("Will try again in a second");
+          
+            // In the meantime check for input in case something needs to be changed to make it work
+            yield();
+            delay(1000);
+            yield();
+            }
+          }
+        checkForCommand();
+        }
+      mqttClient.loop(); //This has to happen every so often or we get disconnected for some reason
+      }
+    }
+  else if (settings.debug)
+    {
+    Serial.println("Broker address not set, ignoring MQTT");
+    }
+  }
+
+/*
+ * Get the TLS client ready to connect. The broker's certificate is pinned by its
+ * fingerprint, and the session saved before the last deep sleep is offered so
+ * the broker can resume it with an abbreviated handshake instead of a full one.
+ */
+void prepareTls()
+  {
+  static int8_t sessionBroker=-1; //the broker tlsSession is from
+  if (sessionBroker!=brokerIndex) //a session is only any good with the broker that made it
+    {
+    tlsSession=BearSSL::Session();
+    if (rtc.net.tlsSessionValid && rtc.net.tlsBroker==brokerIndex)
+      memcpy((void*)&tlsSession,rtc.net.tlsSession,sizeof(tlsSession));
+    sessionBroker=brokerIndex;
+    }
+  secureClient.setSession(&tlsSession);
+
+  uint8_t fingerprint[FINGERPRINT_BYTES];
+  if (viewToFingerprint({settings.tlsFingerprint,strlen(settings.tlsFingerprint)},fingerprint))
+    secureClient.setFingerprint(fingerprint);
+  else
+    {
+    Serial.println("No TLS fingerprint is set, so the broker's certificate is not checked");
+    secureClient.setInsecure();
+    }
+  }
+
+// Keep the session from a TLS connection in RTC memory for the next wake
+void saveTlsSession(uint32_t handshakeMs)
+  {
+  memcpy(rtc.net.tlsSession,(const void*)&tlsSession,sizeof(tlsSession));
+  rtc.net.tlsSessionValid=true;
+  rtc.net.tlsBroker=brokerIndex;
+  if (settings.debug)
+    {
+    Serial.print("TLS connection took ");
+    Serial.print(handshakeMs);
+    Serial.println("ms");
+    }
+  }
+
+// TLS is only done by the blocking client, so it overrides mqttasync
+bool usingAsyncMqtt()
+  {
+  return settings.asyncMqtt && !settings.mqttTls;
+  }
+
+/*
+ * Start the async client connecting if it isn't already, at most once a
+ * second. networkTask() subscribes when the connection is made.
+ */
+void connectAsync()
+  {
+  static bool attempted=false;
+  static bool failureNoted=false;
+  static uint32_t lastAttempt=0;
+  if (mqttAsync.connected() || mqttAsync.connecting())
+    return;
+  if (attempted && !asyncSubscribed && !failureNoted)
+    {
+    brokerFailed(brokerIndex);
+    failureNoted=true;
+    }
+  if (attempted && millis()-lastAttempt<ASYNC_MQTT_RETRY_MS && chooseBroker()==brokerIndex)
+    return; //no other broker to fail over to, so don't hammer this one
+  attempted=true;
+  failureNoted=false;
+  lastAttempt=millis();
+  lastAsyncConnect=lastAttempt;
+  asyncSubscribed=false;
+
+  if (settings.debug)
+    Serial.println("Starting MQTT connection...");
+  mqttAsync.setBufferSize(max(JSON_STATUS_SIZE,max(MEMSTATS_SIZE,LATENCY_JSON_SIZE))+MQTT_TOPIC_SIZE);
+  mqttAsync.setKeepAlive(120); //seconds
+  IPAddress brokerIp;
+  bool resolved;
+  if (!selectBroker(brokerIp,resolved))
+    return;
+  if (resolved)
+    mqttAsync.setServer(brokerIp, brokerPort);
+  else
+    mqttAsync.setServer(brokerHost, brokerPort);
+  mqttAsync.setCallback(incomingMqttHandler);
+  mqttAsync.setMqtt5(settings.mqtt5);
+  mqttAsync.setSessionExpiry(settings.persistentSession?MQTT5_SESSION_EXPIRY_S:0);
+  if (!mqttAsync.connect(settings.mqttClientId,settings.mqttUsername,settings.mqttPassword,!settings.persistentSession))
+    Serial.println("MQTT connection could not be started");
+  }
+
+// Run the async client, and subscribe once it has connected
+void serviceAsyncMqtt()
+  {
+  if (!mqttAsync.connected() && WiFi.status() == WL_CONNECTED)
+    reconnectToBroker();
+  PROFILE(PROFILE_MQTT);
+  mqttAsync.loop();
+  if (mqttAsync.connected() && !asyncSubscribed)
+    {
+    if (settings.debug)
+      Serial.println("connected to MQTT broker.");
+    enterPhase(PHASE_PUBLISH);
+    brokerConnectedAt=millis();
+    brokerConnected(brokerIndex,brokerConnectedAt-lastAsyncConnect);
+    asyncSubscribed=mqttAsync.subscribe(topics[TOPIC_COMMAND],1); //QoS 1 so the broker queues commands while we sleep
+    showSub(topics[TOPIC_COMMAND],asyncSubscribed);
+    }
+  checkAsyncFailures();
+  }
+
+/*
+ * With a persistent session the broker sends the commands it kept for us as
+ * soon as we connect. True once it has had time to, and none have come in for
+ * a moment, so they are all handled before deciding whether to sleep. Always
+ * true if the broker was never reached, so that can't keep the device awake.
+ */
+bool commandsDrained()
+  {
+  if (!settings.persistentSession || brokerConnectedAt==0)
+    return true;
+  return millis()-brokerConnectedAt>=COMMAND_DRAIN_MS
+      && millis()-lastCommandAt>=COMMAND_DRAIN_MS;
+  }
+
+// Restart for a reboot command, now that the broker has its acknowledgement
+void restartAfterCommand()
+  {
+  Serial.println("Restarting for the reboot command");
+  if (usingAsyncMqtt())
+    {
+    mqttAsync.disconnect();
+    delay(100); //let the TCP stack send what is queued
+    }
+  else
+    mqttClient.disconnect();
+  ESP.restart();
+  }
+
+void showSub(const char* topic, bool subgood)
+  {
+  if (settings.debug)
+    {
+    Serial.print("++++++Subscribing to ");
+    Serial.print(topic);
+    Serial.print(":");
+    Serial.println(subgood);
+    }
+  }
+
+/**
+ * @brief Checks if a C-style string (char array) contains only
+ * alphanumeric characters (a-z, A-Z, 0-9).
+ *
+ * @param str The null-terminated char array to check.
+ * @return true if all characters are alphanumeric or the string is empty.
+ * @return false if any character is not alphanumeric.
+ */
+bool checkString(const char* str) 
+  {
+    if (str == nullptr) 
+      {
+      return false; // A null pointer is not a valid string
+      }
+
+    // Iterate through the string until the null terminator
+    for (size_t i = 0; str[i] != '\0'; ++i) 
+      {
+      // Cast char to unsigned char to avoid potential issues with 
+      // negative char values when passed to ctype functions.
+      unsigned char ch = static_cast<unsigned char>(str[i]); // Cast once
+      if (!isalnum(ch) && ch != '/' && ch != '.')
+        {
+        return false; // Found a non-alphanumeric character
+        }
+      }
+
+  // If the loop completes, all characters were alphanumeric (or the string was empty)
+  return true;
+  }
+
+// Check all of the text in all active ports for sanity
+bool checkPorts()
+  {
+  bool hasOne=false; //settings are incomplete unless we have at least one port activated
+  for (int i=0;i<PORT_COUNT;i++)
+    {
+    if (settings.ports[i].isActive)
+      {
+      hasOne=true;
+      if (!(checkString(settings.ports[i].highMessage) &&
+             checkString(settings.ports[i].lowMessage)))
+        return false;
+      }
+    else //clear out any that are inactive
+      {
+      settings.ports[i].gpioNumber=0;
+      settings.ports[i].highMessage[0]='\0';
+      settings.ports[i].lowMessage[0]='\0';
+      settings.ports[i].usePullup=false;
+      }
+//    yield();
+    }
+  return true && hasOne;
+  }
+
+/*
+ * Check all of the strings in the settings.   If any of the
+ * character strings in the settings fail the test, it's 
+ * likely that the settings are corrupt. 
+*/  
+bool settingsSanityCheck()
+  {
+  return checkString(settings.ssid)
+      && checkString(settings.wifiPassword)
+      && checkString(settings.mqttBrokerAddress)
+      && checkBackupBroker(settings.backupBrokers[0])
+      && checkBackupBroker(settings.backupBrokers[1])
+      && checkString(settings.mqttUsername)
+      && checkString(settings.mqttPassword)
+      && checkString(settings.mqttTopicRoot)
+      && checkString(settings.mqttClientId)
+      && checkString(settings.address)
+      && checkString(settings.mdnsName)
+      && checkString(settings.netmask)
+      && checkString(settings.gateway)
+      && checkString(settings.dns)
+      && checkPorts()
+      ;
+  }
+
+// True if the text setting is different from the one in the saved settings
+#define TEXT_CHANGED(saved,field) (strncmp((saved).field,settings.field,sizeof(settings.field))!=0)
+
+/*
+ * Forget the cached connection details and broker health that a settings
+ * change has made wrong, and keep them otherwise, so saving an unrelated
+ * setting doesn't cost the next wake a scan, DHCP and a DNS lookup. The
+ * EEPROM buffer still has the settings as they were last saved to compare with.
+ */
+void dropStaleCaches()
+  {
+  const conf& saved=*(const conf*)EEPROM.getConstDataPtr();
+  bool brokersChanged=TEXT_CHANGED(saved,mqttBrokerAddress)
+                   || saved.mqttBrokerPort!=settings.mqttBrokerPort;
+  for (uint8_t i=0;i<BACKUP_BROKER_COUNT;i++)
+    brokersChanged=brokersChanged || TEXT_CHANGED(saved,backupBrokers[i]);
+  bool networkChanged=TEXT_CHANGED(saved,ssid)
+                   || TEXT_CHANGED(saved,wifiPassword)
+                   || TEXT_CHANGED(saved,address)
+                   || TEXT_CHANGED(saved,netmask)
+                   || TEXT_CHANGED(saved,gateway)
+                   || TEXT_CHANGED(saved,dns);
+  bool tlsChanged=saved.mqttTls!=settings.mqttTls
+               || TEXT_CHANGED(saved,tlsFingerprint); //the cached TLS session is with the old setup
+
+  if (networkChanged || brokersChanged || tlsChanged)
+    clearNetworkCache();
+  if (brokersChanged)
+    memset(rtc.brokers,0,sizeof(rtc.brokers));
+  }
+
+/*
+ * Save the settings to EEPROM. Set the valid flag if everything is filled in.
+ */
+boolean saveSettings()
+  {
+  AUDIT_SUBSYSTEM(SUBSYSTEM_SETTINGS);
+  if (strlen(settings.ssid)>0 &&
+      strlen(settings.wifiPassword)>0 &&
+      // strlen(settings.mqttBrokerAddress)>0 &&
+      // settings.mqttBrokerPort!=0 &&
+      strlen(settings.mqttTopicRoot)>0 &&
+      strlen(settings.mqttClientId)>0 &&
+      settingsSanityCheck())
+    {
+    Serial.println("Settings deemed complete");
+    settings.validConfig=VALID_SETTINGS_FLAG;
+    settingsAreValid=true;
+    }
+  else
+    {
+    Serial.println("Settings still incomplete");
+    settings.validConfig=0;
+    settingsAreValid=false;
+    }
+    
+  //The mqttClientId is not set by the user, but we need to make sure it's set  
+  if (strlen(settings.mqttClientId)==0)
+    {
+    generateMqttClientId(settings.mqttClientId);
+    }
+
+  rebuildActivePorts();
+  rebuildTopics();
+  rtc.cache.validMask=0; //something may have changed what gets published, so send it all next time
+  dropStaleCaches();
+#ifdef ESPNOW_GATEWAY
+  pairEspNowNodes(); //the key or the nodes may have changed
+#endif
+    
+  EEPROM.put(0,settings);
+  if (settings.debug)
+    Serial.println("Committing settings to eeprom");
+  return EEPROM.commit();
+  }
+
+  //This is a special initialization function. Do not call except when necessary.
+void initTopicForTesting()
+  {
+  strcpy(settings.mqttTopicRoot,"buteomont/mousetest/"); // To keep from messing up the real mousetrap
+  saveSettings();
+  }
+
+void erasePortsForTesting()
+  {
+  for (int i=0;i<PORT_COUNT;i++)
+    {
+    settings.ports[i].isActive=false;
+    settings.ports[i].highMessage[0]='\0';
+    settings.ports[i].lowMessage[0]='\0';
+    }
+  saveSettings();
+  }
+
+void initSerial()
+  {
+  Serial.setRxBufferSize(SERIAL_RX_BUFFER_SIZE); // room for a pasted configuration script
+  Serial.begin(115200);
+  Serial.println();
+  Serial.println("Serial communications established.");
+  }
+
+void initFS()
+  {
+  if (!LittleFS.begin()) 
+    Serial.println("Failed to mount FS");
+  else
+    {
+    Serial.println("File system started.");
+    //   Serial.println("Listing LittleFS contents:");
+    // Dir dir = LittleFS.openDir("/"); // Open the root directory
+    // while (dir.next())
+    //   {
+    //   Serial.print("  FILE: ");
+    //   Serial.print(dir.fileName());
+    //   Serial.print("  SIZE: ");
+    //   Serial.println(dir.fileSize());
+    //   }
+    // Serial.println("-------------------------");
+    }
+
+  }
+
+/*
+*  Initialize the settings from eeprom and determine if they are valid
+*/
+void loadSettings()
+  {
+  AUDIT_SUBSYSTEM(SUBSYSTEM_SETTINGS);
+  EEPROM.get(0,settings);
+  bool upgraded=upgradeSettings(); //fill in any settings that are newer than what was saved
+
+  if (!settingsSanityCheck()) //if something is wildly off then don't run, allow setup
+    {
+    settings.validConfig=0;
+    settingsAreValid=false;
+    Serial.println(F("Settings are corrupt, marking invalid."));
+    }
+  else if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
+    {
+    settingsAreValid=true;
+    if (settings.debug)
+      {
+      Serial.println("\nLoaded configuration values from EEPROM");
+      }
+    if (upgraded)
+      {
+      Serial.println("Added defaults for new settings.");
+      EEPROM.put(0,settings);
+      EEPROM.commit();
+      }
+    }
+  else
+    {
+    Serial.println("Skipping load from EEPROM, device not configured.");    
+    settingsAreValid=false;
+    }
+  rebuildActivePorts(); //the sanity check cleared out any inactive ports
+  rebuildTopics();
+    showSettings();
+  }
+
+void reconfigSerial()
+  {
+  if (settings.ports[portIndex(TX_PIN)].isActive && settings.ports[portIndex(RX_PIN)].isActive)
+    {
+    Serial.println("*******************************************");
+    Serial.println("* Both TX and RX are being used for GPIO. *");
+    Serial.println("* Serial UART is being deactivated!       *");
+    Serial.println("*******************************************");
+    Serial.flush();
+    Serial.end();
+    }
+  else if (settings.ports[portIndex(RX_PIN)].isActive)
+    {
+    Serial.println("****************************************");
+    Serial.println("* The RX port is being used for GPIO.  *");
+    Serial.println("* Serial receive is being deactivated! *");
+    Serial.println("****************************************");
+    Serial.flush();
+    Serial.begin(115200,SERIAL_8N1,SERIAL_TX_ONLY); 
+    }    
+  else if (settings.ports[portIndex(TX_PIN)].isActive)
+    {
+    Serial.println("***************************************");
+    Serial.println("* The TX port is being used for GPIO. *");
+    Serial.println("* Serial.print is being deactivated!  *");
+    Serial.println("***************************************");
+    Serial.flush();
+    Serial.begin(115200,SERIAL_8N1,SERIAL_TX_ONLY); 
+    }
+  else
+    Serial.println("No port adjustments necessary.");  
+  }
+
+void initPorts()
+  {
+  for (uint8_t n=0;n<activePortCount;n++)
+    {
+    uint8_t i=activePorts[n];
+    int8_t port=indexPort(i);
+    bool pullup=settings.ports[i].usePullup && (gpioCapabilities[i]&GPIO_CAN_PULLUP);
+    pinMode(port,pullup?INPUT_PULLUP:INPUT);
+    }
+  }
+
+void initSettings()
+  {
+  EEPROM.begin(sizeof(settings)); //fire up the eeprom section of flash
+  loadSettings(); //set the values from eeprom 
+
+  //show the MAC address
+  Serial.print("ESP8266 MAC Address: ");
+  Serial.println(WiFi.macAddress());
+
+  if (settings.mqttBrokerPort < 0) //then this must be the first powerup
+    {
+    Serial.println("\n*********************** Resetting All EEPROM Values ************************");
+    initializeSettings();
+    saveSettings();
+    delay(2000);
+    ESP.restart();
+    }
+  }
+
+void startAPMode() 
+  {
+  Serial.println("\nStarting SoftAP Mode...");
+  WiFi.mode(WIFI_AP); // Set mode to AP
+  // Optional: Set a static IP for the AP (defaults to 192.168.4.1)
+  WiFi.softAPConfig(IPAddress(192, 168, 4, 1), IPAddress(192, 168, 4, 1), IPAddress(255, 255, 255, 0));
+  bool result = WiFi.softAP(STANDALONE_SSID, "password");
+  apModeActive=true;
+
+  if (result) 
+    {
+    Serial.print("SoftAP '" + String(STANDALONE_SSID) + "' started. IP: ");
+    Serial.println(WiFi.softAPIP());
+    } 
+  else 
+    {
+    Serial.println("Failed to start SoftAP!");
+    }
+  keepAwake=millis()+STAY_AWAKE_INCREMENT; //stay awake a while for changes via web page
+
+  // The receiver has to stay on for an access point, so light sleep isn't possible.
+  // Configuration is done from close by though, so the transmitter can be turned down.
+  WiFi.setOutputPower(AP_MODE_TX_POWER_DBM);
+  }
+
+/**
+ * @brief Checks if the ESP8266 SoftAP is actively running.
+ *
+ * This function verifies if the current WiFi mode includes AP functionality
+ * and that the SoftAP interface has a valid IP address.
+ *
+ * @return true if SoftAP is running and initialized, false otherwise.
+ */
+// bool isSoftAPRunning()
+//   {
+//   // Check if the current Wi-Fi mode is AP or AP_STA
+//   if (WiFi.getMode() == WIFI_AP || WiFi.getMode() == WIFI_AP_STA)
+//     {
+//     // Additionally, check if the SoftAP has successfully obtained an IP address.
+//     // If the IP is 0.0.0.0, it usually means the AP failed to start correctly.
+//     if (WiFi.softAPIP()[0] != 0)
+//       {
+//       return true; // AP mode is active and has an IP
+//       }
+//     }
+//   return false; // AP mode is not active or hasn't got an IP
+//   }
+
+/*
+ * Parse the static network settings. Anything blank or invalid is left unset.
+ */
+void initNetworkSettings()
+  {
+  if (!ip.fromString(settings.address))
+    {
+    ip=IPAddress();
+    if (settings.debug && !apModeActive)
+      Serial.println("Static IP Address '"+String(settings.address)+"' is blank or not valid. Using dynamic addressing.");
+    }
+  else if (!mask.fromString(settings.netmask))
+    {
+    Serial.println("Static network mask "+String(settings.netmask)+" is not valid.");
+    ip=IPAddress(); //can't use the static address without it
+    }
+  if (!gateway.fromString(settings.gateway))
+    gateway=ip; //what was always used before there was a gateway setting
+  if (!dns.fromString(settings.dns))
+    dns=gateway;
+  }
+
+// Forget the cached lease, channel and TLS session, so the next connection starts fresh
+void clearNetworkCache()
+  {
+  memset(&rtc.net,0,sizeof(rtc.net));
+  }
+
+/*
+ * Set up the address before connecting. A static address is used if there is one,
+ * otherwise the DHCP lease from the last connection if it hasn't expired. Returns
+ * true if the cached lease is being used, so it can be dropped if it doesn't work.
+ */
+bool configureAddress()
+  {
+  if (ip.isSet())
+    {
+    if (!WiFi.config(ip,gateway,mask,dns))
+      {
+      Serial.println("STA Failed to configure");
+      }
+    return false;
+    }
+  if (rtc.net.ip!=0 && clockSeconds()-rtc.net.leaseSeconds<settings.cacheTtl)
+    {
+    if (settings.debug)
+      Serial.println("Using cached DHCP lease");
+    return WiFi.config(IPAddress(rtc.net.ip),IPAddress(rtc.net.gateway),IPAddress(rtc.net.netmask),IPAddress(rtc.net.dns));
+    }
+  return false;
+  }
+
+// Remember the details of a good connection for the next wake
+void cacheConnection()
+  {
+  if (!ip.isSet() && rtc.net.ip==0) //got this one from DHCP
+    {
+    rtc.net.ip=WiFi.localIP();
+    rtc.net.gateway=WiFi.gatewayIP();
+    rtc.net.netmask=WiFi.subnetMask();
+    rtc.net.dns=WiFi.dnsIP();
+    rtc.net.leaseSeconds=clockSeconds();
+    }
+  uint8_t* bssid=WiFi.BSSID();
+  if (bssid)
+    {
+    memcpy(rtc.net.bssid,bssid,sizeof(rtc.net.bssid));
+    rtc.net.channel=WiFi.channel();
+    }
+  }
+
+/*
+ * Find broker n's address. If its host is already an address, or it was looked
+ * up within cacheTtl seconds, there's no need to ask DNS.
+ */
+bool resolveBroker(uint8_t n, const char* host, IPAddress& brokerIp)
+  {
+  brokerHealth& h=rtc.brokers[n];
+  if (brokerIp.fromString(host))
+    return true;
+  if (h.ip!=0 && clockSeconds()-h.ipSeconds<settings.cacheTtl)
+    {
+    brokerIp=IPAddress(h.ip);
+    return true;
+    }
+  if (WiFi.hostByName(host,brokerIp)==1)
+    {
+    h.ip=brokerIp;
+    h.ipSeconds=clockSeconds();
+    return true;
+    }
+  return false;
+  }
+
+// A backup broker is a host name or address, with ":port" if it isn't on the main broker's port.
+// The host has to fit where brokerAddress() puts it and pass the same check as the main broker.
+parseResult checkBrokerEntry(textView entry)
+  {
+  const char* colon=(const char*)memchr(entry.text,':',entry.length);
+  size_t hostLength=colon?(size_t)(colon-entry.text):entry.length;
+  if (hostLength>=ADDRESS_SIZE)
+    return PARSE_VALUE_TOO_LONG;
+  char host[ADDRESS_SIZE];
+  memcpy(host,entry.text,hostLength);
+  host[hostLength]='\0';
+  if (!checkString(host))
+    return PARSE_BAD_HOST;
+  if (!colon)
+    return PARSE_OK;
+  uint32_t port;
+  return viewToUnsigned({colon+1,entry.length-hostLength-1},1,65535,port);
+  }
+
+// A stored backup broker entry
+bool checkBackupBroker(const char* entry)
+  {
+  return checkBrokerEntry({entry,strlen(entry)})==PARSE_OK;
+  }
+
+// Broker n's host and port: 0 is broker and port, 1 and up are the backups. False if it isn't set.
+bool brokerAddress(uint8_t n, char* host, size_t size, uint16_t& port)
+  {
+  if (n==0)
+    {
+    snprintf(host,size,"%s",settings.mqttBrokerAddress);
+    port=settings.mqttBrokerPort;
+    }
+  else
+    {
+    const char* entry=settings.backupBrokers[n-1];
+    const char* colon=strchr(entry,':');
+    snprintf(host,size,"%.*s",colon?(int)(colon-entry):(int)strlen(entry),entry);
+    port=colon?atoi(colon+1):settings.mqttBrokerPort;
+    }
+  return host[0]!='\0';
+  }
+
+/*
+ * Pick the broker to try. One that failed is left alone for a while, twice as
+ * long each time it fails again, so a dead broker doesn't cost every wake a
+ * connection timeout. Of the rest, the one with the quickest recent connections
+ * wins, but the one in use is kept unless another is clearly quicker. A broker
+ * that has never connected counts as slow, so backups are only tried when the
+ * known good ones are down. If they are all being left alone, the one whose
+ * wait ends soonest is tried anyway. Returns -1 if no broker is set.
+ */
+int8_t chooseBroker()
+  {
+  int8_t best=-1;
+  uint32_t bestScore=UINT32_MAX;
+  int8_t soonest=-1;
+  uint32_t soonestWait=UINT32_MAX;
+  uint32_t now=clockSeconds();
+  char host[ADDRESS_SIZE];
+  uint16_t port;
+  for (uint8_t n=0;n<MAX_BROKERS;n++)
+    {
+    if (!brokerAddress(n,host,sizeof(host),port))
+      continue;
+    brokerHealth& h=rtc.brokers[n];
+    uint32_t backoff=h.failures==0?0:BROKER_BACKOFF_SECONDS<<min(h.failures-1,BROKER_BACKOFF_MAX_SHIFT);
+    uint32_t since=now-h.failSeconds;
+    if (since<backoff)
+      {
+      if (backoff-since<soonestWait)
+        {
+        soonestWait=backoff-since;
+        soonest=n;
+        }
+      continue;
+      }
+    uint32_t score=h.connectMs?h.connectMs:BROKER_UNMEASURED_MS;
+    if (n==rtc.currentBroker)
+      score=score*BROKER_SWITCH_PERCENT/100;
+    if (score<bestScore)
+      {
+      bestScore=score;
+      best=n;
+      }
+    }
+  return best>=0?best:soonest;
+  }
+
+/*
+ * Choose a broker and look up its address, leaving its host in brokerHost and
+ * its port in brokerPort. Returns false if no broker is set. resolved is false
+ * if DNS couldn't find it, and the client will have to try the name itself.
+ */
+bool selectBroker(IPAddress& ip, bool& resolved)
+  {
+  brokerIndex=chooseBroker();
+  if (brokerIndex<0)
+    return false;
+  brokerAddress(brokerIndex,brokerHost,sizeof(brokerHost),brokerPort);
+  resolved=resolveBroker(brokerIndex,brokerHost,ip);
+  if (settings.debug)
+    Serial.printf("Using broker %d, %s:%u\n",brokerIndex+1,brokerHost,brokerPort);
+  return true;
+  }
+
+// Note how long a broker took to connect, with the recent connections counting the most
+void brokerConnected(uint8_t n, uint32_t ms)
+  {
+  brokerHealth& h=rtc.brokers[n];
+  ms=min(ms,(uint32_t)UINT16_MAX);
+  h.connectMs=h.connectMs==0?ms:(h.connectMs*3+ms)/4;
+  h.failures=0;
+  rtc.currentBroker=n;
+  }
+
+void brokerFailed(uint8_t n)
+  {
+  brokerHealth& h=rtc.brokers[n];
+  if (h.failures<UINT8_MAX)
+    h.failures++;
+  h.failSeconds=clockSeconds();
+  h.ip=0; //look it up again in case it moved
+  }
+
+// Print how each broker has been doing
+void showBrokerHealth()
+  {
+  char host[ADDRESS_SIZE];
+  uint16_t port;
+  for (uint8_t n=0;n<MAX_BROKERS;n++)
+    {
+    if (brokerAddress(n,host,sizeof(host),port))
+      Serial.printf("Broker %d %s:%u: %ums to connect, %u failures in a row%s\n",
+                    n+1,host,port,rtc.brokers[n].connectMs,rtc.brokers[n].failures,
+                    n==rtc.currentBroker?" (current)":"");
+    }
+  }
+
+/*
+ * If not connected to wifi, start connecting and return right away, so the rest
+ * of waking up can be done while the access point and DHCP answer. serviceWiFi()
+ * finishes the job. If there is a cached lease and channel from the last wake,
+ * try those first since it's much faster than DHCP and scanning for the access
+ * point. If that doesn't work, do it the usual way.
+ */
+void startWiFi()
+  {
+  if (settingsAreValid && WiFi.status() != WL_CONNECTED && !apModeActive && !wifiConnecting)
+    {
+    Serial.print("Attempting to connect to WPA SSID \"");
+    Serial.print(settings.ssid);
+    Serial.println("\"");
+
+    WiFi.disconnect(true); // Completely reset Wi-Fi stack
+    delay(100); // Small delay to ensure reset is applied
+    WiFi.persistent(false); // Prevent saving to flash
+    WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
+
+    // Associating and getting an address have separate budgets, so tell them apart
+    static WiFiEventHandler associated=WiFi.onStationModeConnected([](const WiFiEventStationModeConnected&)
+      {
+      enterPhase(PHASE_DHCP);
+      });
+    enterPhase(PHASE_WIFI);
+    wifiStartMs=millis();
+    wifiCachedLease=configureAddress();
+    wifiFastPath=rtc.net.channel!=0;
+    if (wifiFastPath)
+      WiFi.begin(settings.ssid, settings.wifiPassword, rtc.net.channel, rtc.net.bssid);
+    else
+      WiFi.begin(settings.ssid, settings.wifiPassword);
+    wifiConnecting=true;
+    }
+  }
+
+/*
+ * Move a connection started by startWiFi() along. Once it is up, cache the
+ * details and get the first report going. If it takes too long, open AP mode.
+ * Returns true while still connecting.
+ */
+bool serviceWiFi()
+  {
+  if (!wifiConnecting)
+    return false;
+
+  if (WiFi.status() == WL_CONNECTED)
+    {
+    wifiConnecting=false;
+    Serial.print("\nConnected to network with address ");
+    Serial.print(WiFi.localIP());
+    Serial.printf(" in %lu ms\n",millis()-wifiStartMs);
+    Serial.println();
+    cacheConnection();
+    rtc.wifiFailures=0;
+    enterPhase(PHASE_BROKER);
+    if (settings.slotted)
+      {
+      configTime(0,0,settings.timeServer); //answers in the background while the report goes out
+      sntpStartMs=millis();
+      }
+    startMdns();
+#ifdef ESPNOW_GATEWAY
+    startEspNowGateway();
+#endif
+    if (!wakeReported)
+      scheduleNow(tasks[TASK_REPORT]); //everything else is ready, so this is all it was waiting for
+    return false;
+    }
+
+  if (wifiFastPath && millis()-wifiStartMs > WIFI_FAST_TIMEOUT_SECONDS*1000) //the cached details didn't work, start over without them
+    {
+    Serial.print("\nCached connection details failed, trying again");
+    clearNetworkCache();
+    wifiFastPath=false;
+    WiFi.disconnect();
+    if (wifiCachedLease)
+      {
+      WiFi.config(IPAddress(0,0,0,0),IPAddress(0,0,0,0),IPAddress(0,0,0,0)); //back to DHCP
+      wifiCachedLease=false;
+      }
+    WiFi.begin(settings.ssid, settings.wifiPassword);
+    }
+
+  if (millis()-wifiStartMs > WIFI_TIMEOUT_SECONDS*1000)
+    {
+    if (unattendedWake()) //without a budget, or one longer than this
+      {
+      giveUpOnWake(); //only opens AP mode after enough of these
+      return false;
+      }
+    wifiConnecting=false;
+    Serial.println("\nConnection to network failed. Opening AP mode.");
+    rtc.rfCalNeeded=true; //in case a stale calibration had something to do with it
+    clearNetworkCache();
+    startAPMode();  //fire up our own network
+    startMdns();
+    return false;
+    }
+
+  if (millis() - wifiDotMs > 500) // Print dot every 500ms, but don't block
+    {
+    Serial.print(".");
+    wifiDotMs = millis();
+    }
+  return true;
+  }
+
+// Connect and wait for it, for the places that can't do anything without the network
+void connectToWiFi()
+  {
+  startWiFi();
+  while (serviceWiFi())
+    {
+    checkForCommand(); // Check for input in case something needs to be changed to work
+    checkAwakeBudget();
+    yield();
+    }
+  }
+
+// Connect, and start the web server and mDNS, when the network wasn't started at boot
+void initServer()
+  {
+  connectToWiFi(); //will either connect to wifo or set up AP mode
+  server.begin();
+  }
+
+// Once there is a network, our own or the access point's, answer to the mDNS name
+void startMdns()
+  {
+  static bool started=false;
+  if (started)
+    return;
+  started=true;
+
+  Serial.print("Setting MDNS name to ");
+  Serial.print(settings.mdnsName);
+  Serial.println(".local");
+
+  if (!MDNS.begin(settings.mdnsName)) // Always check return value!
+    {
+    Serial.println("Error setting up MDNS responder!");
+    }
+    else
+    {
+    Serial.println("mDNS responder started successfully.");
+    MDNS.addService("http", "tcp", 80); // Add service after mDNS is running
+    Serial.println("HTTP service added to mDNS.");
+    }  
+  }
+
+void notFound(AsyncWebServerRequest *request) 
+  {
+  request->send(404, "text/plain", "Not found");
+  }
+
+void setup()
+  {
+  initSerial();
+  
+  initSettings();
+  loadRtcState();
+
+  if (settingsAreValid)
+    {
+    reconfigSerial(); //settings are valid, reconfigure the serial port if necessary
+    initPorts();  // Initialize the I/O ports based on settings
+    }
+  latchWakeState(); //before anything slow, so the switch that woke us is still where it was
+  if (rtc.sleepRemaining>0)
+    {
+    if (strcmp(wakeCause,WAKE_CAUSE_TIMER)==0)
+      continueSleep();
+    rtc.sleepRemaining=0; //a change, reset or power up ends a chained sleep early
+    }
+  if (strcmp(wakeCause,WAKE_CAUSE_TIMER)!=0)
+    rtc.clockBaseMs=0; //the sleep was cut short, so how long it really lasted isn't known
+  budgetActive=settings.awakeBudget>0 && unattendedWake();
+  if (rtc.wakeFailures>0)
+    Serial.printf("The last %u wakes gave up %s\n",rtc.wakeFailures,phaseNames[min(rtc.failedPhase,(uint8_t)(PHASE_COUNT-1))]);
+
+  // Power up always calibrates the radio, and so does a wake we asked to
+  if (ESP.getResetInfoPtr()->reason!=REASON_DEEP_SLEEP_AWAKE || rtc.nextWakeRf==WAKE_RFCAL)
+    {
+    rtc.lastRfCalSeconds=clockSeconds();
+    rtc.rfCalNeeded=false;
+    }
+
+  if (settingsAreValid && settings.samplesPerReport>1)
+    {
+    takeSample(bootSnapshot.levels);
+    if (strcmp(wakeCause,WAKE_CAUSE_TIMER)==0 && rtc.summary.count<settings.samplesPerReport)
+      {
+      // Just a sample this time. Only turn the radio on for the wake that will report.
+      bool reportNext=rtc.summary.count+1>=settings.samplesPerReport;
+      if (settings.debug)
+        Serial.printf("Sample %u of %u taken\n",rtc.summary.count,settings.samplesPerReport);
+      goToSleep(slottedSleepMicros(sampleIntervalSeconds()),nextWakeRfMode(reportNext));
+      }
+    }
+
+  if (rtc.nextWakeRf==WAKE_RF_DISABLED && ESP.getResetInfoPtr()->reason==REASON_DEEP_SLEEP_AWAKE)
+    {
+    // The radio is off on this wake but something needs reporting. It can only be
+    // turned back on by a reset, so sleep just long enough to reboot with it on.
+    if (strcmp(wakeCause,WAKE_CAUSE_CHANGE)==0)
+      {
+      rtc.changePending=true;
+      rtc.pendingGpio=wakeGpio;
+      }
+    goToSleep(RADIO_RESTART_MICROS,nextWakeRfMode(true));
+    }
+
+  // The radio is the slow part of waking, so get it going first. Association and
+  // DHCP go on in the background while the file system and web server are set up,
+  // and serviceWiFi() starts the report the moment the network is up.
+  initNetworkSettings(); //before connecting, so a static address is actually used
+  if (!useEspNow() || !startEspNow()) //ESP-NOW doesn't need the network
+    startWiFi();
+  rtc.espNowFailed=false; //only the one wake after the gateway didn't answer uses WiFi
+
+  initFS();
+ 
+  if (!settingsAreValid) //we need more settings, allow it via the web page
+    {
+    startAPMode();
+    startMdns();
+    }
+
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) 
+    {
+    AUDIT_SUBSYSTEM(SUBSYSTEM_WEB);
+    PROFILE(PROFILE_WEB);
+    
+    // if (settings.debug) //prove that the request and file are ok
+    //   {
+    //   Serial.println("Got request for index page.");
+
+    //   File file = LittleFS.open("index.html", "r"); // Open the file for reading
+    //   if (file)
+    //     {
+    //     // Read and print each character until the end of the file
+    //     while (file.available())
+    //       {
+    //       Serial.write(file.read()); // Use Serial.write for raw bytes, good for large files
+    //       }
+    //     file.close(); 
+    //     }
+    //   else
+    //     {
+    //     Serial.println("Can't open file.");
+    //     }
+    //   }
+    Serial.println("*********** Got web request ****************");
+    request->send(LittleFS, "/index.html", "text/html", false, processor);
+    keepAwake=millis()+STAY_AWAKE_INCREMENT; //stay awake a little longer for more web changes
+    noteActivity();
+    });
+
+  server.on("/save", HTTP_POST, [](AsyncWebServerRequest *request) 
+    {
+    AUDIT_SUBSYSTEM(SUBSYSTEM_WEB);
+    PROFILE(PROFILE_WEB);
+    // if (settings.debug)
+    //   {
+    //   int params = request->params(); // total number of parameters in this request
+    //   for (int i = 0; i < params; i++)
+    //     {
+    //     AsyncWebParameter* p = request->getParam(i);
+    //     Serial.printf("Form Data - Name: '%s', Value: '%s'\n", p->name().c_str(), p->value().c_str());
+    //     }
+    //   }
+    Serial.println("******************** Saving form **********************");
+    bool changed=false; //starts out with nothing changed
+
+    if (request->hasParam("ssid", true))
+      {
+      const char* val = request->getParam("ssid", true)->value().c_str();
+      if (strcmp(val, settings.ssid) != 0)  
+        {
+        snprintf(settings.ssid,sizeof(settings.ssid),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("wifipass", true))
+      {
+      const char* val = request->getParam("wifipass", true)->value().c_str();
+      if (strcmp(val, settings.wifiPassword) != 0)  
+        {
+        snprintf(settings.wifiPassword,sizeof(settings.wifiPassword),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("address", true))
+      {
+      const char* val = request->getParam("address", true)->value().c_str();
+      if (strcmp(val, settings.address) != 0)  
+        {
+        snprintf(settings.address,sizeof(settings.address),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("netmask", true))
+      {
+      const char* val = request->getParam("netmask", true)->value().c_str();
+      if (strcmp(val, settings.netmask) != 0)  
+        {
+        snprintf(settings.netmask,sizeof(settings.netmask),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("gateway", true))
+      {
+      const char* val = request->getParam("gateway", true)->value().c_str();
+      if (strcmp(val, settings.gateway) != 0)  
+        {
+        snprintf(settings.gateway,sizeof(settings.gateway),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("dns", true))
+      {
+      const char* val = request->getParam("dns", true)->value().c_str();
+      if (strcmp(val, settings.dns) != 0)  
+        {
+        snprintf(settings.dns,sizeof(settings.dns),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("cachettl", true))
+      {
+      uint32_t val = strtoul(request->getParam("cachettl", true)->value().c_str(),NULL,10);
+      if (val != settings.cacheTtl)  
+        {
+        settings.cacheTtl=val;
+        changed=true;
+        }
+      }
+    if (request->hasParam("broker", true))
+      {
+      const char* val = request->getParam("broker", true)->value().c_str();
+      if (strcmp(val, settings.mqttBrokerAddress) != 0)  
+        {
+        snprintf(settings.mqttBrokerAddress,sizeof(settings.mqttBrokerAddress),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("port", true))
+      {
+      int val = atoi(request->getParam("port", true)->value().c_str());
+      if (val != settings.mqttBrokerPort)  
+        {
+        settings.mqttBrokerPort=val;
+        changed=true;
+        }
+      }
+    for (uint8_t i=0;i<BACKUP_BROKER_COUNT;i++)
+      {
+      char name[10];
+      sprintf(name,"broker%d",i+2);
+      if (request->hasParam(name, true))
+        {
+        const char* val = request->getParam(name, true)->value().c_str();
+        if (strcmp(val, settings.backupBrokers[i]) != 0
+            && checkBrokerEntry({val,strlen(val)})==PARSE_OK)
+          {
+          snprintf(settings.backupBrokers[i],sizeof(settings.backupBrokers[i]),"%s",val);
+          changed=true;
+          }
+        }
+      }
+    if (request->hasParam("topicroot", true))
+      {
+      const String& vals = request->getParam("topicroot", true)->value();
+      char val[MQTT_TOPIC_SIZE];
+      snprintf(val,sizeof(val)-1,"%s",vals.c_str()); //leave room for the slash
+      if (!vals.endsWith("/"))  //enforce last slash rule
+        strcat(val,"/");
+
+      if (strcmp(val, settings.mqttTopicRoot) != 0)  
+        {
+        strcpy(settings.mqttTopicRoot,val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("user", true))
+      {
+      const char* val = request->getParam("user", true)->value().c_str();
+      if (strcmp(val, settings.mqttUsername) != 0)  
+        {
+        snprintf(settings.mqttUsername,sizeof(settings.mqttUsername),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("pass", true))
+      {
+      const char* val = request->getParam("pass", true)->value().c_str();
+      if (strcmp(val, settings.mqttPassword) != 0)  
+        {
+        snprintf(settings.mqttPassword,sizeof(settings.mqttPassword),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("mdnsname", true))
+      {
+      const char* val = request->getParam("mdnsname", true)->value().c_str();
+      if (strcmp(val, settings.mdnsName) != 0)  
+        {
+        snprintf(settings.mdnsName,sizeof(settings.mdnsName),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("debug", true)) //Maybe not - debug doesn't show up if not checked.
+      {
+      bool bval=(strcmp(request->getParam("debug", true)->value().c_str(), "1") == 0);
+      if (bval != settings.debug)  
+        {
+        settings.debug=bval;
+        changed=true;
+        }
+      }
+    else if (settings.debug) //special case - checkbox not sent if not checked. Always true or false though.
+      {
+      settings.debug=false;
+      changed=true;
+      }
+
+    if (request->hasParam("reportinterval", true))
+      {
+      ulong val = (ulong)atol(request->getParam("reportinterval", true)->value().c_str());
+      if (val != settings.reportInterval)  
+        {
+        settings.reportInterval=val;
+        changed=true;
+        }
+      }
+
+    if (request->hasParam("lightsleep", true))
+      {
+      if (!settings.lightSleep)
+        {
+        settings.lightSleep=true;
+        changed=true;
+        }
+      }
+    else if (settings.lightSleep) //checkbox not sent if not checked
+      {
+      settings.lightSleep=false;
+      changed=true;
+      }
+
+    if (request->hasParam("binaryreport", true))
+      {
+      if (!settings.binaryReport)
+        {
+        settings.binaryReport=true;
+        changed=true;
+        }
+      }
+    else if (settings.binaryReport) //checkbox not sent if not checked
+      {
+      settings.binaryReport=false;
+      changed=true;
+      }
+
+    if (request->hasParam("mqttasync", true))
+      {
+      if (!settings.asyncMqtt)
+        {
+        settings.asyncMqtt=true;
+        changed=true;
+        }
+      }
+    else if (settings.asyncMqtt)
+      {
+      settings.asyncMqtt=false;
+      changed=true;
+      }
 
-  initServer();
+    if (request->hasParam("persistentsession", true))
+      {
+      if (!settings.persistentSession)
+        {
+        settings.persistentSession=true;
+        changed=true;
+        }
+      }
+    else if (settings.persistentSession)
+      {
+      settings.persistentSession=false;
+      changed=true;
+      }
 
-  if (settingsAreValid)
-    {      
-    reconfigSerial(); //settings are valid, reconfigure the serial port if necessary
-    initPorts();  // Initialize the I/O ports based on settings
+    if (request->hasParam("mqtt5", true))
+      {
+      if (!settings.mqtt5)
+        {
+        settings.mqtt5=true;
+        changed=true;
+        }
+      }
+    else if (settings.mqtt5)
+      {
+      settings.mqtt5=false;
+      changed=true;
+      }
 
-    if (settings.debug)
+    if (request->hasParam("mqtttls", true))
       {
-      if (!ip.fromString(settings.address)&& !apModeActive)
+      if (!settings.mqttTls)
         {
-        Serial.println("Static IP Address '"+String(settings.address)+"' is blank or not valid. Using dynamic addressing.");
-        // settingsAreValid=false;
-        // settings.validConfig=false;
+        settings.mqttTls=true;
+        changed=true;
         }
-      else if (!mask.fromString(settings.netmask)&& !apModeActive)
+      }
+    else if (settings.mqttTls)
+      {
+      settings.mqttTls=false;
+      changed=true;
+      }
+    if (request->hasParam("tlsfingerprint", true))
+      {
+      const char* val = request->getParam("tlsfingerprint", true)->value().c_str();
+      uint8_t fingerprint[FINGERPRINT_BYTES];
+      if (strcmp(val, settings.tlsFingerprint) != 0
+          && (strlen(val)==0 || viewToFingerprint({val,strlen(val)},fingerprint)))
         {
-        Serial.println("Static network mask "+String(settings.netmask)+" is not valid.");
-        // settingsAreValid=false;
-        // settings.validConfig=false;
+        snprintf(settings.tlsFingerprint,sizeof(settings.tlsFingerprint),"%s",val);
+        changed=true;
         }
       }
-    }
-
-  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) 
-    {
-    
-    // if (settings.debug) //prove that the request and file are ok
-    //   {
-    //   Serial.println("Got request for index page.");
 
-    //   File file = LittleFS.open("index.html", "r"); // Open the file for reading
-    //   if (file)
-    //     {
-    //     // Read and print each character until the end of the file
-    //     while (file.available())
-    //       {
-    //       Serial.write(file.read()); // Use Serial.write for raw bytes, good for large files
-    //       }
-    //     file.close(); 
-    //     }
-    //   else
-    //     {
-    //     Serial.println("Can't open file.");
-    //     }
-    //   }
-    Serial.println("*********** Got web request ****************");
-    request->send(LittleFS, "/index.html", "text/html", false, processor);
-    keepAwake=millis()+STAY_AWAKE_INCREMENT; //stay awake a little longer for more web changes
-    });
+    if (request->hasParam("espnow", true))
+      {
+      if (!settings.espNow)
+        {
+        settings.espNow=true;
+        changed=true;
+        }
+      }
+    else if (settings.espNow)
+      {
+      settings.espNow=false;
+      changed=true;
+      }
+    if (request->hasParam("espnowgateway", true))
+      {
+      const char* val = request->getParam("espnowgateway", true)->value().c_str();
+      uint8_t mac[MAC_BYTES];
+      if (strcmp(val, settings.espNowGateway) != 0
+          && (strlen(val)==0 || viewToMac({val,strlen(val)},mac)))
+        {
+        snprintf(settings.espNowGateway,sizeof(settings.espNowGateway),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("espnowchannel", true))
+      {
+      uint8_t val = constrain(atoi(request->getParam("espnowchannel", true)->value().c_str()),0,ESPNOW_MAX_CHANNEL);
+      if (val != settings.espNowChannel)  
+        {
+        settings.espNowChannel=val;
+        changed=true;
+        }
+      }
+    if (request->hasParam("espnowkey", true))
+      {
+      const char* val = request->getParam("espnowkey", true)->value().c_str();
+      uint8_t key[ESPNOW_KEY_BYTES];
+      if (strcmp(val, settings.espNowKey) != 0
+          && (strlen(val)==0 || viewToKey({val,strlen(val)},key)))
+        {
+        snprintf(settings.espNowKey,sizeof(settings.espNowKey),"%s",val);
+        changed=true;
+        }
+      }
 
-  server.on("/save", HTTP_POST, [](AsyncWebServerRequest *request) 
-    {
-    // if (settings.debug)
-    //   {
-    //   int params = request->params(); // total number of parameters in this request
-    //   for (int i = 0; i < params; i++)
-    //     {
-    //     AsyncWebParameter* p = request->getParam(i);
-    //     Serial.printf("Form Data - Name: '%s', Value: '%s'\n", p->name().c_str(), p->value().c_str());
-    //     }
-    //   }
-    Serial.println("******************** Saving form **********************");
-    bool changed=false; //starts out with nothing changed
+    if (request->hasParam("changeonly", true))
+      {
+      if (!settings.changeOnly)
+        {
+        settings.changeOnly=true;
+        changed=true;
+        }
+      }
+    else if (settings.changeOnly) //checkbox not sent if not checked
+      {
+      settings.changeOnly=false;
+      changed=true;
+      }
 
-    if (request->hasParam("ssid", true))
+    if (request->hasParam("fullsync", true))
       {
-      const char* val = request->getParam("ssid", true)->value().c_str();
-      if (strcmp(val, settings.ssid) != 0)  
+      uint16_t val = atoi(request->getParam("fullsync", true)->value().c_str());
+      if (val != settings.fullSyncInterval)  
         {
-        snprintf(settings.ssid,sizeof(settings.ssid),"%s",val);
+        settings.fullSyncInterval=val;
         changed=true;
         }
       }
-    if (request->hasParam("wifipass", true))
+    if (request->hasParam("rssideadband", true))
       {
-      const char* val = request->getParam("wifipass", true)->value().c_str();
-      if (strcmp(val, settings.wifiPassword) != 0)  
+      uint8_t val = atoi(request->getParam("rssideadband", true)->value().c_str());
+      if (val != settings.rssiDeadband)  
         {
-        snprintf(settings.wifiPassword,sizeof(settings.wifiPassword),"%s",val);
+        settings.rssiDeadband=val;
         changed=true;
         }
       }
-    if (request->hasParam("address", true))
+    if (request->hasParam("vccdeadband", true))
       {
-      const char* val = request->getParam("address", true)->value().c_str();
-      if (strcmp(val, settings.address) != 0)  
+      uint16_t val = atoi(request->getParam("vccdeadband", true)->value().c_str());
+      if (val != settings.vccDeadband)  
         {
-        snprintf(settings.address,sizeof(settings.address),"%s",val);
+        settings.vccDeadband=val;
         changed=true;
         }
       }
-    if (request->hasParam("netmask", true))
+    if (request->hasParam("heapdeadband", true))
       {
-      const char* val = request->getParam("netmask", true)->value().c_str();
-      if (strcmp(val, settings.netmask) != 0)  
+      uint16_t val = atoi(request->getParam("heapdeadband", true)->value().c_str());
+      if (val != settings.heapDeadband)  
         {
-        snprintf(settings.netmask,sizeof(settings.netmask),"%s",val);
+        settings.heapDeadband=val;
         changed=true;
         }
       }
-    if (request->hasParam("broker", true))
+    if (request->hasParam("wakeport", true))
       {
-      const char* val = request->getParam("broker", true)->value().c_str();
-      if (strcmp(val, settings.mqttBrokerAddress) != 0)  
+      const char* val = request->getParam("wakeport", true)->value().c_str();
+      int8_t port = NO_WAKE_PORT;
+      if (strlen(val)>0 && portIndex(atoi(val))>=0)
+        port = atoi(val);
+      if (port != settings.wakePort)  
         {
-        snprintf(settings.mqttBrokerAddress,sizeof(settings.mqttBrokerAddress),"%s",val);
+        settings.wakePort=port;
         changed=true;
         }
       }
-    if (request->hasParam("port", true))
+    if (request->hasParam("samples", true))
       {
-      int val = atoi(request->getParam("port", true)->value().c_str());
-      if (val != settings.mqttBrokerPort)  
+      uint8_t val = constrain(atoi(request->getParam("samples", true)->value().c_str()),1,MAX_SAMPLES_PER_REPORT);
+      if (val != settings.samplesPerReport)  
         {
-        settings.mqttBrokerPort=val;
+        settings.samplesPerReport=val;
         changed=true;
         }
       }
-    if (request->hasParam("topicroot", true))
+    if (request->hasParam("rfcalinterval", true))
       {
-      String vals = request->getParam("topicroot", true)->value();
-      if (!vals.endsWith("/"))  //enforce last slash rule
-        vals+="/";
-      const char* val = vals.c_str();
-
-      if (strcmp(val, settings.mqttTopicRoot) != 0)  
+      uint32_t val = strtoul(request->getParam("rfcalinterval", true)->value().c_str(),NULL,10);
+      if (val != settings.rfCalInterval)  
         {
-        snprintf(settings.mqttTopicRoot,sizeof(settings.mqttTopicRoot),"%s",val);
+        settings.rfCalInterval=val;
         changed=true;
         }
       }
-    if (request->hasParam("user", true))
+    if (request->hasParam("awakebudget", true))
       {
-      const char* val = request->getParam("user", true)->value().c_str();
-      if (strcmp(val, settings.mqttUsername) != 0)  
+      uint16_t val = constrain(atoi(request->getParam("awakebudget", true)->value().c_str()),0,MAX_AWAKE_BUDGET);
+      if (val != settings.awakeBudget)  
         {
-        snprintf(settings.mqttUsername,sizeof(settings.mqttUsername),"%s",val);
+        settings.awakeBudget=val;
         changed=true;
         }
       }
-    if (request->hasParam("pass", true))
+    if (request->hasParam("apafterfailures", true))
       {
-      const char* val = request->getParam("pass", true)->value().c_str();
-      if (strcmp(val, settings.mqttPassword) != 0)  
+      uint8_t val = constrain(atoi(request->getParam("apafterfailures", true)->value().c_str()),0,UINT8_MAX);
+      if (val != settings.apAfterFailures)  
         {
-        snprintf(settings.mqttPassword,sizeof(settings.mqttPassword),"%s",val);
+        settings.apAfterFailures=val;
         changed=true;
         }
       }
-    if (request->hasParam("mdnsname", true))
+    if (request->hasParam("maxsleep", true))
       {
-      const char* val = request->getParam("mdnsname", true)->value().c_str();
-      if (strcmp(val, settings.mdnsName) != 0)  
+      uint32_t val = strtoul(request->getParam("maxsleep", true)->value().c_str(),NULL,10);
+      if (val!=0)
+        val=max(val,(uint32_t)MIN_MAX_SLEEP);
+      if (val != settings.maxSleep)  
         {
-        snprintf(settings.mdnsName,sizeof(settings.mdnsName),"%s",val);
+        settings.maxSleep=val;
         changed=true;
         }
       }
-    if (request->hasParam("debug", true)) //Maybe not - debug doesn't show up if not checked.
+    if (request->hasParam("slotted", true))
       {
-      String val = request->getParam("debug", true)->value();
-      bool bval=(strcmp(val.c_str(), "1") == 0);
-      if (bval != settings.debug)  
+      if (!settings.slotted)
         {
-        settings.debug=bval;
+        settings.slotted=true;
         changed=true;
         }
       }
-    else if (settings.debug) //special case - checkbox not sent if not checked. Always true or false though.
+    else if (settings.slotted)
       {
-      settings.debug=false;
+      settings.slotted=false;
       changed=true;
       }
-
-    if (request->hasParam("reportinterval", true))
+    if (request->hasParam("timeserver", true))
       {
-      ulong val = (ulong)atol(request->getParam("reportinterval", true)->value().c_str());
-      if (val != settings.reportInterval)  
+      const char* val = request->getParam("timeserver", true)->value().c_str();
+      if (strcmp(val, settings.timeServer) != 0)
         {
-        settings.reportInterval=val;
+        snprintf(settings.timeServer,sizeof(settings.timeServer),"%s",val);
+        changed=true;
+        }
+      }
+    if (request->hasParam("fragdeadband", true))
+      {
+      uint8_t val = atoi(request->getParam("fragdeadband", true)->value().c_str());
+      if (val != settings.fragDeadband)  
+        {
+        settings.fragDeadband=val;
         changed=true;
         }
       }
@@ -1858,77 +4501,227 @@ void setup()
     if (changed)
       {
       saveSettings();
-      webMessage="Settings saved";
+      strcpy(webMessage,"Settings saved");
       }
 
     keepAwake=millis()+STAY_AWAKE_INCREMENT; //stay awake a little longer for more web changes
+    noteActivity();
     request->redirect("/");  // Go back to main page
     });
   
+  server.on("/api/memstats", HTTP_GET, [](AsyncWebServerRequest *request) 
+    {
+    size_t mark=arenaMark(requestArena);
+    char* stats=(char*)arenaAlloc(requestArena,MEMSTATS_SIZE);
+    if (stats)
+      {
+      memStatsJson(stats,MEMSTATS_SIZE);
+      request->send(200,"application/json",stats);
+      }
+    else
+      request->send(503,"text/plain","No room for memstats");
+    arenaRelease(requestArena,mark);
+    });
+
+  server.on("/api/latency", HTTP_GET, [](AsyncWebServerRequest *request) 
+    {
+    size_t mark=arenaMark(requestArena);
+    char* stats=(char*)arenaAlloc(requestArena,LATENCY_JSON_SIZE);
+    if (stats)
+      {
+      latencyJson(stats,LATENCY_JSON_SIZE);
+      request->send(200,"application/json",stats);
+      }
+    else
+      request->send(503,"text/plain","No room for latency");
+    arenaRelease(requestArena,mark);
+    });
+
   server.onNotFound(notFound);
 
   server.begin();  
   }
 
-void loop()
+/*
+ * These are the things loop() does while awake, each run by the scheduler as a task.
+ */
+
+// Keep the WiFi and broker connections up and handle incoming MQTT messages
+void networkTask()
   {
-  if (settings.debug)
-    {
-    static unsigned long lastLoopTime = 0;
-    unsigned long now = millis();
-    unsigned long duration = now - lastLoopTime;
-    lastLoopTime = now;
-    if (duration > 5)
-      Serial.printf("loop() gap: %lu ms\n", duration);
-    }
-  
-  
-  yield();
-  if (settingsAreValid)
+  AUDIT_SUBSYSTEM(SUBSYSTEM_NETWORK);
+  if (settingsAreValid && !espNowActive)
     {      
     if (WiFi.status() != WL_CONNECTED && !apModeActive)
       {
-      yield();
-      connectToWiFi();
+      startWiFi(); //doesn't wait, so the web server and serial port keep going while it connects
+      serviceWiFi();
       }
-    if (!mqttClient.connected() && WiFi.status() == WL_CONNECTED)
+    if (usingAsyncMqtt())
       {
-      yield();
-      reconnectToBroker();
-      yield();
-      mqttClient.loop();
-      }  
-    else 
+      if (mqttClient.connected()) //the transport was just changed, don't use the client id twice
+        mqttClient.disconnect();
+      serviceAsyncMqtt();
+      }
+    else
+      {
+      if (mqttAsync.connected() || mqttAsync.connecting())
+        mqttAsync.disconnect();
+      if (!mqttClient.connected() && WiFi.status() == WL_CONNECTED)
+        reconnectToBroker();
+      PROFILE(PROFILE_MQTT); //times the rest of this block
       mqttClient.loop();
+      }
+    if (restartPending) //a command asked for it, and the PUBACK has gone out with loop()
+      restartAfterCommand();
     }
-  
-  yield();
+  }
+
+void mdnsTask()
+  {
+  PROFILE(PROFILE_MDNS);
   MDNS.update();
-  yield();
-    
+  }
+
+bool serialReady()
+  {
+  return Serial.available()>0;
+  }
+
+void serialTask()
+  {
   checkForCommand();
-  yield(); //Very important! Web page won't load without these yields.
+  }
+
+void reportTask()
+  {
+  if (settingsAreValid && !apModeActive)
+    {
+    if (espNowActive)
+      {
+      if (report())
+        {
+        wakeSucceeded();
+        scheduleNow(tasks[TASK_SLEEP]); //that's all this wake was for
+        }
+      else
+        stopEspNow(); //doesn't return
+      return;
+      }
+    if (WiFi.status()!=WL_CONNECTED)
+      {
+      tasks[TASK_REPORT].nextRunMs=millis()+REPORT_RETRY_MS; //still connecting, serviceWiFi() will start it
+      return;
+      }
+    if (usingAsyncMqtt() && !mqttAsync.connected())
+      {
+      tasks[TASK_REPORT].nextRunMs=millis()+REPORT_RETRY_MS; //the connection is still being made
+      return;
+      }
+    if (report())
+      wakeSucceeded();
+    }
+  }
+
+// Something happened that should get a quick response, so stay out of light sleep for a while
+void noteActivity()
+  {
+  lastActivity=millis();
+  if (lowPowerIdle)
+    scheduleNow(tasks[TASK_IDLE]);
+  }
 
-  static unsigned long nextReport=0; //first report right away
+/*
+ * While waiting around for configuration changes, let the radio and CPU light
+ * sleep between DTIM beacons. The access point holds on to anything for us until
+ * the next beacon, so web pages and MQTT messages still get through, just a little
+ * slower. A low level on the RX pin wakes it for serial input. After any activity
+ * it goes back to modem sleep for a while so a whole page or command goes quickly.
+ */
+void idleTask()
+  {
+#ifndef ESPNOW_GATEWAY //the receiver has to stay on to hear the nodes
+  bool wanted=settings.lightSleep
+           && settingsAreValid
+           && !apModeActive
+           && WiFi.status()==WL_CONNECTED
+           && millis()-lastActivity>ACTIVE_HOLD_MS;
+  if (wanted==lowPowerIdle)
+    return;
 
-  if (settingsAreValid && millis() >= nextReport && !apModeActive)
+  lowPowerIdle=wanted;
+  if (lowPowerIdle)
     {
-    nextReport=millis()+STAY_AWAKE_MINIMUM_MS;
-    report();
-    yield();
+    if (!(activePortMask & (1<<portIndex(RX_PIN)))) //serial receive is still on
+      wifi_enable_gpio_wakeup(GPIO_ID_PIN(RX_PIN),GPIO_PIN_INTR_LOLEVEL);
+    WiFi.setSleepMode(WIFI_LIGHT_SLEEP,LIGHT_SLEEP_LISTEN_INTERVAL);
+    tasks[TASK_NETWORK].periodMs=LIGHT_SLEEP_NETWORK_TASK_MS;
+    tasks[TASK_MDNS].periodMs=LIGHT_SLEEP_MDNS_TASK_MS;
     }
+  else
+    {
+    wifi_disable_gpio_wakeup(); //so serial receive stops waking a sleep that isn't happening
+    WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+    tasks[TASK_NETWORK].periodMs=NETWORK_TASK_MS;
+    tasks[TASK_MDNS].periodMs=MDNS_TASK_MS;
+    }
+  if (settings.debug)
+    Serial.println(lowPowerIdle?"Idling in light sleep":"Out of light sleep");
+#endif
+  }
 
-  // Give someone a chance to change a setting before sleeping
+// Give someone a chance to change a setting before sleeping
+void sleepTask()
+  {
+#ifndef ESPNOW_GATEWAY //a node could send at any time
+  // Nothing can reach a device that only used ESP-NOW, so there's no point waiting around once it has reported
+  bool waitedEnough=espNowActive
+                  ? wakeReported
+                  : millis() > STAY_AWAKE_MINIMUM_MS && millis()>keepAwake && commandsDrained()
+                    && !wifiConnecting //it either connects and reports, or opens AP mode
+                    && (sntpStartMs==0 || clockSynced() || millis()-sntpStartMs>SNTP_WAIT_MS);
   if (settingsAreValid && 
       settings.reportInterval>0 && 
-      millis() > STAY_AWAKE_MINIMUM_MS &&
-      millis()>keepAwake)
+      waitedEnough)
     {
-    Serial.print("Sleeping for ");
-    Serial.print(settings.reportInterval);
-    Serial.println(" seconds");
-    Serial.flush();
-    ESP.deepSleep(settings.reportInterval*1000000, WAKE_RF_DEFAULT); 
+    if (settings.debug)
+      {
+      printTaskStats(tasks,TASK_COUNT);
+#ifdef HEAP_AUDIT
+      printHeapAudit();
+#endif
+      }
+    sleepUntilNextWake();
+    }
+#endif
+  }
+
+// In priority order. The report task has no deadline yet, so the first report goes out right away.
+task tasks[TASK_COUNT]=
+  {
+  //name       run          ready        period ms              budget us
+  {"network",  networkTask, NULL,        NETWORK_TASK_MS,       NETWORK_TASK_BUDGET_US},
+  {"serial",   serialTask,  serialReady, 0,                     SERIAL_TASK_BUDGET_US},
+  {"mdns",     mdnsTask,    NULL,        MDNS_TASK_MS,          MDNS_TASK_BUDGET_US},
+  {"report",   reportTask,  NULL,        STAY_AWAKE_MINIMUM_MS, REPORT_TASK_BUDGET_US},
+  {"idle",     idleTask,    NULL,        IDLE_TASK_MS,          IDLE_TASK_BUDGET_US},
+  {"sleep",    sleepTask,   NULL,        SLEEP_TASK_MS,         SLEEP_TASK_BUDGET_US},
+#ifdef ESPNOW_GATEWAY
+  {"gateway",  gatewayTask, espNowQueued, 0,                     GATEWAY_TASK_BUDGET_US},
+#endif
+  };
+
+void loop()
+  {
+  checkAwakeBudget();
+  uint32_t start=micros();
+  uint32_t idleMs=runTasks(tasks,TASK_COUNT,lowPowerIdle?LIGHT_SLEEP_MAX_IDLE_MS:MAX_IDLE_MS);
+  recordLatency(PROFILE_LOOP,micros()-start); //only the work, not the idling below
+  if (idleMs>0)
+    {
+    if (lowPowerIdle)
+      Serial.flush(); //don't light sleep in the middle of sending something
+    delay(idleMs); //idles the CPU and lets the WiFi stack and web server run, instead of spinning
     }
   }
 
@@ -1941,36 +4734,3 @@ extern "C" void vApplicationStackOverflowHook(void* xTask, char *pcTaskName)
   Serial.println("***********************************************");
   while (true);  // Halt so you can see the error
   }
-
-/*
-  SerialEvent occurs whenever a new data comes in the hardware serial RX. This
-  routine is run between each time loop() runs, so using delay inside loop can
-  delay response. Multiple bytes of data may be available.
-*/
-void incomingSerialData() 
-  {
-  static bool lastCR = false; 
-    {
-    char inChar = (char)Serial.read(); // get the new byte
-    Serial.print(inChar); //echo it back to the terminal
-
-    // if the incoming character is a newline, set a flag so the main loop can
-    // do something about it 
-    if (inChar == '\n' || inChar == '\r') 
-      {
-      if (lastCR)     //some serial ports send both CR and LF, We want to ignore the second one
-        lastCR=false;
-      else
-        {
-        lastCR=true;
-        commandComplete = true;
-        }
-      }
-    else
-      {
-      lastCR=false; //in case only one of \r and \n is sent
-      // add it to the inputString 
-      commandString += inChar;
-      }
-    }
-  }
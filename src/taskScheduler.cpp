@@ -0,0 +1,75 @@
+#include "taskScheduler.h"
+
+// True if the task's deadline has come. Written so millis() rolling over doesn't matter.
+static bool isDue(task& t, uint32_t now)
+  {
+  return t.periodMs>0 && (int32_t)(now-t.nextRunMs)>=0;
+  }
+
+/*
+ * Run every task that is due or ready, in table order, and keep track of how
+ * long each one takes. Returns the number of milliseconds until the next task
+ * is due, limited to maxIdleMs, or 0 if something is already waiting.
+ */
+uint32_t runTasks(task* tasks, uint8_t count, uint32_t maxIdleMs)
+  {
+  for (uint8_t i=0;i<count;i++)
+    {
+    task& t=tasks[i];
+    uint32_t now=millis();
+    if (isDue(t,now) || (t.ready && t.ready()))
+      {
+      if (t.periodMs>0)
+        t.nextRunMs=now+t.periodMs;
+
+      uint32_t start=micros();
+      t.run();
+      uint32_t elapsed=micros()-start;
+
+      t.runs++;
+      t.totalUs+=elapsed;
+      if (elapsed>t.maxUs)
+        t.maxUs=elapsed;
+      if (t.budgetUs>0 && elapsed>t.budgetUs)
+        t.overruns++;
+      yield(); //let the WiFi stack have a turn between tasks
+      }
+    }
+
+  uint32_t now=millis();
+  uint32_t idleMs=maxIdleMs;
+  for (uint8_t i=0;i<count;i++)
+    {
+    task& t=tasks[i];
+    if (t.ready && t.ready())
+      return 0;
+    if (t.periodMs>0)
+      {
+      if (isDue(t,now))
+        return 0;
+      idleMs=min(idleMs,t.nextRunMs-now);
+      }
+    }
+  return idleMs;
+  }
+
+// Make a task due right away, for when something happens that it should deal with
+void scheduleNow(task& t)
+  {
+  t.nextRunMs=millis();
+  }
+
+void printTaskStats(task* tasks, uint8_t count)
+  {
+  Serial.println("Task        Runs   Overruns  Max(us)  Avg(us)");
+  for (uint8_t i=0;i<count;i++)
+    {
+    task& t=tasks[i];
+    Serial.printf("%-10s %6u %9u %8u %8u\n",
+                  t.name,
+                  t.runs,
+                  t.overruns,
+                  t.maxUs,
+                  t.runs>0?(uint32_t)(t.totalUs/t.runs):0);
+    }
+  }
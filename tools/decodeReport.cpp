@@ -0,0 +1,148 @@
+/* Decode the binary reports published on <topicroot>/bin into JSON, one line each.
+ *
+ * Build on the host from the repository root:
+ *   g++ -std=c++11 -Iinclude -o decodeReport tools/decodeReport.cpp
+ *
+ * Feed it raw payloads on stdin, back to back, for example:
+ *   mosquitto_sub -h broker -t 'mytopicroot/bin' -N | ./decodeReport
+ * or give it payloads as hex on the command line:
+ *   ./decodeReport 0103...
+ *
+ * Fields are read one at a time in little endian order, so it works the same
+ * on any host no matter how it lays out or orders the packed struct.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "binaryReport.h"
+#include "gpioMap.h"
+
+static uint32_t readLittleEndian(const uint8_t* buf, size_t offset, size_t size)
+  {
+  uint32_t value=0;
+  for (size_t i=0;i<size;i++)
+    value|=(uint32_t)buf[offset+i]<<(8*i);
+  return value;
+  }
+
+#define FIELD(buf,name) readLittleEndian(buf,offsetof(binaryReport,name),sizeof(((binaryReport*)0)->name))
+
+static const char* wakeCauseName(uint8_t code)
+  {
+  switch (code)
+    {
+    case WAKE_CODE_TIMER: return "timer";
+    case WAKE_CODE_CHANGE: return "change";
+    case WAKE_CODE_RESET: return "reset";
+    case WAKE_CODE_POWER: return "power";
+    case WAKE_CODE_RESTART: return "restart";
+    }
+  return "unknown";
+  }
+
+// How long a report of this version is, or 0 if it's one we don't know
+static size_t reportSize(uint8_t version)
+  {
+  return version==1?sizeof(binaryReport):0;
+  }
+
+static void printReport(const uint8_t* buf)
+  {
+  uint8_t flags=FIELD(buf,flags);
+  uint16_t activeMask=FIELD(buf,activeMask);
+  uint16_t levels=FIELD(buf,levels);
+
+  printf("{\"version\":%u, \"full\":%s, \"ms\":%u, \"clock\":%u, \"ports\":{",
+         (unsigned)FIELD(buf,version),
+         flags&BINARY_FLAG_FULL?"true":"false",
+         FIELD(buf,snapshotMillis),
+         FIELD(buf,clockSeconds));
+  bool first=true;
+  for (uint8_t i=0;i<GPIO_PORT_COUNT;i++)
+    {
+    if (activeMask&(1<<i))
+      {
+      printf("%s\"%d\":%d",first?"":", ",indexPort(i),(levels>>i)&1);
+      first=false;
+      }
+    }
+  printf("}, \"rssi\":%d, \"battery\":%.2f, \"freeHeap\":%u, \"maxBlockSize\":%u, \"heapFrag\":%u",
+         (int8_t)FIELD(buf,rssi),
+         FIELD(buf,vccMilliVolts)/1000.0,
+         FIELD(buf,freeHeap),
+         FIELD(buf,maxFreeBlockSize),
+         FIELD(buf,heapFragmentation));
+  if (flags&BINARY_FLAG_WAKE)
+    {
+    printf(", \"wakeCause\":\"%s\"",wakeCauseName(FIELD(buf,wakeCause)));
+    if ((int8_t)FIELD(buf,wakeGpio)>=0)
+      printf(", \"wakePort\":%d",(int8_t)FIELD(buf,wakeGpio));
+    }
+  if (flags&BINARY_FLAG_SUMMARY)
+    printf(", \"summary\":{\"samples\":%u, \"vccMin\":%.2f, \"vccMax\":%.2f}",
+           FIELD(buf,samples),FIELD(buf,vccMin)/1000.0,FIELD(buf,vccMax)/1000.0);
+  printf("}\n");
+  }
+
+static int hexValue(char c)
+  {
+  if (c>='0' && c<='9') return c-'0';
+  if (c>='a' && c<='f') return c-'a'+10;
+  if (c>='A' && c<='F') return c-'A'+10;
+  return -1;
+  }
+
+int main(int argc, char* argv[])
+  {
+  uint8_t buf[256];
+  int bad=0;
+
+  if (argc>1) //hex payloads on the command line
+    {
+    for (int a=1;a<argc;a++)
+      {
+      size_t len=strlen(argv[a])/2;
+      if (len>sizeof(buf))
+        len=sizeof(buf);
+      bool ok=true;
+      for (size_t i=0;i<len && ok;i++)
+        {
+        int hi=hexValue(argv[a][2*i]);
+        int lo=hexValue(argv[a][2*i+1]);
+        ok=hi>=0 && lo>=0;
+        buf[i]=(uint8_t)(hi<<4|lo);
+        }
+      size_t size=len>0?reportSize(buf[0]):0;
+      if (!ok || size==0 || len<size)
+        {
+        fprintf(stderr,"Argument %d is not a binary report I know\n",a);
+        bad++;
+        }
+      else
+        printReport(buf);
+      }
+    return bad?1:0;
+    }
+
+  int version;
+  while ((version=getchar())!=EOF) //each report starts with its version, which says how long it is
+    {
+    size_t size=reportSize((uint8_t)version);
+    if (size==0)
+      {
+      fprintf(stderr,"Unknown report version %d, skipping a byte\n",version);
+      bad++;
+      continue;
+      }
+    buf[0]=(uint8_t)version;
+    if (fread(buf+1,1,size-1,stdin)!=size-1)
+      {
+      fprintf(stderr,"Report cut short\n");
+      return 1;
+      }
+    printReport(buf);
+    fflush(stdout);
+    }
+  return bad?1:0;
+  }
@@ -0,0 +1,206 @@
+/* Simulate nodes reporting to a gateway over an ESP-NOW link that loses frames.
+ *
+ * Build on the host from the repository root:
+ *   g++ -std=c++11 -Iinclude -o espNowSim tools/espNowSim.cpp src/espNowFrame.cpp
+ *
+ * Run it with the percentage of frames and of acknowledgements to lose, and
+ * optionally how many reports each node sends, how many nodes there are, and a
+ * random seed:
+ *   ./espNowSim 10 10
+ *   ./espNowSim 30 50 1000 20 7
+ *
+ * Nodes send the way the firmware does: each publish is put in a frame by
+ * espNowEncode() and sent up to ESPNOW_SEND_TRIES times with the same sequence
+ * number until the gateway acknowledges it. The gateway takes it apart with
+ * espNowDecode() and forwards it only if espNowIsNew() says it hasn't already.
+ * Every forwarded topic and payload is checked against what the node sent. It
+ * exits with 1 if anything was forwarded twice or came out different, or if a
+ * publish the node saw acknowledged was never forwarded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binaryReport.h"
+#include "espNowFrame.h"
+
+#define SIM_TOPIC_SIZE 40
+#define SIM_ROOT_SIZE 24
+#define SIM_PAYLOADS_PER_REPORT 2 //the binary report, and a status message
+
+typedef struct
+  {
+  uint8_t mac[ESPNOW_MAC_BYTES];
+  char topicRoot[SIM_ROOT_SIZE];
+  uint16_t sequence; //of the last frame sent, kept in RTC memory on a real node
+  } simNode;
+
+typedef struct
+  {
+  uint8_t node;
+  char topic[SIM_TOPIC_SIZE];
+  uint8_t payload[sizeof(binaryReport)];
+  size_t length;
+  bool acknowledged; //the node got an acknowledgement for it
+  uint8_t forwards; //times the gateway published it
+  bool mismatch; //what the gateway published wasn't what was sent
+  } simPublish;
+
+static uint32_t randomState=1;
+
+// xorshift, so a seed always gives the same run on any host
+static uint32_t nextRandom()
+  {
+  randomState^=randomState<<13;
+  randomState^=randomState>>17;
+  randomState^=randomState<<5;
+  return randomState;
+  }
+
+static bool lost(unsigned percent)
+  {
+  return nextRandom()%100<percent;
+  }
+
+// The gateway's side: what the receive callback and gatewayTask() do with a frame
+static void gatewayReceive(espNowSeen& seen, const uint8_t* mac, const uint8_t* frame, size_t length,
+                           simPublish& sent, unsigned& duplicates)
+  {
+  espNowMessage msg;
+  if (!espNowDecode(frame,length,msg))
+    {
+    sent.mismatch=true;
+    return;
+    }
+  if (!espNowIsNew(seen,mac,msg.sequence))
+    {
+    duplicates++;
+    return;
+    }
+  sent.forwards++;
+  if (strcmp(msg.topic,sent.topic)!=0
+      || msg.length!=sent.length
+      || memcmp(msg.payload,sent.payload,sent.length)!=0)
+    sent.mismatch=true;
+  }
+
+int main(int argc, char* argv[])
+  {
+  unsigned frameLoss=argc>1?atoi(argv[1]):10;
+  unsigned ackLoss=argc>2?atoi(argv[2]):10;
+  unsigned reports=argc>3?atoi(argv[3]):200;
+  unsigned nodeCount=argc>4?atoi(argv[4]):4;
+  randomState=argc>5?atoi(argv[5]):1;
+  if (randomState==0)
+    randomState=1;
+  if (nodeCount==0 || nodeCount>255 || frameLoss>100 || ackLoss>100)
+    {
+    fprintf(stderr,"Usage: %s [frameLoss%%] [ackLoss%%] [reports] [nodes 1-255] [seed]\n",argv[0]);
+    return 2;
+    }
+
+  simNode* nodes=(simNode*)calloc(nodeCount,sizeof(simNode));
+  size_t total=(size_t)reports*nodeCount*SIM_PAYLOADS_PER_REPORT;
+  simPublish* sent=(simPublish*)calloc(total,sizeof(simPublish));
+  if (!nodes || !sent)
+    {
+    fprintf(stderr,"Out of memory\n");
+    return 2;
+    }
+  for (unsigned n=0;n<nodeCount;n++)
+    {
+    const uint8_t mac[ESPNOW_MAC_BYTES]={0x5C,0xCF,0x7F,0x00,(uint8_t)(n>>8),(uint8_t)n};
+    memcpy(nodes[n].mac,mac,sizeof(mac));
+    snprintf(nodes[n].topicRoot,sizeof(nodes[n].topicRoot),"sim/node%u/",n);
+    nodes[n].sequence=(uint16_t)nextRandom(); //as after a power up
+    }
+
+  espNowSeen seen;
+  memset(&seen,0,sizeof(seen));
+  unsigned frames=0, framesLost=0, acksLost=0, duplicates=0;
+  size_t count=0;
+
+  // The nodes take turns waking, the way their reports would interleave at the gateway
+  for (unsigned r=0;r<reports;r++)
+    {
+    for (unsigned n=0;n<nodeCount;n++)
+      {
+      binaryReport bin;
+      memset(&bin,0,sizeof(bin));
+      bin.version=BINARY_REPORT_VERSION;
+      bin.flags=BINARY_FLAG_FULL;
+      bin.clockSeconds=r;
+      bin.levels=nextRandom()&1;
+      bin.activeMask=1;
+
+      simPublish& report=sent[count++];
+      report.node=n;
+      snprintf(report.topic,sizeof(report.topic),"%s%s",nodes[n].topicRoot,"bin");
+      memcpy(report.payload,&bin,sizeof(bin));
+      report.length=sizeof(bin);
+
+      simPublish& status=sent[count++];
+      status.node=n;
+      snprintf(status.topic,sizeof(status.topic),"%s%s",nodes[n].topicRoot,"status");
+      const char* text=bin.levels?"tripped":"armed";
+      memcpy(status.payload,text,strlen(text));
+      status.length=strlen(text);
+
+      for (size_t p=count-SIM_PAYLOADS_PER_REPORT;p<count;p++)
+        {
+        simPublish& pub=sent[p];
+        uint8_t frame[ESPNOW_MAX_FRAME];
+        size_t size=espNowEncode(frame,sizeof(frame),++nodes[n].sequence,false,
+                                 pub.topic,pub.payload,pub.length);
+        if (size==0)
+          {
+          fprintf(stderr,"%s doesn't fit in a frame\n",pub.topic);
+          return 2;
+          }
+        for (uint8_t t=0;t<ESPNOW_SEND_TRIES && !pub.acknowledged;t++)
+          {
+          frames++;
+          if (lost(frameLoss))
+            {
+            framesLost++;
+            continue;
+            }
+          gatewayReceive(seen,nodes[n].mac,frame,size,pub,duplicates);
+          if (lost(ackLoss))
+            acksLost++;
+          else
+            pub.acknowledged=true;
+          }
+        }
+      }
+    }
+
+  unsigned acknowledged=0, forwarded=0, forwardedTwice=0, missing=0, wrong=0, unconfirmed=0;
+  for (size_t p=0;p<count;p++)
+    {
+    simPublish& pub=sent[p];
+    acknowledged+=pub.acknowledged;
+    forwarded+=pub.forwards>0;
+    forwardedTwice+=pub.forwards>1;
+    wrong+=pub.mismatch;
+    if (pub.acknowledged && pub.forwards==0)
+      missing++;
+    if (!pub.acknowledged && pub.forwards>0) //got through, but every acknowledgement was lost
+      unconfirmed++;
+    }
+
+  printf("%u nodes, %u reports each, %u%% of frames and %u%% of acknowledgements lost\n",
+         nodeCount,reports,frameLoss,ackLoss);
+  printf("Publishes:  %zu sent, %u acknowledged, %u forwarded\n",count,acknowledged,forwarded);
+  printf("Frames:     %u sent, %u lost, %u acknowledgements lost, %.2f per publish\n",
+         frames,framesLost,acksLost,count?(double)frames/count:0.0);
+  printf("Gateway:    %u duplicates dropped\n",duplicates);
+  printf("Not acknowledged but forwarded anyway: %u\n",unconfirmed);
+  printf("Left for the node's next wake:        %zu\n",count-acknowledged);
+  bool ok=forwardedTwice==0 && wrong==0 && missing==0;
+  if (!ok)
+    printf("FAILED: %u forwarded twice, %u forwarded wrong, %u acknowledged but never forwarded\n",
+           forwardedTwice,wrong,missing);
+  free(sent);
+  free(nodes);
+  return ok?0:1;
+  }
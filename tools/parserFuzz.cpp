@@ -0,0 +1,416 @@
+/* Throw random and bulk command lines at the command parser on the host.
+ *
+ * Build on the host from the repository root:
+ *   g++ -std=c++11 -O2 -Iinclude -o parserFuzz tools/parserFuzz.cpp src/commandParser.cpp
+ * or, to have the compiler catch any read or write outside the line:
+ *   g++ -std=c++11 -g -fsanitize=address,undefined -Iinclude -o parserFuzz tools/parserFuzz.cpp src/commandParser.cpp
+ *
+ * Run it with the number of random lines and of bulk commands, and optionally
+ * a random seed:
+ *   ./parserFuzz
+ *   ./parserFuzz 5000000 2000000 7
+ *
+ * Random lines are mostly the characters the parser cares about ("=", ",",
+ * ":", spaces, line endings, digits and hex) with any other byte thrown in, a
+ * lot of them starting with a real command name. Each is in a block of its
+ * own size with no terminator, and is run through parseCommand() and then
+ * whatever processCommand() would do with that command's value. It checks that
+ * the line is never changed, that every view stays inside it, that copyView()
+ * never writes past its field, and that every value accepted is what the text
+ * says. The bulk run is a configuration script pasted many times over, split
+ * into lines and handled the same way, and is timed. It exits with 1 if any
+ * check failed.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "commandParser.h"
+
+#define FUZZ_MAX_LINE 256 //longer than the serial port accepts, SERIAL_LINE_SIZE
+#define FUZZ_GUARD 8 //bytes checked on each side of a field copyView() writes to
+#define FUZZ_GUARD_BYTE 0xA5
+#define FUZZ_ADDRESS_SIZE 30 //ADDRESS_SIZE, the most a backup broker host can be
+
+// How processCommand() handles the value of each command
+typedef enum
+  {
+  VALUE_NUMBER,
+  VALUE_BOOL,
+  VALUE_TEXT,
+  VALUE_MAC,
+  VALUE_FINGERPRINT,
+  VALUE_KEY,
+  VALUE_BROKER, //host or host:port
+  VALUE_PORTADD //gpio,highmessage,lowmessage,usepullup
+  } valueKind;
+
+typedef struct
+  {
+  const char* name;
+  valueKind kind;
+  uint32_t minValue; //for numbers
+  uint32_t maxValue;
+  size_t size; //for text, the field including its terminator
+  } commandSpec;
+
+static const commandSpec commands[]=
+  {
+  {"ssid",VALUE_TEXT,0,0,50},
+  {"wifipass",VALUE_TEXT,0,0,50},
+  {"broker",VALUE_TEXT,0,0,30},
+  {"port",VALUE_NUMBER,0,65535,0},
+  {"broker2",VALUE_BROKER,0,0,36},
+  {"topicroot",VALUE_TEXT,0,0,150},
+  {"user",VALUE_TEXT,0,0,50},
+  {"pass",VALUE_TEXT,0,0,50},
+  {"reportinterval",VALUE_NUMBER,0,UINT32_MAX,0},
+  {"debug",VALUE_BOOL,0,0,0},
+  {"changeonly",VALUE_BOOL,0,0,0},
+  {"fullsync",VALUE_NUMBER,0,65535,0},
+  {"samples",VALUE_NUMBER,1,255,0},
+  {"cachettl",VALUE_NUMBER,0,UINT32_MAX,0},
+  {"awakebudget",VALUE_NUMBER,0,3600,0},
+  {"tlsfingerprint",VALUE_FINGERPRINT,0,0,60},
+  {"espnowgateway",VALUE_MAC,0,0,18},
+  {"espnowchannel",VALUE_NUMBER,0,14,0},
+  {"espnowkey",VALUE_KEY,0,0,48},
+  {"portadd",VALUE_PORTADD,0,16,15},
+  {"portremove",VALUE_NUMBER,0,16,0},
+  };
+#define COMMAND_COUNT (sizeof(commands)/sizeof(commands[0]))
+
+// A configuration script like one pasted into the serial monitor
+static const char* const script[]=
+  {
+  "ssid=workshop",
+  "wifipass=correct horse=battery staple",
+  "broker=192.168.1.20",
+  "port=1883",
+  "broker2=backup.local:8883",
+  "topicroot=house/garage/door/",
+  "user=sensors",
+  "pass=NULL",
+  "reportinterval=3600",
+  "debug=0",
+  "changeonly=1",
+  "fullsync=24",
+  "samples=4",
+  "cachettl=86400",
+  "awakebudget=20",
+  "tlsfingerprint=AB:CD:EF:01:23:45:67:89:AB:CD:EF:01:23:45:67:89:AB:CD:EF:01",
+  "espnowgateway=5c:cf:7f:12:34:56",
+  "espnowchannel=6",
+  "espnowkey=00112233445566778899aabbccddeeff",
+  "portadd=4,open,closed,1",
+  "portadd=14,tripped,armed",
+  "portremove=12",
+  "",
+  };
+#define SCRIPT_LINES (sizeof(script)/sizeof(script[0]))
+
+static uint32_t randomState=1;
+static unsigned failures=0;
+
+// xorshift, so a seed always gives the same run on any host
+static uint32_t nextRandom()
+  {
+  randomState^=randomState<<13;
+  randomState^=randomState>>17;
+  randomState^=randomState<<5;
+  return randomState;
+  }
+
+static void fail(const char* what, const char* line, size_t length)
+  {
+  if (failures++<10)
+    printf("FAILED: %s in \"%.*s\"\n",what,(int)length,line);
+  }
+
+static bool inside(textView view, const char* line, size_t length)
+  {
+  return view.length==0 || (view.text>=line && view.text+view.length<=line+length);
+  }
+
+// What viewToUnsigned() should say, worked out the slow way
+static parseResult expectedUnsigned(textView view, uint32_t minValue, uint32_t maxValue, uint32_t& result)
+  {
+  if (view.length==0)
+    return PARSE_NO_VALUE;
+  for (size_t i=0;i<view.length;i++)
+    {
+    if (view.text[i]<'0' || view.text[i]>'9')
+      return PARSE_NOT_A_NUMBER;
+    }
+  size_t start=0;
+  while (start<view.length-1 && view.text[start]=='0')
+    start++;
+  if (view.length-start>10)
+    return PARSE_OUT_OF_RANGE;
+  char digits[11];
+  memcpy(digits,view.text+start,view.length-start);
+  digits[view.length-start]='\0';
+  unsigned long long value=strtoull(digits,NULL,10);
+  if (value>maxValue || value<minValue)
+    return PARSE_OUT_OF_RANGE;
+  result=(uint32_t)value;
+  return PARSE_OK;
+  }
+
+static parseResult checkNumber(textView view, uint32_t minValue, uint32_t maxValue, const char* line, size_t length)
+  {
+  uint32_t got=0, expected=0;
+  parseResult rc=viewToUnsigned(view,minValue,maxValue,got);
+  parseResult want=expectedUnsigned(view,minValue,maxValue,expected);
+  // It stops at the first digit that takes it over the maximum, so text that is
+  // both too big and not a number can get either error
+  if ((rc==PARSE_OK)!=(want==PARSE_OK) || (rc==PARSE_NO_VALUE)!=(want==PARSE_NO_VALUE))
+    fail("viewToUnsigned() gave the wrong result",line,length);
+  else if (rc==PARSE_OK && got!=expected)
+    fail("viewToUnsigned() gave the wrong number",line,length);
+  return rc;
+  }
+
+static parseResult checkCopy(textView view, size_t size, const char* line, size_t length)
+  {
+  unsigned char block[FUZZ_GUARD+FUZZ_MAX_LINE+FUZZ_GUARD];
+  memset(block,FUZZ_GUARD_BYTE,sizeof(block));
+  char* dest=(char*)block+FUZZ_GUARD;
+  parseResult rc=copyView(view,dest,size);
+  for (size_t i=0;i<FUZZ_GUARD;i++)
+    {
+    if (block[i]!=FUZZ_GUARD_BYTE || block[FUZZ_GUARD+size+i]!=FUZZ_GUARD_BYTE)
+      {
+      fail("copyView() wrote outside its field",line,length);
+      break;
+      }
+    }
+  bool cleared=viewIs(view,"NULL");
+  size_t expected=cleared?0:view.length;
+  if (rc==PARSE_OK && (dest[expected]!='\0' || memcmp(dest,view.text,expected)!=0))
+    fail("copyView() copied the wrong text",line,length);
+  if ((rc==PARSE_OK)!=(expected<size))
+    fail("copyView() accepted the wrong length",line,length);
+  return rc;
+  }
+
+// Do what processCommand() does with the value, checking each step
+static parseResult handleValue(const commandSpec& spec, textView val, const char* line, size_t length)
+  {
+  uint8_t bytes[FINGERPRINT_BYTES];
+  switch (spec.kind)
+    {
+    case VALUE_NUMBER:
+      return checkNumber(val,spec.minValue,spec.maxValue,line,length);
+    case VALUE_BOOL:
+      {
+      bool b;
+      parseResult rc=viewToBool(val,b);
+      if (rc!=checkNumber(val,0,1,line,length))
+        fail("viewToBool() and viewToUnsigned() disagree",line,length);
+      return rc;
+      }
+    case VALUE_TEXT:
+      return checkCopy(val,spec.size,line,length);
+    case VALUE_MAC:
+      if (!viewIs(val,"NULL") && !viewToMac(val,bytes))
+        return PARSE_BAD_MAC;
+      return checkCopy(val,spec.size,line,length);
+    case VALUE_FINGERPRINT:
+      if (!viewIs(val,"NULL") && !viewToFingerprint(val,bytes))
+        return PARSE_BAD_FINGERPRINT;
+      return checkCopy(val,spec.size,line,length);
+    case VALUE_KEY:
+      if (!viewIs(val,"NULL") && !viewToKey(val,bytes))
+        return PARSE_BAD_KEY;
+      return checkCopy(val,spec.size,line,length);
+    case VALUE_BROKER:
+      {
+      const char* colon=(const char*)memchr(val.text,':',val.length);
+      size_t hostLength=colon?(size_t)(colon-val.text):val.length;
+      if (hostLength>=FUZZ_ADDRESS_SIZE)
+        return PARSE_VALUE_TOO_LONG;
+      for (size_t i=0;i<hostLength;i++)
+        {
+        unsigned char ch=(unsigned char)val.text[i];
+        if (!isalnum(ch) && ch!='/' && ch!='.')
+          return PARSE_BAD_HOST;
+        }
+      if (colon)
+        {
+        parseResult rc=checkNumber({colon+1,val.length-(size_t)(colon-val.text)-1},1,65535,line,length);
+        if (rc!=PARSE_OK)
+          return rc;
+        }
+      return checkCopy(val,spec.size,line,length);
+      }
+    case VALUE_PORTADD:
+      {
+      textView rest=val, field;
+      textView fields[4]={{NULL,0},{NULL,0},{NULL,0},{NULL,0}};
+      size_t count=0;
+      while (nextField(rest,',',field))
+        {
+        if (!inside(field,line,length))
+          fail("nextField() went outside the line",line,length);
+        if (count<4)
+          fields[count]=field;
+        if (++count>val.length+1)
+          {
+          fail("nextField() didn't stop",line,length);
+          break;
+          }
+        }
+      size_t commas=0;
+      for (size_t i=0;i<val.length;i++)
+        commas+=val.text[i]==',';
+      if (count!=commas+1)
+        fail("nextField() found the wrong number of fields",line,length);
+      parseResult rc=checkNumber(fields[0],spec.minValue,spec.maxValue,line,length);
+      if (rc==PARSE_OK && fields[1].length>0)
+        rc=checkCopy(fields[1],spec.size,line,length);
+      if (rc==PARSE_OK && fields[2].length>0)
+        rc=checkCopy(fields[2],spec.size,line,length);
+      return rc;
+      }
+    }
+  return PARSE_UNKNOWN_COMMAND;
+  }
+
+// Parse one line the way processCommand() does. The line is never null terminated.
+static parseResult handleLine(const char* line, size_t length)
+  {
+  command cmd;
+  parseResult rc=parseCommand(line,length,cmd);
+  if (!inside(cmd.name,line,length) || !inside(cmd.value,line,length))
+    fail("parseCommand() returned a view outside the line",line,length);
+  if (rc!=PARSE_OK)
+    return rc;
+  if (cmd.name.length>=MAX_COMMAND_SIZE)
+    fail("parseCommand() accepted a name that is too long",line,length);
+  for (size_t i=0;i<COMMAND_COUNT;i++)
+    {
+    if (viewIs(cmd.name,commands[i].name))
+      return handleValue(commands[i],cmd.value,line,length);
+    }
+  return PARSE_UNKNOWN_COMMAND;
+  }
+
+// Mostly the characters that matter to the parser
+static char randomChar()
+  {
+  static const char interesting[]="=,: \t\r\n0123456789abcdefABCDEF:NUL";
+  uint32_t r=nextRandom();
+  if (r%8==0)
+    return (char)(r>>8);
+  return interesting[(r>>8)%(sizeof(interesting)-1)];
+  }
+
+static size_t randomLine(char* buf)
+  {
+  size_t length=0;
+  if (nextRandom()%4!=0) //start with a real command name most of the time
+    {
+    const char* name=commands[nextRandom()%COMMAND_COUNT].name;
+    length=strlen(name);
+    memcpy(buf,name,length);
+    if (nextRandom()%8!=0)
+      buf[length++]='=';
+    }
+  size_t extra=nextRandom()%(FUZZ_MAX_LINE-length+1);
+  if (nextRandom()%2) //short values find the edge cases, long ones the limits
+    extra%=24;
+  for (size_t i=0;i<extra;i++)
+    buf[length++]=randomChar();
+  return length;
+  }
+
+static double secondsSince(const struct timespec& start)
+  {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (now.tv_sec-start.tv_sec)+(now.tv_nsec-start.tv_nsec)/1e9;
+  }
+
+int main(int argc, char* argv[])
+  {
+  unsigned long lines=argc>1?strtoul(argv[1],NULL,10):1000000;
+  unsigned long bulk=argc>2?strtoul(argv[2],NULL,10):1000000;
+  randomState=argc>3?strtoul(argv[3],NULL,10):1;
+  if (randomState==0)
+    randomState=1;
+
+  unsigned long results[PARSE_LIST_FULL+1]={0};
+  char buf[FUZZ_MAX_LINE];
+  for (unsigned long n=0;n<lines;n++)
+    {
+    size_t length=randomLine(buf);
+    char* line=(char*)malloc(length?length:1); //exactly the line, so a sanitizer sees any read past it
+    char* before=(char*)malloc(length?length:1);
+    if (!line || !before)
+      {
+      fprintf(stderr,"Out of memory\n");
+      return 2;
+      }
+    memcpy(line,buf,length);
+    memcpy(before,buf,length);
+    results[handleLine(line,length)]++;
+    if (memcmp(line,before,length)!=0)
+      fail("the parser changed the line",before,length);
+    free(before);
+    free(line);
+    }
+  printf("%lu random lines\n",lines);
+  for (int r=PARSE_OK;r<=PARSE_LIST_FULL;r++)
+    {
+    if (results[r])
+      printf("  %-38s %lu\n",parseResultText((parseResult)r),results[r]);
+    }
+
+  // One block holding the script over and over, one command per line
+  size_t scriptSize=0;
+  for (size_t i=0;i<SCRIPT_LINES;i++)
+    scriptSize+=strlen(script[i])+2;
+  size_t repeats=(bulk+SCRIPT_LINES-1)/SCRIPT_LINES;
+  size_t total=scriptSize*repeats;
+  char* block=(char*)malloc(total+1); //sprintf() terminates it
+  if (!block)
+    {
+    fprintf(stderr,"Out of memory\n");
+    return 2;
+    }
+  size_t used=0;
+  for (size_t r=0;r<repeats;r++)
+    {
+    for (size_t i=0;i<SCRIPT_LINES;i++)
+      used+=sprintf(block+used,"%s\r\n",script[i]);
+    }
+
+  unsigned long handled=0, rejected=0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  const char* next=block;
+  const char* end=block+used;
+  while (next<end)
+    {
+    const char* newline=(const char*)memchr(next,'\n',end-next);
+    size_t length=newline?newline-next+1:end-next;
+    parseResult rc=handleLine(next,length);
+    if (rc!=PARSE_OK && rc!=PARSE_EMPTY)
+      {
+      rejected++;
+      fail("a command in the script was rejected",next,length);
+      }
+    handled++;
+    next+=length;
+    }
+  double seconds=secondsSince(start);
+  printf("%lu script commands, %zu bytes in %.3f s: %.0f commands/s, %.1f MB/s\n",
+         handled,used,seconds,seconds>0?handled/seconds:0.0,seconds>0?used/seconds/1e6:0.0);
+  free(block);
+
+  if (failures)
+    printf("%u checks failed\n",failures);
+  return failures?1:0;
+  }